@@ -32,6 +32,11 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
 ////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "util/ThreadPool.h"
+#include "util/FastMath.h"
 #include "Types.h"
 #include "NgramModel.h"
 #include "NgramLM.h"
@@ -39,31 +44,43 @@
 
 namespace mitlm {
 
+const uint64_t InterpolatedNgramLM::kNoEstimate;
+const size_t   InterpolatedNgramLM::kTileSize;
+
+static std::atomic<uint64_t> nextMaskId(1);
+
+static bool SameParams(const ParamVector &x, const ParamVector &y) {
+    if (x.length() != y.length())
+        return false;
+    for (size_t i = 0; i < x.length(); ++i)
+        if (x[i] != y[i])
+            return false;
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void
 InterpolatedNgramLM::LoadLMs(const vector<SharedPtr<NgramLMBase> > &lms) {
     _lms = lms;
 
-    // Build merged NgramModel and sort.
-    vector<VocabVector>          vocabMaps(_lms.size());
-    vector<vector<IndexVector> > ngramMaps(_lms.size());
+    // Build sorted merged NgramModel.
+    vector<const NgramModel *>   models(_lms.size());
+    vector<VocabVector>          vocabMaps;
+    vector<vector<IndexVector> > ngramMaps;
     for (size_t l = 0; l < _lms.size(); l++)
-        _pModel->ExtendModel(_lms[l]->model(), vocabMaps[l], ngramMaps[l]);
-
-    // Sort n-grams.
-    VocabVector         vocabSortMap;
-    vector<IndexVector> ngramSortMap;
-    _pModel->SortModel(vocabSortMap, ngramSortMap);
+        models[l] = &_lms[l]->model();
+    _pModel->MergeModels(models, vocabMaps, ngramMaps);
 
     // Update component LMs to use sorted merged NgramModel.
-    for (size_t l = 0; l < _lms.size(); l++) {
-        VocabVector         vocabMap = vocabSortMap[vocabMaps[l]];
-        vector<IndexVector> ngramMap(ngramMaps[l].size());
-        for (size_t o = 1; o < ngramMaps[l].size(); o++)
-            ngramMap[o] = ngramSortMap[o][ngramMaps[l][o]];
-        _lms[l]->SetModel(_pModel, vocabMap, ngramMap);
-    }
+    for (size_t l = 0; l < _lms.size(); l++)
+        _lms[l]->SetModel(_pModel, vocabMaps[l], ngramMaps[l]);
+
+    // No estimates are cached for the new model.
+    _lmParams.resize(_lms.size());
+    _lmMaskIds.assign(_lms.size(), kNoEstimate);
+    _lmDirty.reset(_lms.size(), 1);
+    _mixMaskId = kNoEstimate;
 
     // Allocate and initialize variables.
     size_t maxLen = 0;
@@ -91,35 +108,59 @@ InterpolatedNgramLM::LoadLMs(const vector<SharedPtr<NgramLMBase> > &lms) {
     builder.append(0, (_lms.size() - 1) * (_tieParamOrder ? 1 : order()));
     _defParams = builder;
 
-    _featureList.resize(lms.size());
+    // Features index the n-grams of the previous model.
+    _lmNumFeatures.assign(lms.size(), 0);
+    _featureMatrix.clear();
+    _numFeatures = 0;
 }
 
 void
 InterpolatedNgramLM::SetInterpolation(Interpolation interpolation,
                                       const vector<vector<FeatureVectors> > &featureList)
 {
-    // Make an attached clone of featureList.
-    _featureList.resize(featureList.size());
+    // Copy the features of each order into a tiled matrix, so that the
+    // weights of a tile of histories are computed from contiguous columns.
+    // Only this float copy is kept, and the caller may release featureList.
+    _lmNumFeatures.resize(featureList.size());
+    _numFeatures = 0;
     for (size_t l = 0; l < featureList.size(); ++l) {
-        _featureList[l].resize(featureList[l].size());
-        for (size_t f = 0; f < featureList[l].size(); ++f) {
-            _featureList[l][f].resize(featureList[l][f].size());
-            for (size_t o = 0; o < featureList[l][f].size(); ++o)
-                _featureList[l][f][o].attach(featureList[l][f][o]);
+        _lmNumFeatures[l] = featureList[l].size();
+        _numFeatures += featureList[l].size();
+    }
+    _featureMatrix.clear();
+    if (_numFeatures > 0) {
+        _featureMatrix.resize(_order);
+        for (size_t o = 0; o < _order; ++o) {
+            size_t       len = sizes(o);
+            FloatVector &matrix(_featureMatrix[o]);
+            matrix.reset((len + kTileSize - 1) / kTileSize * kTileSize *
+                         _numFeatures, 0);
+            size_t k = 0;
+            for (size_t l = 0; l < featureList.size(); ++l) {
+                for (size_t f = 0; f < featureList[l].size(); ++f, ++k) {
+                    const DoubleVector &feature(featureList[l][f][o]);
+                    if (feature.length() != len)
+                        throw std::runtime_error("Feature does not match "
+                                                 "the interpolated model.");
+                    for (size_t i = 0; i < len; ++i)
+                        matrix[_FeatureIndex(i, k)] = (float)feature[i];
+                }
+            }
         }
     }
 
     _interpolation = interpolation;
+    _mixMaskId     = kNoEstimate;
     switch (_interpolation) {
     case LinearInterpolation:
-        for (size_t l = 0; l < _featureList.size(); ++l)
-            assert(_featureList[l].size() == 0);
+        for (size_t l = 0; l < _lmNumFeatures.size(); ++l)
+            assert(_lmNumFeatures[l] == 0);
         break;
     case CountMerging:
         {
-            assert(_featureList.size() == _lms.size());
-            for (size_t l = 0; l < _featureList.size(); ++l)
-                assert(_featureList[l].size() == 1);
+            assert(_lmNumFeatures.size() == _lms.size());
+            for (size_t l = 0; l < _lmNumFeatures.size(); ++l)
+                assert(_lmNumFeatures[l] == 1);
 
             Range  r(_defParams.length());
             size_t numParams = r.length() +
@@ -132,21 +173,21 @@ InterpolatedNgramLM::SetInterpolation(Interpolation interpolation,
         break;
     case GeneralizedLinearInterpolation:
         {
-            assert(_featureList.size() == _lms.size());
+            assert(_lmNumFeatures.size() == _lms.size());
 
             Range  r(_defParams.length());
             size_t numParams = 0;
             if (_tieParamLM) {
-                numParams = _featureList[0].size();
-                for (size_t l = 1; l < _featureList.size(); ++l) {
-                    if (_featureList[l].size() != numParams) {
+                numParams = _lmNumFeatures[0];
+                for (size_t l = 1; l < _lmNumFeatures.size(); ++l) {
+                    if (_lmNumFeatures[l] != numParams) {
                         throw std::runtime_error("TieParamLM requires "
                             "consistent number of features across LMs.");
                     }
                 }
             } else {
-                for (size_t l = 0; l < _featureList.size(); ++l)
-                    numParams += _featureList[l].size();
+                for (size_t l = 0; l < _lmNumFeatures.size(); ++l)
+                    numParams += _lmNumFeatures[l];
             }
             if (!_tieParamOrder) numParams *= order();
             numParams += r.length();
@@ -162,8 +203,12 @@ InterpolatedNgramLM::SetInterpolation(Interpolation interpolation,
 Mask *
 InterpolatedNgramLM::GetMask(vector<BitVector> &probMaskVectors,
                              vector<BitVector> &bowMaskVectors) const {
+    if (_pruned)
+        return NgramLMBase::GetMask(probMaskVectors, bowMaskVectors);
+
     // Extend prob and bow masks.
     InterpolatedNgramLMMask *pMask = new InterpolatedNgramLMMask();
+    pMask->Id = nextMaskId++;
     pMask->ProbMaskVectors.resize(_order + 1);
     pMask->BowMaskVectors.resize(_order);
     pMask->WeightMaskVectors.resize(_order);
@@ -193,12 +238,33 @@ InterpolatedNgramLM::GetMask(vector<BitVector> &probMaskVectors,
         IndexVector hoHists(this->hists(o + 1));
 
         // weightMasks[hoHists] |= hoProbMasks;
-        weightMasks.resize(sizes(o));
+        weightMasks.reset(sizes(o), 0);
         for (size_t i = 0; i < hoProbMasks.length(); ++i)
             if (hoProbMasks[i])
                 weightMasks[hoHists[i]] = 1;
     }
 
+    // Sparse components compute the masked probabilities from those of their
+    // backoffs, so list the masked n-grams along with their backoffs.
+    if (_AnySparse()) {
+        pMask->SparseNgramVectors.resize(_order + 1);
+        BitVector masks, boMasks;
+        masks = pMask->ProbMaskVectors[_order];
+        for (size_t o = _order; o > 0; --o) {
+            const IndexVector &backoffs(this->backoffs(o));
+            boMasks = pMask->ProbMaskVectors[o - 1];
+            VectorBuilder<NgramIndex> builder;
+            for (size_t i = 0; i < masks.length(); ++i) {
+                if (masks[i]) {
+                    builder.append(i);
+                    boMasks[backoffs[i]] = 1;
+                }
+            }
+            pMask->SparseNgramVectors[o] = builder;
+            masks.swap(boMasks);
+        }
+    }
+
     // Compute filter for each component LM.
     pMask->LMMasks.resize(_lms.size());
     for (size_t l = 0; l < _lms.size(); ++l) {
@@ -210,6 +276,13 @@ InterpolatedNgramLM::GetMask(vector<BitVector> &probMaskVectors,
 
 bool
 InterpolatedNgramLM::Estimate(const ParamVector &params, Mask *pMask) {
+    // The components no longer match the model of a pruned LM.
+    if (_pruned)
+        return NgramLMBase::Estimate(params, pMask);
+
+    // Estimation rewrites probs() and bows(), so drop their quantized copy.
+    _ClearQuantized();
+
     // Map parameters.
     if (_paramMask.length()) {
         const Param *p = params.begin();
@@ -221,24 +294,45 @@ InterpolatedNgramLM::Estimate(const ParamVector &params, Mask *pMask) {
         _paramDefaults = params;
     }
 
-    // Estimate component LMs.
+    // Estimate component LMs.  Components only share the read-only merged
+    // model, so they are estimated concurrently.  Most optimizer probes
+    // only change interpolation parameters, so components whose parameters
+    // are unchanged since an estimate covering the mask are skipped.
     InterpolatedNgramLMMask *pLMMask = (InterpolatedNgramLMMask *)pMask;
-    for (size_t l = 0; l < _lms.size(); ++l) {
+    uint64_t maskId = pLMMask ? pLMMask->Id : 0;
+    ThreadPool::Run(_lms.size(), [&](size_t l) {
         ParamVector lmParams(_paramDefaults[Range(_paramStarts[l],
                                                   _paramStarts[l+1])]);
-        _lms[l]->Estimate(lmParams, pLMMask ? pLMMask->LMMasks[l].get() : NULL);
-    }
-
-    // Interpolate weighted probabilities and normalize backoff weights.
+        if (_IsCached(_lmMaskIds[l], maskId) && SameParams(_lmParams[l],
+                                                           lmParams))
+            return;
+        bool success = _lms[l]->Estimate(
+            lmParams, pLMMask ? pLMMask->LMMasks[l].get() : NULL);
+        _lmParams[l]  = lmParams;
+        _lmMaskIds[l] = success ? maskId : kNoEstimate;
+        _lmDirty[l]   = 1;
+    });
+
+    // Interpolate weighted probabilities and normalize backoff weights,
+    // unless neither the components nor the interpolation changed.
     ParamVector interpolationParams(_paramDefaults[
         Range(_paramStarts[_lms.size()], _paramDefaults.length())]);
-    if (pLMMask != NULL) {
+    if (!anyTrue(_lmDirty) && _IsCached(_mixMaskId, maskId) &&
+        SameParams(_mixParams, interpolationParams))
+        return true;
+    if (_AnySparse())
+        _EstimateSparseProbs(interpolationParams, pLMMask);
+    else if (pLMMask != NULL)
         _EstimateProbsMasked(interpolationParams, pLMMask);
-        _EstimateBowsMasked(pLMMask);
-    } else {
+    else
         _EstimateProbs(interpolationParams);
+    if (pLMMask != NULL)
+        _EstimateBowsMasked(pLMMask);
+    else
         _EstimateBows();
-    }
+    _mixParams = interpolationParams;
+    _mixMaskId = maskId;
+    _lmDirty.set(0);
     return true;
 }
 
@@ -247,62 +341,171 @@ InterpolatedNgramLM::_EstimateProbs(const ParamVector &params) {
     const Param *pBiasParams = &params[0];
     const Param *pFeatParams = &params[(_lms.size() - 1) * 
                                        (_tieParamOrder ? 1 : order())];
+    vector<Param>         biases(_lms.size());
+    vector<Param>         flatParams(_numFeatures);
+    vector<const Prob *>  lmProbs(_lms.size());
     for (size_t o = 1; o <= _order; o++) {
-        Range              r(sizes(o - 1));
-        ProbVector         weights(_weights[r]);
-        ProbVector         totWeights(_totWeights[r]);
         ProbVector &       probs(_probVectors[o]);
         const IndexVector &hists(this->hists(o));
+        _UnpackOrderParams(params, pBiasParams, pFeatParams,
+                           biases, flatParams);
+        for (size_t l = 0; l < _lms.size(); l++)
+            lmProbs[l] = _lms[l]->probs(o).begin();
+
+        // Compute the component weights of each tile of histories from the
+        // log-linear combination of features, then interpolate the component
+        // probabilities of the n-grams of the tile, which are contiguous, in
+        // one branch-free pass.  Without features, every slot of a tile has
+        // the same weights, so one tile covers all n-grams.
+        size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            vector<Param> weights(_lms.size() * kTileSize);
+            vector<Param> totWeights(kTileSize);
+            NgramIndex    tileEnd = 0;
+            for (size_t i = nBegin; i < nEnd; ++i) {
+                NgramIndex h = hists[i];
+                if (h >= tileEnd) {
+                    size_t tile = h / kTileSize;
+                    _ComputeTileWeights(o - 1, tile, biases, flatParams,
+                                        &weights[0], &totWeights[0]);
+                    tileEnd = (_numFeatures == 0) ?
+                        std::numeric_limits<NgramIndex>::max() :
+                        (NgramIndex)((tile + 1) * kTileSize);
+                }
+                size_t b = h % kTileSize;
+                Prob   prob = 0;
+                for (size_t l = 0; l < _lms.size(); l++)
+                    prob += lmProbs[l][i] * weights[l * kTileSize + b];
+                probs[i] = prob / totWeights[b];
+            }
+        });
+        assert(allTrue(hists >= 0));
+        assert(!anyTrue(isnan(probs)));
+    }
+}
 
-        totWeights.set(0);
-        probs.set(0);
-        if (_tieParamOrder) {
-            pBiasParams = &params[0];
-            pFeatParams = &params[_lms.size() - 1];
+// Interpolates the probabilities like _EstimateProbs(), or within pMask like
+// _EstimateProbsMasked(), when some components are sparse.  A sparse component
+// has no dense probabilities to index, so the components are mixed one at a
+// time: each sparse component computes the probabilities of each order from
+// those of the order below, filling the gaps between its explicit n-grams with
+// a single backoff.  The weighted probabilities and total weights accumulate in
+// the same order as in _EstimateProbs(), so the results are identical.
+void
+InterpolatedNgramLM::_EstimateSparseProbs(const ParamVector &params,
+                                          InterpolatedNgramLMMask *pMask) {
+    const Param *pBiasParams = &params[0];
+    const Param *pFeatParams = &params[(_lms.size() - 1) * 
+                                       (_tieParamOrder ? 1 : order())];
+    vector<vector<Param> > biases(_order + 1);
+    vector<vector<Param> > flatParams(_order + 1);
+    _lmOrderProbs.resize(_order + 1);
+    _histWeights.resize(_order + 1);
+    for (size_t o = 1; o <= _order; o++) {
+        ProbVector &       probs(_probVectors[o]);
+        ProbVector &       weights(_histWeights[o]);
+        const IndexVector &hists(this->hists(o));
+        biases[o].resize(_lms.size());
+        flatParams[o].resize(_numFeatures);
+        _UnpackOrderParams(params, pBiasParams, pFeatParams,
+                           biases[o], flatParams[o]);
+        weights.reset(sizes(o - 1));
+        if (pMask == NULL) {
+            probs = 0;
+            weights = 0;
+            continue;
         }
-        const Param *pLMFeatParams = pFeatParams;
-        for (size_t l = 0; l < _lms.size(); l++) {
-            if (_tieParamLM)
-                pFeatParams = pLMFeatParams;
-
-            // Initialize weights with bias.
-            weights.set((l == 0) ? 0 : *pBiasParams++);
-
-            // Compute weights from log-linear combination of features.
-            for (size_t f = 0; f < _featureList[l].size(); f++) {
-                Param param = *pFeatParams++;
-                if (param == 0) continue;
-                // weights += _featureList[l][f][o-1] * param;
-                for (size_t i = 0; i < _probVectors[o-1].length(); ++i)
-                    weights[i] += _featureList[l][f][o-1][i] * param;
+        const IndexVector &ngrams(pMask->SparseNgramVectors[o]);
+        const BitVector &  probMask(pMask->ProbMaskVectors[o]);
+        for (size_t k = 0; k < ngrams.length(); ++k) {
+            if (probMask[ngrams[k]]) {
+                probs[ngrams[k]] = 0;
+                weights[hists[ngrams[k]]] = 0;
             }
+        }
+    }
 
-            // Compute component weights and update total weights.
-            // weights = exp(weights);
-            // totWeights += weights;
-            for (size_t i = 0; i < weights.length(); ++i) {
-                weights[i] = std::exp(weights[i]);
-                totWeights[i] += weights[i];
+    // Accumulate the weighted probabilities of each component.  With a mask,
+    // sparse components only compute the masked n-grams and their backoffs.
+    for (size_t l = 0; l < _lms.size(); l++) {
+        const NgramLMBase &lm(*_lms[l]);
+        if (lm.sparse())
+            _lmOrderProbs[0].reset(1, lm.GetProb(0, 0));
+        for (size_t o = 1; o <= _order; o++) {
+            ProbVector &       probs(_probVectors[o]);
+            ProbVector &       weights(_histWeights[o]);
+            const IndexVector &hists(this->hists(o));
+            const Prob *       lmProbs;
+            if (lm.sparse()) {
+                lm.GetOrderProbs(o, _lmOrderProbs[o - 1], _lmOrderProbs[o],
+                    pMask ? &pMask->SparseNgramVectors[o] : NULL);
+                lmProbs = _lmOrderProbs[o].begin();
+            } else
+                lmProbs = lm.probs(o).begin();
+
+            if (pMask != NULL) {
+                const IndexVector &ngrams(pMask->SparseNgramVectors[o]);
+                const BitVector &  probMask(pMask->ProbMaskVectors[o]);
+                NgramIndex         h = NgramVector::Invalid;
+                Param              weight = 0;
+                for (size_t k = 0; k < ngrams.length(); ++k) {
+                    NgramIndex i = ngrams[k];
+                    if (!probMask[i]) continue;
+                    if (hists[i] != h) {
+                        h = hists[i];
+                        weight = _ComputeHistoryWeight(
+                            o - 1, h, l, biases[o], flatParams[o]);
+                        weights[h] += weight;
+                    }
+                    probs[i] += lmProbs[i] * weight;
+                }
+                continue;
             }
+            size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 14);
+            ThreadPool::Run(numChunks, [&](size_t c) {
+                size_t hBegin, hEnd, nBegin, nEnd;
+                _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+                for (size_t i = nBegin; i < nEnd;) {
+                    NgramIndex h = hists[i];
+                    Param weight = _ComputeHistoryWeight(
+                        o - 1, h, l, biases[o], flatParams[o]);
+                    weights[h] += weight;
+                    for (; i < nEnd && hists[i] == h; ++i)
+                        probs[i] += lmProbs[i] * weight;
+                }
+            });
+        }
+    }
 
-            // Interpolate component LM probabilities.
-            //probs += _lms[l]->probs(o) * weights[hists];
-            const ProbVector &lmProbs(_lms[l]->probs(o));
+    // Normalize by the total weight of each history.
+    for (size_t o = 1; o <= _order; o++) {
+        ProbVector &       probs(_probVectors[o]);
+        const ProbVector & weights(_histWeights[o]);
+        const IndexVector &hists(this->hists(o));
+        if (pMask == NULL) {
             for (size_t i = 0; i < probs.length(); ++i)
-                probs[i] += lmProbs[i] * weights[hists[i]];
+                probs[i] /= weights[hists[i]];
+            assert(!anyTrue(isnan(probs)));
+            continue;
         }
-        assert(allTrue(totWeights != 0));
-        assert(!anyTrue(isnan(probs)));
-        assert(allTrue(hists >= 0));
-
-        // Normalize probabilities.
-        //probs /= totWeights[hists];
-        for (size_t i = 0; i < probs.length(); ++i)
-            probs[i] /= totWeights[hists[i]];
-        assert(!anyTrue(isnan(probs)));
+        const IndexVector &ngrams(pMask->SparseNgramVectors[o]);
+        const BitVector &  probMask(pMask->ProbMaskVectors[o]);
+        for (size_t k = 0; k < ngrams.length(); ++k)
+            if (probMask[ngrams[k]])
+                probs[ngrams[k]] /= weights[hists[ngrams[k]]];
     }
 }
 
+bool
+InterpolatedNgramLM::_AnySparse() const {
+    for (size_t l = 0; l < _lms.size(); l++)
+        if (_lms[l]->sparse())
+            return true;
+    return false;
+}
+
 void
 InterpolatedNgramLM::_EstimateBows() {
     for (size_t o = 1; o <= _order; o++) {
@@ -311,19 +514,22 @@ InterpolatedNgramLM::_EstimateBows() {
         const ProbVector & boProbs(this->probs(o - 1));
         const IndexVector &hists(this->hists(o));
         const IndexVector &backoffs(this->backoffs(o));
-
-        Range      r(sizes(o - 1));
-        ProbVector numerator(_weights[r]);       // Reuse buffers.
-        ProbVector denominator(_totWeights[r]);  // Reuse buffers.
-        numerator.set(0);
-        denominator.set(0);
-
-        for (size_t i = 0; i < probs.length(); ++i) {
-            numerator[hists[i]] += probs[i];
-            denominator[hists[i]] += boProbs[backoffs[i]];
-        }
-        for (size_t i = 0; i < bows.length(); ++i)
-            bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
+        ProbVector &       numerator(_weights);       // Reuse buffers.
+        ProbVector &       denominator(_totWeights);  // Reuse buffers.
+
+        size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            for (size_t i = hBegin; i < hEnd; ++i)
+                numerator[i] = denominator[i] = 0;
+            for (size_t i = nBegin; i < nEnd; ++i) {
+                numerator[hists[i]] += probs[i];
+                denominator[hists[i]] += boProbs[backoffs[i]];
+            }
+            for (size_t i = hBegin; i < hEnd; ++i)
+                bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
+        });
         assert(!anyTrue(isnan(bows)));
     }
 }
@@ -336,58 +542,45 @@ InterpolatedNgramLM::_EstimateProbsMasked(const ParamVector &params,
     const Param *pBiasParams = &params[0];
     const Param *pFeatParams = &params[(_lms.size() - 1) * 
                                        (_tieParamOrder ? 1 : order())];
+    vector<Param>         biases(_lms.size());
+    vector<Param>         flatParams(_numFeatures);
+    vector<const Prob *>  lmProbs(_lms.size());
     for (size_t o = 1; o <= _order; o++) {
-        Range              r(sizes(o - 1));
-        ProbVector         weights(_weights[r]);
-        ProbVector         totWeights(_totWeights[r]);
         ProbVector &       probs(_probVectors[o]);
         const IndexVector &hists(this->hists(o));
-
-        totWeights.set(0);
-        probs.set(0);
-        if (_tieParamOrder) {
-            pBiasParams = &params[0];
-            pFeatParams = &params[_lms.size() - 1];
-        }
-        const Param *pLMFeatParams = pFeatParams;
-        for (size_t l = 0; l < _lms.size(); ++l) {
-            if (_tieParamLM)
-                pFeatParams = pLMFeatParams;
-
-            // Initialize weights with bias.
-            weights.set((l == 0) ? 0 : *pBiasParams++);
-
-            // Compute weights from log-linear combination of features.
-            for (size_t f = 0; f < _featureList[l].size(); ++f) {
-                Param param = *pFeatParams++;
-                if (param == 0) continue;
-                for (size_t i = 0; i < _probVectors[o-1].length(); ++i)
-                    if (pMask->WeightMaskVectors[o-1][i])
-                        weights[i] += _featureList[l][f][o-1][i] * param;
-            }
-
-            // Compute component weights and update total weights.
-            //weights.mask(pMask->WeightMaskVectors[o - 1]) = exp(weights);
-            //totWeights.mask(pMask->WeightMaskVectors[o - 1]) += weights;
-            for (size_t i = 0; i < weights.length(); ++i) {
-                if (pMask->WeightMaskVectors[o-1][i]) {
-                    weights[i] = std::exp(weights[i]);
-                    totWeights[i] += weights[i];
+        const BitVector &  weightMask(pMask->WeightMaskVectors[o-1]);
+        const BitVector &  probMask(pMask->ProbMaskVectors[o]);
+        _UnpackOrderParams(params, pBiasParams, pFeatParams,
+                           biases, flatParams);
+        for (size_t l = 0; l < _lms.size(); l++)
+            lmProbs[l] = _lms[l]->probs(o).begin();
+
+        // Interpolate the masked n-grams of each masked history.  The weight
+        // mask includes the history of every n-gram in the prob mask.  Masks
+        // are usually sparse, so weights are computed per history, not tile.
+        size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            vector<Param> weights(_lms.size());
+            for (size_t i = nBegin; i < nEnd;) {
+                NgramIndex h = hists[i];
+                if (!weightMask[h]) {
+                    while (i < nEnd && hists[i] == h)
+                        ++i;
+                    continue;
+                }
+                Param totWeight = _ComputeHistoryWeights(
+                    o - 1, h, biases, flatParams, &weights[0]);
+                for (; i < nEnd && hists[i] == h; ++i) {
+                    if (!probMask[i]) continue;
+                    Prob prob = 0;
+                    for (size_t l = 0; l < _lms.size(); l++)
+                        prob += lmProbs[l][i] * weights[l];
+                    probs[i] = prob / totWeight;
                 }
             }
-
-            // Interpolate component LM probabilities.
-            const ProbVector &lmProbs(_lms[l]->probs(o));
-            for (size_t i = 0; i < probs.length(); ++i)
-                //probs.mask(pMask->ProbMaskVectors[o]) +=
-                //    lmProbs * weights[hists];
-                if (pMask->ProbMaskVectors[o][i])
-                    probs[i] += lmProbs[i] * weights[hists[i]];
-        }
-        // Normalize probabilities.
-        for (size_t i = 0; i < probs.length(); ++i)
-            if (pMask->ProbMaskVectors[o][i])
-                probs[i] /= totWeights[hists[i]];
+        });
     }
 }
 
@@ -399,28 +592,133 @@ InterpolatedNgramLM::_EstimateBowsMasked(InterpolatedNgramLMMask *pMask) {
         const ProbVector & boProbs(this->probs(o - 1));
         const IndexVector &hists(this->hists(o));
         const IndexVector &backoffs(this->backoffs(o));
-
-        Range      r(sizes(o - 1));
-        ProbVector numerator(_weights[r]);       // Reuse buffers.
-        ProbVector denominator(_totWeights[r]);  // Reuse buffers.
-        numerator.set(0);
-        denominator.set(0);
-
-        // BitVector m = pMask->BowMaskVectors[o-1][hists];
-        // numerator[hists].masked(m) += probs;
-        // denominator[hists].masked(m) += boProbs[backoffs];
-        for (size_t i = 0; i < probs.length(); ++i) {
-            if (pMask->BowMaskVectors[o-1][hists[i]]) {
-                numerator[hists[i]] += probs[i];
-                denominator[hists[i]] += boProbs[backoffs[i]];
+        const BitVector &  bowMask(pMask->BowMaskVectors[o-1]);
+        ProbVector &       numerator(_weights);       // Reuse buffers.
+        ProbVector &       denominator(_totWeights);  // Reuse buffers.
+
+        size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            for (size_t i = hBegin; i < hEnd; ++i)
+                numerator[i] = denominator[i] = 0;
+
+            // BitVector m = pMask->BowMaskVectors[o-1][hists];
+            // numerator[hists].masked(m) += probs;
+            // denominator[hists].masked(m) += boProbs[backoffs];
+            for (size_t i = nBegin; i < nEnd; ++i) {
+                if (bowMask[hists[i]]) {
+                    numerator[hists[i]] += probs[i];
+                    denominator[hists[i]] += boProbs[backoffs[i]];
+                }
             }
+            //bows.masked(pMask->BowMaskVectors[o-1]) = (1 - numerator) /
+            //                                          (1 - denominator);
+            for (size_t i = hBegin; i < hEnd; ++i)
+                if (bowMask[i])
+                    bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
+        });
+    }
+}
+
+// Unpacks the interpolation bias and feature parameters of each component
+// LM for the next order, advancing pBiasParams and pFeatParams past them.
+// flatParams holds the feature parameters in the order of the features in
+// _featureMatrix.
+void
+InterpolatedNgramLM::_UnpackOrderParams(const ParamVector &params,
+                                        const Param *&pBiasParams,
+                                        const Param *&pFeatParams,
+                                        vector<Param> &biases,
+                                        vector<Param> &flatParams) const {
+    if (_tieParamOrder) {
+        pBiasParams = &params[0];
+        pFeatParams = &params[_lms.size() - 1];
+    }
+    const Param *pLMFeatParams = pFeatParams;
+    size_t       k = 0;
+    for (size_t l = 0; l < _lms.size(); l++) {
+        if (_tieParamLM)
+            pFeatParams = pLMFeatParams;
+        biases[l] = (l == 0) ? 0 : *pBiasParams++;
+        for (size_t f = 0; f < _lmNumFeatures[l]; f++)
+            flatParams[k++] = *pFeatParams++;
+    }
+}
+
+// Computes the unnormalized weight of each component LM for the histories of
+// order o in tile, exp(bias + features . params), into weights[l * kTileSize +
+// b] for history tile * kTileSize + b, and their sums into totWeights[b].  Each
+// step is a loop over the tile, which the compiler vectorizes, also for AVX2
+// when available at run time.  AVX2 excludes FMA, so the results match the
+// default build bit for bit.
+#ifdef HAVE_TARGET_CLONES
+__attribute__((target_clones("avx2", "default")))
+#endif
+void
+InterpolatedNgramLM::_ComputeTileWeights(size_t o, size_t tile,
+                                         const vector<Param> &biases,
+                                         const vector<Param> &flatParams,
+                                         Param *weights,
+                                         Param *totWeights) const {
+    const float *features = (_numFeatures == 0) ? NULL :
+        &_featureMatrix[o][tile * _numFeatures * kTileSize];
+    Param  tot[kTileSize];  // Local, so the compiler sees no aliasing.
+    for (size_t b = 0; b < kTileSize; b++)
+        tot[b] = 0;
+    size_t k = 0;
+    for (size_t l = 0; l < _lms.size(); l++) {
+        Param *w = &weights[l * kTileSize];
+        Param  bias = biases[l];
+        for (size_t b = 0; b < kTileSize; b++)
+            w[b] = bias;
+        for (size_t f = 0; f < _lmNumFeatures[l]; f++, k++) {
+            const float *column = &features[k * kTileSize];
+            Param        param = flatParams[k];
+            if (param == 0) continue;
+            for (size_t b = 0; b < kTileSize; b++)
+                w[b] += column[b] * param;
+        }
+        for (size_t b = 0; b < kTileSize; b++)
+            w[b] = std::min(std::max(w[b], kMinFastExp), kMaxFastExp);
+        for (size_t b = 0; b < kTileSize; b++) {
+            w[b] = FastExp(w[b]);
+            tot[b] += w[b];
         }
-        //bows.masked(pMask->BowMaskVectors[o-1]) = (1 - numerator) /
-        //                                          (1 - denominator);
-        for (size_t i = 0; i < bows.length(); ++i)
-            if (pMask->BowMaskVectors[o-1][i])
-                bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
     }
+    std::copy(tot, tot + kTileSize, totWeights);
+}
+
+// Computes the unnormalized weight of each component LM for history h of
+// order o into weights, as _ComputeTileWeights() does, and returns their sum.
+Param
+InterpolatedNgramLM::_ComputeHistoryWeights(size_t o, size_t h,
+                                            const vector<Param> &biases,
+                                            const vector<Param> &flatParams,
+                                            Param *weights) const {
+    Param totWeight = 0;
+    for (size_t l = 0; l < _lms.size(); l++) {
+        weights[l] = _ComputeHistoryWeight(o, h, l, biases, flatParams);
+        totWeight += weights[l];
+    }
+    return totWeight;
+}
+
+// Computes the unnormalized weight of component LM l for history h of order o,
+// as _ComputeTileWeights() does.
+Param
+InterpolatedNgramLM::_ComputeHistoryWeight(size_t o, size_t h, size_t l,
+                                           const vector<Param> &biases,
+                                           const vector<Param> &flatParams) const {
+    size_t k = 0;
+    for (size_t m = 0; m < l; m++)
+        k += _lmNumFeatures[m];
+    Param weight = biases[l];
+    for (size_t f = 0; f < _lmNumFeatures[l]; f++, k++)
+        if (flatParams[k] != 0)
+            weight += _featureMatrix[o][_FeatureIndex(h, k)] * flatParams[k];
+    weight = std::min(std::max(weight, kMinFastExp), kMaxFastExp);
+    return FastExp(weight);
 }
 
 }
@@ -58,39 +58,90 @@ enum Interpolation {
 
 class InterpolatedNgramLM : public NgramLMBase {
 protected:
+    static const uint64_t           kNoEstimate = (uint64_t)-1;
+    static const size_t             kTileSize = 64;  // Histories per tile
+
     vector<SharedPtr<NgramLMBase> > _lms;
-    vector<vector<FeatureVectors> > _featureList;
+    vector<size_t>                  _lmNumFeatures;  // Features of each LM
+    vector<FloatVector>             _featureMatrix;  // [o][_FeatureIndex(h, k)]
+    size_t                          _numFeatures;
     Interpolation                   _interpolation;
     ProbVector                      _weights;
     ProbVector                      _totWeights;
+    vector<ProbVector>              _lmOrderProbs;   // Sparse component probs
+    vector<ProbVector>              _histWeights;    // Sparse mixing weights
     IntVector                       _paramStarts;
     ParamVector                     _paramDefaults;
     BitVector                       _paramMask;
     bool                            _tieParamOrder;
     bool                            _tieParamLM;
 
+    // Parameters and mask id of the last estimate of each component LM
+    // and of the interpolation, used to skip unchanged estimates.  A mask
+    // id of 0 denotes a full estimate, and kNoEstimate a missing one.
+    vector<ParamVector>             _lmParams;
+    vector<uint64_t>                _lmMaskIds;
+    BitVector                       _lmDirty;  // Changed since interpolation
+    ParamVector                     _mixParams;
+    uint64_t                        _mixMaskId;
+
 public:
     InterpolatedNgramLM(size_t order = 3, 
                         bool tieParamOrder = false, 
                         bool tieParamLM = false)
-        : NgramLMBase(order), _interpolation(LI), 
-          _tieParamOrder(tieParamOrder), _tieParamLM(tieParamLM) { }
+        : NgramLMBase(order), _numFeatures(0), _interpolation(LI), 
+          _tieParamOrder(tieParamOrder), _tieParamLM(tieParamLM),
+          _mixMaskId(kNoEstimate) { }
     void  LoadLMs(const vector<SharedPtr<NgramLMBase> > &lms);
     void  SetInterpolation(Interpolation interpolation,
                            const vector<vector<FeatureVectors> > &featureList);
     SharedPtr<NgramLMBase> &lms(int l) { return _lms[l]; }
     size_t                  numLMs()   { return _lms.size(); }
+    Interpolation           interpolation() const { return _interpolation; }
+    bool                    tieParamOrder() const { return _tieParamOrder; }
+    // Index of the first interpolation bias parameter, after the
+    // parameters of the component LMs.
+    size_t                  biasParamStart() const
+    { return _paramStarts[_lms.size()]; }
 
     virtual Mask *GetMask(vector<BitVector> &probMaskVectors,
                           vector<BitVector> &bowMaskVectors) const;
     virtual bool  Estimate(const ParamVector &params, Mask *pMask=NULL);
 
-private:
+protected:
+    // Index of feature k of history h in _featureMatrix.  The matrix is split
+    // into tiles of kTileSize histories, each storing one feature of all its
+    // histories contiguously, so tile weights are computed column by column.
+    size_t _FeatureIndex(size_t h, size_t k) const
+    { return (h / kTileSize * _numFeatures + k) * kTileSize + h % kTileSize; }
+    // An estimate with cachedMaskId covers one with maskId if it was a full
+    // estimate or used the same mask.
+    static bool _IsCached(uint64_t cachedMaskId, uint64_t maskId)
+    { return cachedMaskId == 0 || cachedMaskId == maskId; }
     void _EstimateProbs(const ParamVector &params);
     void _EstimateBows();
     void _EstimateProbsMasked(const ParamVector &params,
                               InterpolatedNgramLMMask *pMask);
     void _EstimateBowsMasked(InterpolatedNgramLMMask *pMask);
+    void _EstimateSparseProbs(const ParamVector &params,
+                              InterpolatedNgramLMMask *pMask);
+    bool _AnySparse() const;
+    void _UnpackOrderParams(const ParamVector &params,
+                            const Param *&pBiasParams,
+                            const Param *&pFeatParams,
+                            vector<Param> &biases,
+                            vector<Param> &flatParams) const;
+    void  _ComputeTileWeights(size_t o, size_t tile,
+                              const vector<Param> &biases,
+                              const vector<Param> &flatParams,
+                              Param *weights, Param *totWeights) const;
+    Param _ComputeHistoryWeights(size_t o, size_t h,
+                                 const vector<Param> &biases,
+                                 const vector<Param> &flatParams,
+                                 Param *weights) const;
+    Param _ComputeHistoryWeight(size_t o, size_t h, size_t l,
+                                const vector<Param> &biases,
+                                const vector<Param> &flatParams) const;
 };
 
 }
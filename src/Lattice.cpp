@@ -36,6 +36,7 @@
 #include <queue>
 #include <limits>
 #include <algorithm>
+#include <cassert>
 
 #ifdef HAVE_TR1_UNORDERED_MAP
 #include <tr1/unordered_map>
@@ -46,6 +47,7 @@ using std::unordered_map;
 #endif
 
 #include "util/FastIO.h"
+#include "util/FastMath.h"
 #include "util/constants.h"
 #include "Lattice.h"
 
@@ -66,11 +68,36 @@ struct ArcCompare
     }
 };
 
-struct Path {
-    Path(float s, NodeIndex n) : score(s), node(n) { }
-    bool operator<(const Path &x) const { return score > x.score; }
-    float     score;
-    NodeIndex node;
+struct DeltaCompare
+{
+    const FloatVector &_deltas;
+    DeltaCompare(const FloatVector &deltas) : _deltas(deltas) { }
+    bool operator()(uint i, uint j) const { return _deltas[i] < _deltas[j]; }
+};
+
+// Node of a persistent leftist heap of the nodes on a best path, keyed by
+// the cost of their cheapest sidetrack arc.  Each node also heads the chain
+// of its remaining sidetracks, sorted by cost.
+struct SidetrackHeap {
+    SidetrackHeap(uint f, uint l) : first(f), last(l), left(-1), right(-1),
+                                    rank(1) { }
+    uint first;  // Range in sidetracks of the node's sidetracks
+    uint last;
+    uint left;
+    uint right;
+    uint rank;
+};
+
+// Candidate path of the k-best search, which leaves its parent path by
+// taking sidetracks[sidetrack] from the node of heap node heap.
+struct NBestPath {
+    NBestPath(float s, uint h, uint t, uint p)
+        : score(s), heap(h), sidetrack(t), parent(p) { }
+    bool operator<(const NBestPath &x) const { return score > x.score; }
+    float score;
+    uint  heap;
+    uint  sidetrack;
+    uint  parent;
 };
 
 struct OraclePath {
@@ -102,6 +129,7 @@ typedef unordered_map<NodeNgram, NodeIndex, NodeNgramHash> NodeNgramMap;
 
 void
 Lattice::LoadLattice(ZFile &latticeFile) {
+    assert(!_packed);
     // TODO: Support optional weights.
     if (latticeFile == NULL) throw std::invalid_argument("Invalid file");
 
@@ -154,21 +182,18 @@ Lattice::LoadLattice(ZFile &latticeFile) {
     // Sort transitions by arcStart, arcEnd.
     _Sort(numArcs, ArcCompare(*this));
 
-    // Compute first index of each start node and update final node index.
+    // Update final node index and compute first index of each start node.
     _finalNode = _arcStarts[_arcStarts.length() - 1] + 1;
-    _nodeArcs.reset(_finalNode + 2);
-    NodeIndex node = (NodeIndex)-1;
     for (uint i = 0; i < numArcs; ++i) {
-        if (_arcStarts[i] != node) {
-            node = _arcStarts[i];
-            assert(node < _finalNode);
-            _nodeArcs[node] = i;
-        }
+        assert(_arcStarts[i] < _finalNode);
         if (_arcEnds[i] == std::numeric_limits<NodeIndex>::max())
             _arcEnds[i] = _finalNode;
     }
-    _nodeArcs[_finalNode]   = _arcStarts.length();
-    _nodeArcs[_finalNode+1] = _arcStarts.length();
+    _ComputeNodeArcs();
+
+    // Split nodes reached with different n-gram histories.
+    if (_expandHistories)
+        _ExpandNgramHistories();
 
     // Compute arc -> ngram prob/bow index mapping.
     _ComputeArcNgramMapping();
@@ -176,6 +201,81 @@ Lattice::LoadLattice(ZFile &latticeFile) {
     UpdateWeights();
 }
 
+// Remove arcs with posterior probability below minPosterior under the
+// current weights, except the arcs of the oracle path, along with the arcs
+// no longer on a complete path.  Return the number of arcs removed.
+size_t
+Lattice::Prune(float minPosterior) {
+    assert(!_packed);
+    size_t numArcs = _arcStarts.length();
+
+    // Compute posterior probabilities.
+    FloatVector forwardScores, backwardScores, arcScores;
+    _ComputeBackwardScores(backwardScores, arcScores);
+    _ComputeForwardScores(forwardScores, arcScores);
+    float     totScore = forwardScores[_finalNode];
+    BitVector keepArcs(numArcs);
+    for (uint i = 0; i < numArcs; ++i)
+        keepArcs[i] = (std::exp(arcScores[i] + backwardScores[_arcEnds[i]]
+                                - totScore) >= minPosterior);
+    for (size_t i = 0; i < _oraclePath.length(); ++i)
+        keepArcs[_oraclePath[i]] = true;
+
+    // Keep arcs on a path from the initial node to the final node.
+    BitVector reachable, coreachable;
+    reachable.reset(_finalNode + 1, false);
+    coreachable.reset(_finalNode + 1, false);
+    reachable[0] = true;
+    coreachable[_finalNode] = true;
+    for (uint i = 0; i < numArcs; ++i)
+        if (keepArcs[i] && reachable[_arcStarts[i]])
+            reachable[_arcEnds[i]] = true;
+    for (uint i = numArcs - 1; i != (uint)-1; --i)
+        if (keepArcs[i] && coreachable[_arcEnds[i]])
+            coreachable[_arcStarts[i]] = true;
+    size_t numKept = 0;
+    for (uint i = 0; i < numArcs; ++i) {
+        keepArcs[i] = keepArcs[i] && reachable[_arcStarts[i]] &&
+            coreachable[_arcEnds[i]];
+        numKept += keepArcs[i];
+    }
+    if (numKept == numArcs)
+        return 0;
+
+    // Renumber remaining nodes in order, and copy remaining arcs.
+    NodeVector newNodes(_finalNode + 1);
+    NodeIndex  numNodes = 0;
+    for (NodeIndex n = 0; n <= _finalNode; ++n)
+        newNodes[n] = (reachable[n] && coreachable[n]) ? numNodes++ : -1;
+    NodeVector  newArcStarts(numKept);
+    NodeVector  newArcEnds(numKept);
+    VocabVector newArcWords(numKept);
+    FloatVector newArcBaseWeights(numKept);
+    for (uint i = 0, j = 0; i < numArcs; ++i) {
+        if (keepArcs[i]) {
+            newArcStarts[j]      = newNodes[_arcStarts[i]];
+            newArcEnds[j]        = newNodes[_arcEnds[i]];
+            newArcWords[j]       = _arcWords[i];
+            newArcBaseWeights[j] = _arcBaseWeights[i];
+            ++j;
+        }
+    }
+    _arcStarts.swap(newArcStarts);
+    _arcEnds.swap(newArcEnds);
+    _arcWords.swap(newArcWords);
+    _arcBaseWeights.swap(newArcBaseWeights);
+
+    // Compute first index of each start node.
+    _finalNode = numNodes - 1;
+    _ComputeNodeArcs();
+
+    // Recompute arc -> ngram prob/bow index mapping, weights, and oracle.
+    _ComputeArcNgramMapping();
+    UpdateWeights();
+    _FindOraclePath();
+    return numArcs - numKept;
+}
+
 void
 Lattice::SaveLattice(ZFile &latticeFile) const {
     if (latticeFile == NULL) throw std::invalid_argument("Invalid file");
@@ -212,8 +312,45 @@ Lattice::UpdateWeights() {
     }
 }
 
+// Update _arcWeights of arcs whose LM probabilities changed.  slotLogs holds
+// the log probabilities of the slots that WordErrorRateOptimizer assigned to
+// _arcProbs and _arcBows, and changedSlots marks the slots that changed since
+// the last update.  Each arc has exactly one _arcProbs entry, in arc order,
+// followed by its _arcBows entries.  The weights are computed in the same
+// order as UpdateWeights(), so the results are identical.  All arcs are
+// updated if the weights have not been computed yet.
+void
+Lattice::UpdateWeights(const DoubleVector &slotLogs,
+                       const BitVector &changedSlots) {
+    if (_arcProbSlots.length() != _arcProbs.length()) {
+        UpdateWeights();  // Slots not assigned.
+        return;
+    }
+    bool updateAll = (_arcWeights.length() != _arcBaseWeights.length());
+    if (updateAll) {
+        assert(!_packed);
+        _arcWeights.reset(_arcBaseWeights.length());
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < _arcProbs.length(); ++i) {
+        uint   arc     = _arcProbs[i].arcIndex;
+        size_t jEnd    = j;
+        bool   changed = updateAll || changedSlots[_arcProbSlots[i]];
+        while (jEnd < _arcBows.length() && _arcBows[jEnd].arcIndex == arc)
+            changed |= changedSlots[_arcBowSlots[jEnd++]];
+        if (changed) {
+            float weight = _arcBaseWeights[arc] - slotLogs[_arcProbSlots[i]];
+            for (size_t k = j; k < jEnd; ++k)
+                weight -= slotLogs[_arcBowSlots[k]];
+            _arcWeights[arc] = weight;
+        }
+        j = jEnd;
+    }
+}
+
 void
 Lattice::SetReferenceText(const char *ref) {
+    assert(!_packed);
     _ref.reset(256);
     size_t      numWords = 0;
     const char *p = ref;
@@ -227,27 +364,34 @@ Lattice::SetReferenceText(const char *ref) {
         if (*p != '\0') ++p;
     }
     _ref.resize(numWords);
+    _BuildRefMasks();
 
     _FindOraclePath();
 }
 
 float
 Lattice::ComputeMargin() const {
+    Scratch scratch;
+    return ComputeMargin(scratch);
+}
+
+float
+Lattice::ComputeMargin(Scratch &scratch) const {
     // Compute oracle score.
     float oracleScore = 0;
     for (size_t i = 0; i < _oraclePath.length(); ++i)
         oracleScore += _arcWeights[_oraclePath[i]];
 
     // Compute reverse scores and paths.
-    ArcScoreVector bestArcs(_finalNode + 1);
+    ArcScoreVector &bestArcs = scratch.bestArcs;
+    if (bestArcs.length() < _finalNode + 1)
+        bestArcs.reset(_finalNode + 1);
     _ReverseViterbiSearch(bestArcs);
 
     // Compute margin between oracle and best non-oracle scores.
     if (_IsOracleBestPath(bestArcs)) {
-//        vector<float> nbestScores;
-//        _FindNBestPaths(bestArcs, 2, nbestScores);
-//        return nbestScores[1] - oracleScore;
-        return 0;
+        float runnerUpScore = _FindRunnerUpScore(bestArcs);
+        return (runnerUpScore == INF) ? 0 : runnerUpScore - oracleScore;
     } else {
         return bestArcs[0].score - oracleScore;
     }
@@ -255,9 +399,17 @@ Lattice::ComputeMargin() const {
 
 int
 Lattice::ComputeWER() const {
+    Scratch scratch;
+    return ComputeWER(scratch);
+}
+
+int
+Lattice::ComputeWER(Scratch &scratch) const {
     // Compute best hypothesis path.
-    ArcScoreVector     bestArcs(_finalNode + 1);
-    vector<VocabIndex> hyp;
+    ArcScoreVector     &bestArcs = scratch.bestArcs;
+    vector<VocabIndex> &hyp      = scratch.hyp;
+    if (bestArcs.length() < _finalNode + 1)
+        bestArcs.reset(_finalNode + 1);
     _ReverseViterbiSearch(bestArcs);
     _FindBestPath(bestArcs, hyp);
 
@@ -273,30 +425,158 @@ Lattice::ComputeWER() const {
 
     if (hyp.size() == 0) return _ref.length();
     if (_ref.length() == 0) return hyp.size();
+    return _EditDistance(hyp, scratch);
+}
+
+// Compute the WER of the best path, as ComputeWER(), and count the
+// substitutions, deletions, and insertions of a minimum edit alignment.
+int
+Lattice::ComputeWER(Scratch &scratch, EditCounts &counts) const {
+    ArcScoreVector     &bestArcs = scratch.bestArcs;
+    vector<VocabIndex> &hyp      = scratch.hyp;
+    if (bestArcs.length() < _finalNode + 1)
+        bestArcs.reset(_finalNode + 1);
+    _ReverseViterbiSearch(bestArcs);
+    _FindBestPath(bestArcs, hyp);
+
+    // Compute edit distance of all prefixes of hypothesis and reference.
+    size_t     numRef = _ref.length();
+    size_t     numCols = numRef + 1;
+    IntVector &scores = scratch.editScores;
+    if (scores.length() < (hyp.size() + 1) * numCols)
+        scores.reset((hyp.size() + 1) * numCols);
+    for (size_t iRef = 0; iRef <= numRef; ++iRef)
+        scores[iRef] = iRef;
+    for (size_t iHyp = 1; iHyp <= hyp.size(); ++iHyp) {
+        int *prev = &scores[(iHyp - 1) * numCols];
+        int *cur  = &scores[iHyp * numCols];
+        cur[0] = iHyp;
+        for (size_t iRef = 1; iRef <= numRef; ++iRef)
+            cur[iRef] = std::min(std::min(
+                prev[iRef] + 1,                 // Insertion
+                cur[iRef - 1] + 1),             // Deletion
+                prev[iRef - 1] +                // Substitution
+                ((hyp[iHyp - 1] == _ref[iRef - 1]) ? 0 : 1));
+    }
 
-    // Computes edit distance between hypothesis and reference.
-    IntVector nodeScores = Range(_ref.length() + 1);
+    // Trace back alignment.
+    counts = EditCounts();
+    size_t iHyp = hyp.size(), iRef = numRef;
+    while (iHyp > 0 || iRef > 0) {
+        int score = scores[iHyp * numCols + iRef];
+        if (iHyp > 0 && iRef > 0) {
+            bool match = (hyp[iHyp - 1] == _ref[iRef - 1]);
+            if (score == scores[(iHyp - 1) * numCols + iRef - 1] +
+                (match ? 0 : 1)) {
+                counts.substitutions += !match;
+                --iHyp; --iRef;
+                continue;
+            }
+        }
+        if (iRef > 0 && score == scores[iHyp * numCols + iRef - 1] + 1) {
+            counts.deletions++;
+            --iRef;
+        } else {
+            counts.insertions++;
+            --iHyp;
+        }
+    }
+    return scores[hyp.size() * numCols + numRef];
+}
+
+// Compute the edit distance between hyp and the reference with the
+// bit-parallel algorithm of Myers, as extended to multiple words by Hyyro.
+// Bits of the vertical deltas of each reference position are computed 64
+// positions at a time, so that the cost is O(|hyp| |ref| / 64).
+int
+Lattice::_EditDistance(const vector<VocabIndex> &hyp, Scratch &scratch) const {
+    const uint64_t kAllOnes = ~(uint64_t)0;
+    size_t numRef    = _ref.length();
+    size_t numBlocks = (numRef + 63) / 64;
+    size_t lastBit   = (numRef - 1) % 64;
+    int    score     = numRef;
+    if (numBlocks == 1) {
+        uint64_t pv = kAllOnes, mv = 0;
+        for (size_t iHyp = 0; iHyp < hyp.size(); ++iHyp) {
+            const uint64_t *refMask = _FindRefMask(hyp[iHyp]);
+            uint64_t eq = refMask ? refMask[0] : 0;
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            score += (int)((ph >> lastBit) & 1) - (int)((mh >> lastBit) & 1);
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return score;
+    }
+
+    // Propagate horizontal deltas from block to block.
+    DenseVector<uint64_t> &bits = scratch.editBits;
+    if (bits.length() < 2 * numBlocks)
+        bits.reset(2 * numBlocks);
+    uint64_t *pvs = bits.data();
+    uint64_t *mvs = bits.data() + numBlocks;
+    std::fill_n(pvs, numBlocks, kAllOnes);
+    std::fill_n(mvs, numBlocks, 0);
     for (size_t iHyp = 0; iHyp < hyp.size(); ++iHyp) {
-        int prevScore = iHyp;
-        nodeScores[0] = iHyp + 1;
-        for (size_t iRef = 0; iRef < _ref.length(); ++iRef) {
-            int subScore = prevScore + ((hyp[iHyp] == _ref[iRef]) ? 0 : 1);
-            prevScore = nodeScores[iRef + 1];
-            nodeScores[iRef + 1] = std::min(std::min(
-                prevScore + 1,          // Insertion
-                nodeScores[iRef] + 1),  // Deletion
-                subScore);              // Substitution
+        const uint64_t *refMask = _FindRefMask(hyp[iHyp]);
+        int hin = 1;
+        for (size_t b = 0; b < numBlocks; ++b) {
+            uint64_t pv = pvs[b], mv = mvs[b];
+            uint64_t eq = refMask ? refMask[b] : 0;
+            uint64_t xv = eq | mv;
+            if (hin < 0) eq |= 1;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            size_t   bit = (b + 1 == numBlocks) ? lastBit : 63;
+            int      hout = (int)((ph >> bit) & 1) - (int)((mh >> bit) & 1);
+            ph <<= 1;
+            mh <<= 1;
+            if (hin < 0)
+                mh |= 1;
+            else if (hin > 0)
+                ph |= 1;
+            pvs[b] = mh | ~(xv | ph);
+            mvs[b] = ph & xv;
+            hin = hout;
         }
+        score += hin;
     }
-//    printf("%s %i %lu\n", _tag.c_str(), nodeScores[_ref.length()], _ref.length());
+    return score;
+}
 
-//    vector<float> nbestScores;
-//    _FindNBestPaths(bestArcs, 5, nbestScores);
-//    for (size_t i = 0; i < nbestScores.size(); ++i)
-//        printf("%f ", nbestScores[i]);
-//    printf("\n");
+// Build the bit masks of the positions of each unique reference word, for
+// _EditDistance().
+void
+Lattice::_BuildRefMasks() {
+    vector<VocabIndex> words(_ref.begin(), _ref.end());
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    _refVocab = words;
+
+    size_t numBlocks = (_ref.length() + 63) / 64;
+    _refMasks.reset(words.size() * numBlocks, 0);
+    for (size_t i = 0; i < _ref.length(); ++i) {
+        size_t w = std::lower_bound(words.begin(), words.end(), _ref[i]) -
+            words.begin();
+        _refMasks[w * numBlocks + i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
 
-    return nodeScores[_ref.length()];
+// Return the bit masks of the reference positions of word, or NULL if word
+// is not in the reference.
+const uint64_t *
+Lattice::_FindRefMask(VocabIndex word) const {
+    const VocabIndex *p = std::lower_bound(_refVocab.begin(), _refVocab.end(),
+                                           word);
+    if (p == _refVocab.end() || *p != word)
+        return NULL;
+    return _refMasks.data() + (p - _refVocab.begin()) *
+        ((_ref.length() + 63) / 64);
 }
 
 void
@@ -306,37 +586,38 @@ Lattice::GetBestPath(vector<VocabIndex> &bestPath) const {
     _FindBestPath(bestArcs, bestPath);
 }
 
+// Return the scores and words of the n best paths, in order of score.
+void
+Lattice::GetNBestPaths(size_t n, vector<float> &nbestScores,
+                       vector<vector<VocabIndex> > &nbestPaths) const {
+    ArcScoreVector       bestArcs(_finalNode + 1);
+    vector<vector<uint> > nbestArcs;
+    _ReverseViterbiSearch(bestArcs);
+    _FindNBestPaths(bestArcs, n, nbestScores, &nbestArcs);
+
+    nbestPaths.resize(nbestArcs.size());
+    for (size_t k = 0; k < nbestArcs.size(); ++k) {
+        nbestPaths[k].clear();
+        for (size_t i = 0; i < nbestArcs[k].size(); ++i) {
+            VocabIndex word = _arcWords[nbestArcs[k][i]];
+            if (word != Vocab::EndOfSentence &&
+                (!_skipTags || _lm.vocab()[word][0] != '<'))
+                nbestPaths[k].push_back(word);
+        }
+    }
+}
+
 
 void
 Lattice::ComputeForwardScores(FloatVector &nodeScores) const {
-    // Compute forward cumulative arc weights.
-    nodeScores.reset(_finalNode + 1, -INF);
-    nodeScores[0] = 0;
-    for (uint i = 0; i < _arcEnds.length(); ++i) {
-        assert(_arcStarts[i] < _arcEnds[i]);   // No self-transition.
-        nodeScores[_arcEnds[i]] = logAdd(nodeScores[_arcEnds[i]],
-            nodeScores[_arcStarts[i]] - _arcWeights[i]);
-    }
+    FloatVector arcScores;
+    _ComputeForwardScores(nodeScores, arcScores);
 }
 
 void
 Lattice::ComputeBackwardScores(FloatVector &nodeScores) const {
-    // Compute backward cumulative arc weights.
-    nodeScores.reset(_finalNode + 1);
-    NodeIndex currentNode = _finalNode;
-    float     totScore    = 0;
-    for (uint i = _arcEnds.length() - 1; i != (uint)-1; --i) {
-        assert(_arcStarts[i] < _arcEnds[i]);   // No self-transition.
-        assert(currentNode >= _arcStarts[i]);  // Sorted arcs.
-        if (currentNode != _arcStarts[i]) {
-            nodeScores[currentNode] = totScore;
-            currentNode = _arcStarts[i];
-            totScore    = nodeScores[_arcEnds[i]] - _arcWeights[i];
-        } else
-            totScore = logAdd(totScore,
-                              nodeScores[_arcEnds[i]] - _arcWeights[i]);
-    }
-    nodeScores[currentNode] = totScore;
+    FloatVector arcScores;
+    _ComputeBackwardScores(nodeScores, arcScores);
 }
 
 void
@@ -361,45 +642,20 @@ void
 Lattice::ComputeForwardSteps(const FloatVector &forwardScores,
                              FloatVector &nodeSteps) const {
     // Compute cumulative weighted steps from beginning to each node.
-    nodeSteps.reset(_finalNode + 1, -INF);
-    for (uint i = 0; i < _arcEnds.length(); ++i) {
-        assert(_arcStarts[i] < _arcEnds[i]);   // No self-transition.
-        // float pathProb = forwardScores[_arcStarts[i]] * exp(-_arcWeights[i]);
-        // float avgSteps = nodeSteps[_arcStarts[i]] / forwardScores[_arcStarts[i]] + 1;
-        // nodeSteps[_arcEnds[i]] += pathProb * avgSteps;
-        //nodeSteps[_arcEnds[i]] += exp(-_arcWeights[i]) *
-        //    (nodeSteps[_arcStarts[i]] + forwardScores[_arcStarts[i]]);
-        nodeSteps[_arcEnds[i]] = logAdd(nodeSteps[_arcEnds[i]],
-            logAdd(nodeSteps[_arcStarts[i]], forwardScores[_arcStarts[i]])
-            - _arcWeights[i]);
-    }
+    FloatVector arcSteps;
+    _ForwardPass(-INF, nodeSteps, arcSteps, [&](NodeIndex n) {
+        return logAdd(nodeSteps[n], forwardScores[n]);
+    });
 }
 
 void
 Lattice::ComputeBackwardSteps(const FloatVector &backwardScores,
                               FloatVector &nodeSteps) const {
     // Compute cumulative weighted steps from each node to the end.
-    nodeSteps.reset(_finalNode + 1);
-    NodeIndex currentNode = _finalNode;
-    float     totSteps    = -INF;
-    for (uint i = _arcEnds.length() - 1; i != (uint)-1; --i) {
-        assert(_arcStarts[i] < _arcEnds[i]);   // No self-transition.
-        assert(currentNode >= _arcStarts[i]);  // Sorted arcs.
-        if (currentNode != _arcStarts[i]) {
-            nodeSteps[currentNode] = totSteps;
-            currentNode = _arcStarts[i];
-            totSteps    = -INF;
-        }
-        // float pathProb = backwardScores[_arcEnds[i]] * exp(-_arcWeights[i]);
-        // float avgSteps = nodeSteps[_arcEnds[i]] / backwardScores[_arcEnds[i]] + 1;
-        // totSteps += pathProb * avgSteps;
-        //totSteps += exp(-_arcWeights[i]) *
-        //    (nodeSteps[_arcEnds[i]] + backwardScores[_arcEnds[i]]);
-        totSteps = logAdd(totSteps,
-            logAdd(nodeSteps[_arcEnds[i]], backwardScores[_arcEnds[i]])
-            - _arcWeights[i]);
-    }
-    nodeSteps[currentNode] = totSteps;
+    FloatVector arcSteps;
+    _BackwardPass(-INF, nodeSteps, arcSteps, [&](NodeIndex n) {
+        return logAdd(nodeSteps[n], backwardScores[n]);
+    });
 }
 
 void
@@ -419,148 +675,304 @@ Lattice::EstimateArcPosition(const FloatVector &forwardScores,
     }
 }
 
-float
-Lattice::BuildConfusionNetwork() const {
-    // Hack: If there are more than a million arcs, we must have low confidence.
-    if (_arcStarts.length() > 1000000) {
-        printf("#Arcs = %lu\t#RefWords = %lu\n",
-               (unsigned long)_arcStarts.length(),
-               (unsigned long)_ref.length());
-        return 0;
+// Replace terms[k] for k < n with exp(terms[k]), computed with FastExp().
+// Terms are exponentiated in blocks of fixed size, so that the compiler
+// vectorizes the loops, also for AVX2 when available at run time.
+#ifdef HAVE_TARGET_CLONES
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void
+ExpTerms(double *terms, size_t n) {
+    const size_t kBlockSize = 64;
+    double       block[kBlockSize];
+    for (size_t i = 0; i < n; i += kBlockSize) {
+        size_t m = std::min(n - i, kBlockSize);
+        std::copy(terms + i, terms + i + m, block);
+        std::fill(block + m, block + kBlockSize, 0.0);
+        for (size_t k = 0; k < kBlockSize; ++k)
+            block[k] = std::max(block[k], kMinFastExp);
+        for (size_t k = 0; k < kBlockSize; ++k)
+            block[k] = FastExp(block[k]);
+        std::copy(block, block + m, terms + i);
+    }
+}
+
+// Set nodeScores[nodes[j]] to the log-add of scores[offsets[j]..offsets[j +
+// 1]), for the nodes j in [first, last) of a level with arcs.  By default,
+// scores are added one at a time with logAdd(), in order.  With _fastLogAdd,
+// the scores of the level less the max score of their node are exponentiated
+// as one batch, then summed in double with one log per node.  Each exp is
+// within 1 ulp of std::exp(), so a node score is within a float ulp of the
+// exact log-sum-exp of its arc scores, while each logAdd() rounds to float
+// and drops terms more than 20 below the running max.  The results differ
+// from logAdd() in the last bits, which can change ties in
+// BuildConfusionNetwork().
+void
+Lattice::_LogAddLevel(const UIntVector &offsets, uint first, uint last,
+                      const FloatVector &scores, DoubleVector &terms,
+                      FloatVector &nodeScores) const {
+    const UIntVector &nodes = _levels.nodes;
+    if (!_fastLogAdd) {
+        for (uint j = first; j < last; ++j) {
+            if (offsets[j] == offsets[j + 1])
+                continue;
+            float score = -INF;
+            for (uint k = offsets[j]; k < offsets[j + 1]; ++k)
+                score = logAdd(score, scores[k]);
+            nodeScores[nodes[j]] = score;
+        }
+        return;
+    }
+
+    // Nodes with one arc take its score as is.  Other nodes hold their max
+    // score until their terms are summed.
+    size_t numTerms = 0;
+    for (uint j = first; j < last; ++j) {
+        if (offsets[j + 1] - offsets[j] < 2) {
+            if (offsets[j] < offsets[j + 1])
+                nodeScores[nodes[j]] = scores[offsets[j]];
+            continue;
+        }
+        float maxScore = scores[offsets[j]];
+        for (uint k = offsets[j] + 1; k < offsets[j + 1]; ++k)
+            maxScore = std::max(maxScore, scores[k]);
+        if (maxScore == -INF)
+            maxScore = 0;
+        nodeScores[nodes[j]] = maxScore;
+        for (uint k = offsets[j]; k < offsets[j + 1]; ++k)
+            terms[numTerms++] = (double)scores[k] - maxScore;
+    }
+    ExpTerms(terms.data(), numTerms);
+    numTerms = 0;
+    for (uint j = first; j < last; ++j) {
+        if (offsets[j + 1] - offsets[j] < 2)
+            continue;
+        double sum = 0;
+        for (uint k = offsets[j]; k < offsets[j + 1]; ++k)
+            sum += terms[numTerms++];
+        nodeScores[nodes[j]] = (float)(nodeScores[nodes[j]] + std::log(sum));
+    }
+}
+
+// For each level, log-add the scores of the arcs entering its nodes in arc
+// order, then score the arcs leaving each node as nodeFunc(n) less the arc
+// weight.  The initial node starts at initScore, and other nodes at -INF.
+template <typename NodeFunc>
+void
+Lattice::_ForwardPass(float initScore, FloatVector &nodeScores,
+                      FloatVector &arcScores, const NodeFunc &nodeFunc) const {
+    size_t       numArcs = _arcEnds.length();
+    FloatVector  levelScores(numArcs);
+    DoubleVector terms(_fastLogAdd ? numArcs : 0);
+    nodeScores.reset(_finalNode + 1, -INF);
+    nodeScores[0] = initScore;
+    arcScores.reset(numArcs);
+    size_t numLevels = _levels.offsets.length() - 1;
+    for (size_t l = 0; l < numLevels; ++l) {
+        uint first = _levels.offsets[l];
+        uint last  = _levels.offsets[l + 1];
+        for (uint k = _levels.inOffsets[first];
+             k < _levels.inOffsets[last]; ++k)
+            levelScores[k] = arcScores[_levels.inArcs[k]];
+        _LogAddLevel(_levels.inOffsets, first, last, levelScores, terms,
+                     nodeScores);
+        for (uint j = first; j < last; ++j) {
+            NodeIndex n     = _levels.nodes[j];
+            float     score = nodeFunc(n);
+            for (uint i = _nodeArcs[n]; i < _nodeArcs[n + 1]; ++i)
+                arcScores[i] = score - _arcWeights[i];
+        }
     }
+}
+
+// For each level from the last back, score the arcs leaving its nodes as
+// nodeFunc(n) of their end node less the arc weight, and log-add them into
+// their start nodes from the last arc back.  The final node starts at
+// initScore, and other nodes at -INF.
+template <typename NodeFunc>
+void
+Lattice::_BackwardPass(float initScore, FloatVector &nodeScores,
+                       FloatVector &arcScores,
+                       const NodeFunc &nodeFunc) const {
+    size_t       numArcs = _arcEnds.length();
+    FloatVector  levelScores(numArcs);
+    DoubleVector terms(_fastLogAdd ? numArcs : 0);
+    FloatVector  endScores(_finalNode + 1);
+    nodeScores.reset(_finalNode + 1, -INF);
+    nodeScores[_finalNode] = initScore;
+    arcScores.reset(numArcs);
+    size_t numLevels = _levels.offsets.length() - 1;
+    for (size_t l = numLevels; l-- > 0;) {
+        uint first = _levels.offsets[l];
+        uint last  = _levels.offsets[l + 1];
+        for (uint k = _levels.outOffsets[first];
+             k < _levels.outOffsets[last]; ++k) {
+            uint i = _levels.outArcs[k];
+            arcScores[i]   = endScores[_arcEnds[i]] - _arcWeights[i];
+            levelScores[k] = arcScores[i];
+        }
+        _LogAddLevel(_levels.outOffsets, first, last, levelScores, terms,
+                     nodeScores);
+        for (uint j = first; j < last; ++j)
+            endScores[_levels.nodes[j]] = nodeFunc(_levels.nodes[j]);
+    }
+}
+
+// Compute forward cumulative arc weights, and the forward score of each arc.
+void
+Lattice::_ComputeForwardScores(FloatVector &nodeScores,
+                               FloatVector &arcScores) const {
+    _ForwardPass(0, nodeScores, arcScores,
+                 [&](NodeIndex n) { return nodeScores[n]; });
+}
+
+// Compute backward cumulative arc weights.
+void
+Lattice::_ComputeBackwardScores(FloatVector &nodeScores,
+                                FloatVector &arcScores) const {
+    _BackwardPass(0, nodeScores, arcScores,
+                  [&](NodeIndex n) { return nodeScores[n]; });
+}
+
+// Return the key of (segment, index) in the confusion network hash maps.
+static inline uint64_t SegmentKey(uint segment, uint index) {
+    return ((uint64_t)segment << 32) | index;
+}
 
+float
+Lattice::BuildConfusionNetwork() const {
     // Pivot algorithm.
     // Hakkani-Tur, Bechet, Riccardi, and Tur.  Beyond ASR 1-best: Using word
     // confusion networks in spoken language understanding.  Computer Speech
     // and Language 20:4, 2006, 495-514.
 
-    struct Segment {
-        Segment(float p, Segment *n=NULL) : endPos(p), baseArc(-1), next(n) { }
-        void Insert(float p) { next = new Segment(endPos, next); endPos = p; }
-
-        float            endPos;
-        uint             baseArc;
-        Segment *        next;
-        vector<uint>     arcs;
-        vector<WordProb> wordProbs;
-
-    };
-
     // Compute posterior probabilities and estimate arc positions.
     FloatVector arcProbs, nodePositions;
     {
-        FloatVector forwardScores, backwardScores;
-        ComputeForwardScores(forwardScores);
-        ComputeBackwardScores(backwardScores);
-        ComputePosteriorProbs(forwardScores, backwardScores, arcProbs);
+        FloatVector forwardScores, backwardScores, arcScores;
+        _ComputeBackwardScores(backwardScores, arcScores);
+        _ComputeForwardScores(forwardScores, arcScores);
+        float totScore = forwardScores[_finalNode];
+        assert(fabs(totScore - backwardScores[0]) <= 0.01);
+        arcProbs.reset(_arcEnds.length());
+        for (uint i = 0; i < _arcEnds.length(); ++i)
+            arcProbs[i] = std::exp(arcScores[i] + backwardScores[_arcEnds[i]]
+                                   - totScore);
         EstimateArcPosition(forwardScores, backwardScores, nodePositions);
     }
 
+    // Segments are numbered in order of creation.  segments[k] is the k-th
+    // segment by position, ending at segmentEnds[k].  Splitting segment k at
+    // pos inserts a new segment ending at its old end after it.
+    vector<uint>  segments(1, 0);
+    vector<float> segmentEnds(1, 1.0f);
+    vector<uint>  baseArcs(1, (uint)-1);
+    auto splitSegment = [&](size_t k, float pos) {
+        segments.insert(segments.begin() + k + 1, baseArcs.size());
+        segmentEnds.insert(segmentEnds.begin() + k + 1, segmentEnds[k]);
+        segmentEnds[k] = pos;
+        baseArcs.push_back((uint)-1);
+    };
+
     // Build pivot baseline path.
-    Segment *pivotPath = new Segment(1);
     {
-        Segment *segment = pivotPath;
+        size_t k = 0;
         ArcScoreVector bestArcs(_finalNode + 1);
         _ReverseViterbiSearch(bestArcs);
         uint bestArc = bestArcs[0].arc;
         while (_arcEnds[bestArc] != _finalNode) {
-            segment->baseArc = bestArc;
-            segment->Insert(nodePositions[_arcEnds[bestArc]]);
-            segment = segment->next;
+            baseArcs[segments[k]] = bestArc;
+            splitSegment(k++, nodePositions[_arcEnds[bestArc]]);
             bestArc = bestArcs[_arcEnds[bestArc]].arc;
         }
-        segment->baseArc = bestArc;
-        assert(segment->next == NULL);
+        baseArcs[segments[k]] = bestArc;
+        assert(k + 1 == segments.size());
+    }
+
+    // Index the arcs entering each node, which are assigned to segments
+    // before the arcs leaving it.
+    UIntVector nodeInArcs(_finalNode + 2, 0);
+    UIntVector inArcs(_arcEnds.length());
+    for (uint i = 0; i < _arcEnds.length(); ++i)
+        nodeInArcs[_arcEnds[i] + 1]++;
+    for (NodeIndex n = 0; n <= _finalNode; ++n)
+        nodeInArcs[n + 1] += nodeInArcs[n];
+    {
+        UIntVector next(_finalNode + 1);
+        std::copy(nodeInArcs.begin(), nodeInArcs.end() - 1, next.begin());
+        for (uint i = 0; i < _arcEnds.length(); ++i)
+            inArcs[next[_arcEnds[i]]++] = i;
     }
 
     // Add each transition to the pivot structure.
+    UIntVector arcSegments(_arcStarts.length());
     for (uint i = 0; i < _arcStarts.length(); ++i) {
         // Find pivot segment with the greatest overlap to arc.
-        float    arcStartPos = nodePositions[_arcStarts[i]];
-        float    arcEndPos   = nodePositions[_arcEnds[i]];
-        Segment *segment     = pivotPath;
-        while (segment != NULL && segment->endPos < arcStartPos) {
-            segment = segment->next;
-        }
-        if (segment->next != NULL &&
-            (segment->endPos - arcStartPos <
-            std::min(segment->next->endPos, arcEndPos) - segment->endPos)) {
-            segment = segment->next;
+        float  arcStartPos = nodePositions[_arcStarts[i]];
+        float  arcEndPos   = nodePositions[_arcEnds[i]];
+        size_t k = std::lower_bound(segmentEnds.begin(), segmentEnds.end(),
+                                    arcStartPos) - segmentEnds.begin();
+        if (k == segments.size())
+            --k;
+        if (k + 1 < segments.size() &&
+            (segmentEnds[k] - arcStartPos <
+             std::min(segmentEnds[k + 1], arcEndPos) - segmentEnds[k])) {
+            ++k;
         }
 
         // Does segment contain a transition that precedes the current arc?
-        bool splitSegment = false;
-        for (uint j = 0; j < segment->arcs.size(); ++j) {
-            if (_arcEnds[segment->arcs[j]] == _arcStarts[i]) {
-                splitSegment = true;
+        bool split = false;
+        for (uint j = nodeInArcs[_arcStarts[i]];
+             j < nodeInArcs[_arcStarts[i] + 1]; ++j) {
+            if (arcSegments[inArcs[j]] == segments[k]) {
+                split = true;
                 break;
             }
         }
-        if (splitSegment) {
+        if (split) {
             // arcStartPos should be within existing segment.
-            // Create a new segment with the old endPos set to the arcStartPos.
-            segment->Insert(arcStartPos);
-            segment = segment->next;
+            // Create a new segment with the old endPos set to the arcStartPos,
+            // keeping the segments in order.
+            float pos = arcStartPos;
+            if (k > 0 && pos < segmentEnds[k - 1])
+                pos = segmentEnds[k - 1];
+            splitSegment(k++, pos);
         }
         // Assign arc i to segment.  Will cumulate posterior probs later.
-        segment->arcs.push_back(i);
+        arcSegments[i] = segments[k];
     }
 
     // Cumulate posterior probs and add epsilon arc across each segment.
-    Segment *segment = pivotPath;
-    while (segment != NULL) {
-        float totProb = 0;
-        for (uint i = 0; i < segment->arcs.size(); ++i) {
-            float prob = arcProbs[segment->arcs[i]];
-            totProb += prob;
-
-            // Check if arc for word already exists.
-            VocabIndex word  = _arcWords[segment->arcs[i]];
-            bool       found = false;
-            for (uint j = 0; j < segment->wordProbs.size(); ++j)
-                if (segment->wordProbs[j].word == word) {
-                    segment->wordProbs[j].prob += prob;
-                    found = true;
-                    break;
-                }
-            if (!found)
-                segment->wordProbs.push_back(WordProb(word, prob));
-        }
+    vector<float> segmentProbs(baseArcs.size(), 0);
+    unordered_map<uint64_t, float> wordProbs(_arcStarts.length());
+    for (uint i = 0; i < _arcStarts.length(); ++i) {
+        segmentProbs[arcSegments[i]] += arcProbs[i];
+        wordProbs[SegmentKey(arcSegments[i], _arcWords[i])] += arcProbs[i];
+    }
+    for (uint s = 0; s < segmentProbs.size(); ++s) {
+        float totProb = segmentProbs[s];
         if (totProb > 1.4) {
             printf("TotalSegmentProb = %f\n", totProb);
             assert(0);
         }
-        if (totProb < 1) {
-            VocabIndex word = Vocab::EndOfSentence;
-            bool       found = false;
-            for (uint j = 0; j < segment->wordProbs.size(); ++j)
-                if (segment->wordProbs[j].word == word) {
-                    segment->wordProbs[j].prob += 1 - totProb;
-                    found = true;
-                    break;
-                }
-            if (!found)
-                segment->wordProbs.push_back(WordProb(word, 1 - totProb));
-        }
-        segment = segment->next;
+        if (totProb < 1)
+            wordProbs[SegmentKey(s, Vocab::EndOfSentence)] += 1 - totProb;
     }
 
     // Compute average word confidence score.
     float totConfidence = 0;
     int   numWords      = 0;
-    segment = pivotPath;
-    while (segment != NULL) {
-        if (segment->baseArc != (uint)-1) {
+    for (size_t k = 0; k < segments.size(); ++k) {
+        uint baseArc = baseArcs[segments[k]];
+        if (baseArc != (uint)-1) {
             // Only average over words in the best path.
-            VocabIndex word = _arcWords[segment->baseArc];
-            for (uint j = 0; j < segment->wordProbs.size(); ++j)
-                if (segment->wordProbs[j].word == word) {
-                    totConfidence += segment->wordProbs[j].prob;
-                    numWords++;
-                    break;
-                }
+            unordered_map<uint64_t, float>::const_iterator p =
+                wordProbs.find(SegmentKey(segments[k], _arcWords[baseArc]));
+            if (p != wordProbs.end()) {
+                totConfidence += p->second;
+                numWords++;
+            }
         }
-        segment = segment->next;
     }
     return totConfidence / numWords;
 }
@@ -583,6 +995,7 @@ Lattice::Serialize(FILE *outFile) const {
 
 void
 Lattice::Deserialize(FILE *inFile) {
+    assert(!_packed);
     VerifyHeader(inFile, "Lattice");
     ReadString(inFile, _tag);
     ReadVector(inFile, _arcStarts);
@@ -609,8 +1022,83 @@ Lattice::Deserialize(FILE *inFile) {
     }
     _nodeArcs[_finalNode]   = _arcStarts.length();
     _nodeArcs[_finalNode+1] = _arcStarts.length();
+    _ComputeNodeLevels();
 
     UpdateWeights();
+    _BuildRefMasks();
+}
+
+// Write lattice in a format that can be mapped in place by DeserializeMapped,
+// including the precomputed node arc offsets and weight slots.
+void
+Lattice::SerializeMapped(FILE *outFile) const {
+    WriteHeader(outFile, "Lattice");
+    WriteString(outFile, _tag);
+    WriteUInt64(outFile, _finalNode);
+    WriteUInt64(outFile, (uint64_t)(int64_t)_oracleWER);
+    WriteVector(outFile, _arcStarts);
+    WriteVector(outFile, _arcEnds);
+    WriteVector(outFile, _arcWords);
+    WriteVector(outFile, _arcBaseWeights);
+    WriteVector(outFile, _nodeArcs);
+    WriteVector(outFile, _ref);
+    WriteVector(outFile, _oraclePath);
+    WriteVector(outFile, _arcProbs);
+    WriteVector(outFile, _arcBows);
+    WriteVector(outFile, _arcProbSlots);
+    WriteVector(outFile, _arcBowSlots);
+}
+
+template <typename T>
+static inline size_t MappedVectorSize(const DenseVector<T> &x) {
+    return sizeof(uint64_t) + ((x.length() * sizeof(T) + 7) & ~(size_t)7);
+}
+
+// Return the number of bytes written by SerializeMapped.
+size_t
+Lattice::MappedSize() const {
+    return ((strlen("Lattice") + 7) & ~(size_t)7) +
+        (sizeof(uint64_t) + ((_tag.length() + 7) & ~(size_t)7)) +
+        2 * sizeof(uint64_t) +
+        MappedVectorSize(_arcStarts) + MappedVectorSize(_arcEnds) +
+        MappedVectorSize(_arcWords) + MappedVectorSize(_arcBaseWeights) +
+        MappedVectorSize(_nodeArcs) + MappedVectorSize(_ref) +
+        MappedVectorSize(_oraclePath) + MappedVectorSize(_arcProbs) +
+        MappedVectorSize(_arcBows) + MappedVectorSize(_arcProbSlots) +
+        MappedVectorSize(_arcBowSlots);
+}
+
+// Load the lattice written by SerializeMapped at p as views into the mapped
+// memory, and advance p past it.  Arc weights are left for the caller to
+// compute with UpdateWeights().
+void
+Lattice::DeserializeMapped(char *&p, const char *end) {
+    assert(!_packed);
+    MapHeader(p, end, "Lattice");
+    MapString(p, end, _tag);
+    _finalNode = MapUInt64(p, end);
+    _oracleWER = (int)(int64_t)MapUInt64(p, end);
+    MapVector(p, end, _arcStarts);
+    MapVector(p, end, _arcEnds);
+    MapVector(p, end, _arcWords);
+    MapVector(p, end, _arcBaseWeights);
+    MapVector(p, end, _nodeArcs);
+    MapVector(p, end, _ref);
+    MapVector(p, end, _oraclePath);
+    MapVector(p, end, _arcProbs);
+    MapVector(p, end, _arcBows);
+    MapVector(p, end, _arcProbSlots);
+    MapVector(p, end, _arcBowSlots);
+    size_t numArcs = _arcStarts.length();
+    if (numArcs == 0 || _arcEnds.length() != numArcs ||
+        _arcWords.length() != numArcs || _arcBaseWeights.length() != numArcs ||
+        _nodeArcs.length() != _finalNode + 2 ||
+        (_arcProbSlots.length() != 0 &&
+         (_arcProbSlots.length() != _arcProbs.length() ||
+          _arcBowSlots.length() != _arcBows.length())))
+        throw std::runtime_error("Invalid lattice format.");
+    _ComputeNodeLevels();
+    _BuildRefMasks();
 }
 
 template <typename Compare>
@@ -644,6 +1132,183 @@ Lattice::_Reserve(size_t capacity) {
     _arcBaseWeights.resize(capacity);
 }
 
+// Compute first index in the arcs of each start node, and the node levels.
+void
+Lattice::_ComputeNodeArcs() {
+    size_t numArcs = _arcStarts.length();
+    _nodeArcs.reset(_finalNode + 2);
+    NodeIndex node = (NodeIndex)-1;
+    for (uint i = 0; i < numArcs; ++i) {
+        if (_arcStarts[i] != node) {
+            node = _arcStarts[i];
+            _nodeArcs[node] = i;
+        }
+    }
+    _nodeArcs[_finalNode]   = numArcs;
+    _nodeArcs[_finalNode+1] = numArcs;
+    _ComputeNodeLevels();
+}
+
+// Group nodes by level for the forward and backward passes.  Since arcs are
+// sorted by start node and each arc enters a later node, the level of a node
+// is final before its arcs are visited.
+void
+Lattice::_ComputeNodeLevels() {
+    size_t     numArcs = _arcEnds.length();
+    UIntVector nodeLevels(_finalNode + 1, 0);
+    uint       maxLevel = 0;
+    for (uint i = 0; i < numArcs; ++i) {
+        assert(_arcStarts[i] < _arcEnds[i]);   // No self-transition.
+        uint level = nodeLevels[_arcStarts[i]] + 1;
+        if (level > nodeLevels[_arcEnds[i]]) {
+            nodeLevels[_arcEnds[i]] = level;
+            maxLevel = std::max(maxLevel, level);
+        }
+    }
+
+    _levels.offsets.reset(maxLevel + 2, 0);
+    for (NodeIndex n = 0; n <= _finalNode; ++n)
+        _levels.offsets[nodeLevels[n] + 1]++;
+    for (uint l = 0; l <= maxLevel; ++l)
+        _levels.offsets[l + 1] += _levels.offsets[l];
+    _levels.nodes.reset(_finalNode + 1);
+    UIntVector positions(_finalNode + 1);
+    {
+        UIntVector next(maxLevel + 1);
+        std::copy(_levels.offsets.begin(), _levels.offsets.end() - 1,
+                  next.begin());
+        for (NodeIndex n = 0; n <= _finalNode; ++n) {
+            positions[n] = next[nodeLevels[n]]++;
+            _levels.nodes[positions[n]] = n;
+        }
+    }
+
+    // List the arcs entering each node in arc order, and the arcs leaving
+    // each node from the last back, for the nodes in level order.
+    _levels.inOffsets.reset(_finalNode + 2, 0);
+    _levels.outOffsets.reset(_finalNode + 2, 0);
+    for (uint i = 0; i < numArcs; ++i)
+        _levels.inOffsets[positions[_arcEnds[i]] + 1]++;
+    for (uint j = 0; j <= _finalNode; ++j) {
+        NodeIndex n = _levels.nodes[j];
+        _levels.inOffsets[j + 1]  += _levels.inOffsets[j];
+        _levels.outOffsets[j + 1]  = _levels.outOffsets[j] +
+            _nodeArcs[n + 1] - _nodeArcs[n];
+    }
+    _levels.inArcs.reset(numArcs);
+    _levels.outArcs.reset(numArcs);
+    UIntVector next(_finalNode + 1);
+    std::copy(_levels.inOffsets.begin(), _levels.inOffsets.end() - 1,
+              next.begin());
+    for (uint i = 0; i < numArcs; ++i)
+        _levels.inArcs[next[positions[_arcEnds[i]]]++] = i;
+    for (uint j = 0; j <= _finalNode; ++j) {
+        NodeIndex n = _levels.nodes[j];
+        uint      k = _levels.outOffsets[j];
+        for (uint i = _nodeArcs[n + 1]; i-- > _nodeArcs[n];)
+            _levels.outArcs[k++] = i;
+    }
+}
+
+// Expand the lattice into nodes of (node, LM state), so that each node has
+// a unique n-gram history for _ComputeArcNgramMapping().  States are built
+// lazily from the initial node in topological order, following only the arcs
+// that are reached.  The LM state of a node is its n-gram index of each
+// order below the model order, which is determined by the longest history
+// found in the model, so histories that back off alike share a node.
+void
+Lattice::_ExpandNgramHistories() {
+    const NgramModel &model(_lm.model());
+    size_t numMaps = _lm.order() - 1;
+    size_t numArcs = _arcStarts.length();
+    if (numMaps == 0)
+        return;
+
+    // Expanded nodes of each node, and n-gram indices of each expanded node.
+    vector<vector<NodeIndex> > expandedNodes(_finalNode);
+    vector<NgramIndex>         nodeMaps;
+    vector<NodeNgramMap>       stateNodes(_lm.order());
+    NgramIndex hist = 0;
+    for (size_t o = 1; o <= numMaps; ++o) {
+        if (hist != NgramVector::Invalid)
+            hist = model.vectors(o).Find(hist, Vocab::EndOfSentence);
+        nodeMaps.push_back(hist);
+    }
+    expandedNodes[0].push_back(0);
+    NodeIndex numNodes = 1;
+
+    // Expand arcs of each node in topological order.
+    const NodeIndex    finalNode = std::numeric_limits<NodeIndex>::max();
+    vector<NodeIndex>  newArcStarts, newArcEnds;
+    vector<VocabIndex> newArcWords;
+    vector<float>      newArcBaseWeights;
+    vector<NgramIndex> maps(numMaps);
+    for (uint begin = 0, end; begin < numArcs; begin = end) {
+        NodeIndex node = _arcStarts[begin];
+        for (end = begin + 1; end < numArcs && _arcStarts[end] == node; ++end)
+            ;
+        for (size_t j = 0; j < expandedNodes[node].size(); ++j) {
+            NodeIndex start = expandedNodes[node][j];
+            for (uint i = begin; i < end; ++i) {
+                NodeIndex newEnd = finalNode;
+                if (_arcEnds[i] != _finalNode) {
+                    // Extend history by arc word up to longest known n-gram.
+                    size_t stateOrder = 0;
+                    for (size_t o = 1; o <= numMaps; ++o) {
+                        hist = (o == 1) ? 0 : nodeMaps[start*numMaps + o - 2];
+                        maps[o - 1] = (hist == NgramVector::Invalid) ? hist :
+                            model.vectors(o).Find(hist, _arcWords[i]);
+                        if (maps[o - 1] != NgramVector::Invalid)
+                            stateOrder = o;
+                    }
+                    if (stateOrder == 0)
+                        throw std::runtime_error("FST word not in LM.");
+
+                    // Lower-order indices follow from the longest n-gram.
+                    NodeNgram key(_arcEnds[i], maps[stateOrder - 1]);
+                    NodeNgramMap::const_iterator it =
+                        stateNodes[stateOrder].find(key);
+                    if (it != stateNodes[stateOrder].end()) {
+                        newEnd = it->second;
+                    } else {
+                        newEnd = numNodes++;
+                        stateNodes[stateOrder][key] = newEnd;
+                        expandedNodes[_arcEnds[i]].push_back(newEnd);
+                        nodeMaps.insert(nodeMaps.end(), maps.begin(),
+                                        maps.end());
+                    }
+                }
+                newArcStarts.push_back(start);
+                newArcEnds.push_back(newEnd);
+                newArcWords.push_back(_arcWords[i]);
+                newArcBaseWeights.push_back(_arcBaseWeights[i]);
+            }
+        }
+    }
+
+    // Renumber expanded nodes in topological order of original nodes.
+    NodeVector newNodes(numNodes);
+    NodeIndex  newNode = 0;
+    for (NodeIndex n = 0; n < _finalNode; ++n)
+        for (size_t j = 0; j < expandedNodes[n].size(); ++j)
+            newNodes[expandedNodes[n][j]] = newNode++;
+    _finalNode = newNode;
+    numArcs    = newArcStarts.size();
+    _arcStarts.reset(numArcs);
+    _arcEnds.reset(numArcs);
+    _arcWords.reset(numArcs);
+    _arcBaseWeights.reset(numArcs);
+    for (uint i = 0; i < numArcs; ++i) {
+        _arcStarts[i]      = newNodes[newArcStarts[i]];
+        _arcEnds[i]        = (newArcEnds[i] == finalNode)
+            ? _finalNode : newNodes[newArcEnds[i]];
+        _arcWords[i]       = newArcWords[i];
+        _arcBaseWeights[i] = newArcBaseWeights[i];
+    }
+    _Sort(numArcs, ArcCompare(*this));
+    _ComputeNodeArcs();
+}
+
 void
 Lattice::_ComputeArcNgramMapping() {
     // Build node to ngramIndex mapping for lower-order n-grams.
@@ -811,35 +1476,168 @@ Lattice::_FindBestPath(const ArcScoreVector &bestArcs,
     return bestArcs[0].score;
 }
 
+// Find the n best paths by Eppstein's k shortest paths algorithm, using the
+// costs to the final node in bestArcs.  A path is represented by the
+// sidetracks it takes off the best paths to the final node, each costing
+// the extra score of the arc over the best arc of its start node.  The
+// sidetracks reachable from each node by best arcs are kept in persistent
+// heaps shared with its best successor, so that each path extracted adds at
+// most four candidates.  If nbestArcs is not NULL, also return the arcs of
+// each path.
 void
-Lattice::_FindNBestPaths(const ArcScoreVector &bestArcs,
-                         size_t n,
-                         vector<float> &nbestScores) const {
-    // Perform forward A* search using bestNodeScore as future scores.
-    // Priority queue stores the transition index and forward score up to end.
-    // To find n-best, do not prune paths.
+Lattice::_FindNBestPaths(const ArcScoreVector &bestArcs, size_t n,
+                         vector<float> &nbestScores,
+                         vector<vector<uint> > *nbestArcs) const {
+    const uint Null = (uint)-1;
+    size_t numArcs = _arcStarts.length();
     nbestScores.clear();
-    std::priority_queue<Path> paths;
-    for (uint i = _nodeArcs[0]; i < _nodeArcs[1]; ++i) {
-        NodeIndex node = _arcEnds[i];
-        paths.push(Path(_arcWeights[i] + bestArcs[node].score, node));
+    if (nbestArcs != NULL)
+        nbestArcs->clear();
+    if (n == 0 || numArcs == 0)
+        return;
+
+    // Compute sidetrack costs, grouped by start node and sorted by cost.
+    FloatVector deltas(numArcs);
+    for (uint i = 0; i < numArcs; ++i)
+        deltas[i] = _arcWeights[i] + bestArcs[_arcEnds[i]].score -
+                    bestArcs[_arcStarts[i]].score;
+    vector<uint> sidetracks;
+    sidetracks.reserve(numArcs);
+    vector<SidetrackHeap> heapNodes;
+    vector<uint>          heaps(_finalNode + 1, Null);
+    DeltaCompare          compare(deltas);
+    for (uint end = numArcs; end > 0; ) {
+        NodeIndex node  = _arcStarts[end - 1];
+        uint      begin = _nodeArcs[node];
+        uint      first = sidetracks.size();
+        for (uint i = begin; i < end; ++i)
+            if (i != bestArcs[node].arc)
+                sidetracks.push_back(i);
+        std::sort(sidetracks.begin() + first, sidetracks.end(), compare);
+
+        // Insert node into the heap of its best successor.
+        uint next = heaps[_arcEnds[bestArcs[node].arc]];
+        if (first < sidetracks.size()) {
+            heapNodes.push_back(SidetrackHeap(first, sidetracks.size()));
+            heaps[node] = _MergeSidetrackHeaps(heapNodes, deltas, sidetracks,
+                                               next, heapNodes.size() - 1);
+        } else
+            heaps[node] = next;
+        end = begin;
     }
-    while (!paths.empty()) {
-        Path      path = paths.top();
-        NodeIndex node = path.node;
-        paths.pop();
-        if (node == _finalNode) {
-            nbestScores.push_back(path.score);
-            if (--n == 0) return;
-        } else {
-            float baseScore = path.score - bestArcs[node].score;
-            for (uint i = _nodeArcs[node]; i < _nodeArcs[node + 1]; ++i) {
-                float score = baseScore + _arcWeights[i] +
-                              bestArcs[_arcEnds[i]].score;
-                paths.push(Path(score, _arcEnds[i]));
+
+    // Extract paths in order of score, starting from the best path.
+    vector<std::pair<uint, uint> > paths;  // Last sidetrack, parent path
+    std::priority_queue<NBestPath> candidates;
+    paths.push_back(std::make_pair(Null, Null));
+    nbestScores.push_back(bestArcs[0].score);
+    if (heaps[0] != Null) {
+        uint first = heapNodes[heaps[0]].first;
+        candidates.push(NBestPath(bestArcs[0].score +
+                                  deltas[sidetracks[first]],
+                                  heaps[0], first, 0));
+    }
+    while (paths.size() < n && !candidates.empty()) {
+        NBestPath path = candidates.top();
+        candidates.pop();
+        uint  arc  = sidetracks[path.sidetrack];
+        float base = path.score - deltas[arc];
+        paths.push_back(std::make_pair(arc, path.parent));
+        nbestScores.push_back(path.score);
+
+        // Replace the sidetrack with the next ones in the heap.
+        const SidetrackHeap &heap = heapNodes[path.heap];
+        if (path.sidetrack == heap.first) {
+            uint children[2] = { heap.left, heap.right };
+            for (int c = 0; c < 2; ++c) {
+                if (children[c] == Null) continue;
+                uint first = heapNodes[children[c]].first;
+                candidates.push(NBestPath(base + deltas[sidetracks[first]],
+                                          children[c], first, path.parent));
+            }
+        }
+        if (path.sidetrack + 1 < heap.last)
+            candidates.push(NBestPath(
+                base + deltas[sidetracks[path.sidetrack + 1]],
+                path.heap, path.sidetrack + 1, path.parent));
+
+        // Take another sidetrack after this one.
+        uint next = heaps[_arcEnds[arc]];
+        if (next != Null) {
+            uint first = heapNodes[next].first;
+            candidates.push(NBestPath(path.score + deltas[sidetracks[first]],
+                                      next, first, paths.size() - 1));
+        }
+    }
+    if (nbestArcs == NULL)
+        return;
+
+    // Follow best arcs between the sidetracks of each path.
+    vector<uint> pathSidetracks;
+    nbestArcs->resize(paths.size());
+    for (size_t k = 0; k < paths.size(); ++k) {
+        pathSidetracks.clear();
+        for (uint p = k; paths[p].first != Null; p = paths[p].second)
+            pathSidetracks.push_back(paths[p].first);
+        vector<uint> &arcs((*nbestArcs)[k]);
+        NodeIndex node = 0;
+        while (node != _finalNode) {
+            uint arc = bestArcs[node].arc;
+            if (!pathSidetracks.empty() &&
+                _arcStarts[pathSidetracks.back()] == node) {
+                arc = pathSidetracks.back();
+                pathSidetracks.pop_back();
             }
+            arcs.push_back(arc);
+            node = _arcEnds[arc];
+        }
+    }
+}
+
+// Merge persistent sidetrack heaps a and b, copying the nodes on the merge
+// path instead of modifying them.
+uint
+Lattice::_MergeSidetrackHeaps(vector<SidetrackHeap> &heapNodes,
+                              const FloatVector &deltas,
+                              const vector<uint> &sidetracks,
+                              uint a, uint b) {
+    const uint Null = (uint)-1;
+    if (a == Null) return b;
+    if (b == Null) return a;
+    if (deltas[sidetracks[heapNodes[b].first]] <
+        deltas[sidetracks[heapNodes[a].first]])
+        std::swap(a, b);
+    SidetrackHeap node(heapNodes[a]);
+    node.right = _MergeSidetrackHeaps(heapNodes, deltas, sidetracks,
+                                      node.right, b);
+    uint leftRank  = (node.left == Null) ? 0 : heapNodes[node.left].rank;
+    uint rightRank = heapNodes[node.right].rank;
+    if (leftRank < rightRank)
+        std::swap(node.left, node.right);
+    node.rank = std::min(leftRank, rightRank) + 1;
+    heapNodes.push_back(node);
+    return heapNodes.size() - 1;
+}
+
+// Return the score of the best path other than the best path, which leaves
+// the best path by a single sidetrack, or INF if there is none.
+float
+Lattice::_FindRunnerUpScore(const ArcScoreVector &bestArcs) const {
+    float     runnerUpScore = INF;
+    float     pathScore     = 0;
+    NodeIndex node          = 0;
+    while (node != _finalNode) {
+        uint bestArc = bestArcs[node].arc;
+        for (uint i = _nodeArcs[node]; i < _nodeArcs[node + 1]; ++i) {
+            float score = pathScore + _arcWeights[i] +
+                          bestArcs[_arcEnds[i]].score;
+            if (i != bestArc && score < runnerUpScore)
+                runnerUpScore = score;
         }
+        pathScore += _arcWeights[bestArc];
+        node = _arcEnds[bestArc];
     }
+    return runnerUpScore;
 }
 
 bool
@@ -48,6 +48,8 @@ using std::string;
 
 namespace mitlm {
 
+struct SidetrackHeap;
+
 const float INF = std::numeric_limits<float>::infinity();
 
 inline float logAdd(float logX, float logY) {
@@ -78,10 +80,18 @@ class Lattice {
     };
     typedef DenseVector<ArcScore>  ArcScoreVector;
 
-    struct WordProb {
-        WordProb(VocabIndex w, float p) : word(w), prob(p) { }
-        VocabIndex word;
-        float      prob;
+    // Nodes grouped by topological level, the length of the longest path
+    // from the initial node.  Arcs leaving nodes of one level only enter
+    // nodes of later levels, so they can be scored as a batch.  The arcs
+    // entering and leaving each node are listed for the nodes in level
+    // order, so the arcs of each level are contiguous.
+    struct NodeLevels {
+        UIntVector nodes;       // Nodes ordered by level
+        UIntVector offsets;     // Index in nodes of the first of each level
+        UIntVector inArcs;      // Arcs entering each node, in arc order
+        UIntVector inOffsets;   // Index in inArcs of the arcs of nodes[j]
+        UIntVector outArcs;     // Arcs leaving each node, from the last back
+        UIntVector outOffsets;  // Index in outArcs of the arcs of nodes[j]
     };
 
     const NgramLMBase & _lm;
@@ -98,18 +108,55 @@ class Lattice {
     int                 _oracleWER;
     ArcNgramIndexVector _arcProbs;
     ArcNgramIndexVector _arcBows;
+    UIntVector          _arcProbSlots;  // Shared log prob slot of _arcProbs
+    UIntVector          _arcBowSlots;   // Shared log prob slot of _arcBows
+    VocabVector         _refVocab;      // Sorted unique words of _ref
+    DenseVector<uint64_t> _refMasks;    // _ref positions of each _refVocab
     bool                _skipTags;
+    bool                _expandHistories;  // Split nodes by n-gram history
+    bool                _packed;    // Arrays view an arena; do not reallocate
+    bool                _fastLogAdd;  // Approximate forward-backward sums
+    NodeLevels          _levels;    // Computed by _ComputeNodeLevels()
 
 public:
-    Lattice(const NgramLMBase &lm) : _lm(lm), _skipTags(true) { }
+    // Scratch buffers for evaluating lattices, reused across calls.  Each
+    // thread evaluating lattices concurrently needs its own Scratch.
+    struct Scratch {
+        ArcScoreVector     bestArcs;
+        vector<VocabIndex> hyp;
+        IntVector          editScores;
+        DenseVector<uint64_t> editBits;
+    };
+
+    // Word errors of an alignment of the best path with the reference.
+    struct EditCounts {
+        EditCounts() : substitutions(0), deletions(0), insertions(0) { }
+        int substitutions;
+        int deletions;
+        int insertions;
+    };
+
+    Lattice(const NgramLMBase &lm)
+        : _lm(lm), _skipTags(true), _expandHistories(false),
+          _packed(false), _fastLogAdd(false) { }
     void  SetTag(const char *tag) { _tag = tag; }
+    void  SetExpandHistories(bool expand) { _expandHistories = expand; }
+    void  SetFastLogAdd(bool fast) { _fastLogAdd = fast; }
     void  LoadLattice(ZFile &latticeFile);
     void  SaveLattice(ZFile &latticeFile) const;
     void  UpdateWeights();
+    void  UpdateWeights(const DoubleVector &slotLogs,
+                        const BitVector &changedSlots);
     void  SetReferenceText(const char *ref);
+    size_t Prune(float minPosterior);
     float ComputeMargin() const;
+    float ComputeMargin(Scratch &scratch) const;
     int   ComputeWER() const;
+    int   ComputeWER(Scratch &scratch) const;
+    int   ComputeWER(Scratch &scratch, EditCounts &counts) const;
     void  GetBestPath(vector<VocabIndex> &bestPath) const;
+    void  GetNBestPaths(size_t n, vector<float> &nbestScores,
+                        vector<vector<VocabIndex> > &nbestPaths) const;
 
     void  ComputeForwardScores(FloatVector &nodeScores) const;
     void  ComputeBackwardScores(FloatVector &nodeScores) const;
@@ -127,6 +174,9 @@ public:
 
     void  Serialize(FILE *outFile) const;
     void  Deserialize(FILE *inFile);
+    void  SerializeMapped(FILE *outFile) const;
+    size_t MappedSize() const;
+    void  DeserializeMapped(char *&p, const char *end);
 
     const char *       tag() const        { return _tag.c_str(); }
     const VocabVector &refWords() const   { return _ref; }
@@ -142,14 +192,40 @@ private:
     template <typename Compare>
     void  _Sort(size_t numTrans, const Compare &compare);
     void  _Reserve(size_t capacity);
+    void  _ComputeNodeArcs();
+    void  _ComputeNodeLevels();
+    void  _ExpandNgramHistories();
     void  _ComputeArcNgramMapping();
     float _FindOraclePath();
     void  _ReverseViterbiSearch(ArcScoreVector &bestArcs) const;
     float _FindBestPath(const ArcScoreVector &bestArcs,
                         vector<VocabIndex> &bestPath) const;
-    void  _FindNBestPaths(const ArcScoreVector &bestArcs,
-                          size_t n, vector<float> &nbestScores) const;
+    void  _FindNBestPaths(const ArcScoreVector &bestArcs, size_t n,
+                          vector<float> &nbestScores,
+                          vector<vector<uint> > *nbestArcs = NULL) const;
+    static uint _MergeSidetrackHeaps(vector<SidetrackHeap> &heapNodes,
+                                     const FloatVector &deltas,
+                                     const vector<uint> &sidetracks,
+                                     uint a, uint b);
+    float _FindRunnerUpScore(const ArcScoreVector &bestArcs) const;
     bool  _IsOracleBestPath(const ArcScoreVector &bestArcs) const;
+    int   _EditDistance(const vector<VocabIndex> &hyp, Scratch &scratch) const;
+    void  _BuildRefMasks();
+    void  _LogAddLevel(const UIntVector &offsets, uint first, uint last,
+                       const FloatVector &scores, DoubleVector &terms,
+                       FloatVector &nodeScores) const;
+    template <typename NodeFunc>
+    void  _ForwardPass(float initScore, FloatVector &nodeScores,
+                       FloatVector &arcScores, const NodeFunc &nodeFunc) const;
+    template <typename NodeFunc>
+    void  _BackwardPass(float initScore, FloatVector &nodeScores,
+                        FloatVector &arcScores,
+                        const NodeFunc &nodeFunc) const;
+    void  _ComputeForwardScores(FloatVector &nodeScores,
+                                FloatVector &arcScores) const;
+    void  _ComputeBackwardScores(FloatVector &nodeScores,
+                                 FloatVector &arcScores) const;
+    const uint64_t *_FindRefMask(VocabIndex word) const;
 
 };
 
@@ -0,0 +1,263 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include "util/FastHash.h"
+#include "LazyInterpolatedNgramLM.h"
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Backoff weight of a history, cached per thread.  Entries of all models
+// share the cache and are told apart by cacheId, which changes with the
+// model parameters.
+struct BowCacheEntry {
+    BowCacheEntry() : cacheId(0), histLen(0), bow(0) { }
+    uint64_t   cacheId;
+    size_t     histLen;
+    VocabIndex hist[LazyInterpolatedNgramLM::kMaxOrder];
+    Prob       bow;
+};
+
+static const size_t kBowCacheSize = 1 << 13;
+
+static std::atomic<uint64_t> nextCacheId(1);
+
+////////////////////////////////////////////////////////////////////////////////
+
+LazyInterpolatedNgramLM::LazyInterpolatedNgramLM(size_t order,
+                                                 bool tieParamOrder)
+    : NgramLMBase(order), _tieParamOrder(tieParamOrder),
+      _cacheId(nextCacheId++) { }
+
+void
+LazyInterpolatedNgramLM::LoadLMs(const vector<SharedPtr<NgramLMBase> > &lms) {
+    if (_order >= kMaxOrder)
+        throw std::invalid_argument("Unsupported n-gram order.");
+    _lms = lms;
+
+    // Build union vocabulary and maps to and from component vocabularies.
+    _vocabMaps.resize(_lms.size());
+    _lmVocabMaps.resize(_lms.size());
+    for (size_t l = 0; l < _lms.size(); ++l)
+        _pModel->ExtendVocab(_lms[l]->vocab(), _lmVocabMaps[l]);
+    for (size_t l = 0; l < _lms.size(); ++l) {
+        const VocabVector &lmVocabMap(_lmVocabMaps[l]);
+        _vocabMaps[l].reset(vocab().size(), Vocab::Invalid);
+        for (size_t i = 0; i < lmVocabMap.length(); ++i)
+            _vocabMaps[l][lmVocabMap[i]] = i;
+    }
+
+    // Index the children of each component n-gram by history.
+    _childStarts.resize(_lms.size());
+    _children.resize(_lms.size());
+    for (size_t l = 0; l < _lms.size(); ++l) {
+        const NgramModel &model(_lms[l]->model());
+        _childStarts[l].resize(model.size());
+        _children[l].resize(model.size());
+        for (size_t o = 1; o + 1 < model.size(); ++o) {
+            const IndexVector &hists(model.hists(o + 1));
+            IndexVector &starts(_childStarts[l][o]);
+            IndexVector &children(_children[l][o]);
+            starts.reset(model.sizes(o) + 1, 0);
+            children.reset(hists.length());
+            for (size_t i = 0; i < hists.length(); ++i)
+                ++starts[hists[i] + 1];
+            for (size_t i = 1; i < starts.length(); ++i)
+                starts[i] += starts[i - 1];
+            IndexVector next(model.sizes(o));
+            for (size_t i = 0; i < next.length(); ++i)
+                next[i] = starts[i];
+            for (size_t i = 0; i < hists.length(); ++i)
+                children[next[hists[i]]++] = i;
+        }
+    }
+
+    // Default to equal weights.
+    _defParams.reset((_lms.size() - 1) * (_tieParamOrder ? 1 : _order), 0);
+    Estimate(_defParams);
+}
+
+// Set the interpolation weights from the bias parameters, laid out as in
+// InterpolatedNgramLM with linear interpolation of LMs without parameters.
+bool
+LazyInterpolatedNgramLM::Estimate(const ParamVector &params, Mask *) {
+    size_t numLMs = _lms.size();
+    if (params.length() != _defParams.length())
+        throw std::invalid_argument("Number of parameters mismatched.");
+    _weights.assign((_order + 1) * numLMs, 0);
+    for (size_t o = 1; o <= _order; ++o) {
+        const Param *pBiasParams =
+            &params[_tieParamOrder ? 0 : (o - 1) * (numLMs - 1)];
+        double *weights   = &_weights[o * numLMs];
+        double  totWeight = weights[0] = 1;
+        for (size_t l = 1; l < numLMs; ++l)
+            totWeight += weights[l] = std::exp(pBiasParams[l - 1]);
+        for (size_t l = 0; l < numLMs; ++l)
+            weights[l] /= totWeight;
+    }
+    _cacheId = nextCacheId++;
+    return true;
+}
+
+// Returns the interpolated probability of the last word given the preceding
+// wordsLen - 1 words, backing off as in a merged backoff LM.
+Prob
+LazyInterpolatedNgramLM::ComputeProb(const VocabIndex *words,
+                                     size_t wordsLen) const {
+    Prob   bow = 1.0;
+    size_t boOrder = wordsLen;
+    while (boOrder > 1 && !_Exists(&words[wordsLen - boOrder], boOrder)) {
+        --boOrder;
+        bow *= _FindBow(&words[wordsLen - boOrder - 1], boOrder);
+    }
+    return bow * _ComputeMixedProb(&words[wordsLen - boOrder], boOrder);
+}
+
+// Map the longest suffix of words in the vocabulary of LM l to lmWords,
+// up to the order of LM l, and return its length.
+size_t
+LazyInterpolatedNgramLM::_MapWords(size_t l, const VocabIndex *words,
+                                   size_t wordsLen,
+                                   VocabIndex *lmWords) const {
+    const VocabVector &vocabMap(_vocabMaps[l]);
+    size_t maxLen = std::min(wordsLen, _lms[l]->model().size() - 1);
+    size_t len    = 0;
+    while (len < maxLen &&
+           vocabMap[words[wordsLen - len - 1]] != Vocab::Invalid)
+        ++len;
+    for (size_t i = 0; i < len; ++i)
+        lmWords[i] = vocabMap[words[wordsLen - len + i]];
+    return len;
+}
+
+// Return whether the n-gram is in any component LM.
+bool
+LazyInterpolatedNgramLM::_Exists(const VocabIndex *words,
+                                 size_t wordsLen) const {
+    VocabIndex lmWords[kMaxOrder];
+    for (size_t l = 0; l < _lms.size(); ++l)
+        if (_MapWords(l, words, wordsLen, lmWords) == wordsLen &&
+            _lms[l]->model().Find(lmWords, wordsLen) != -1)
+            return true;
+    return false;
+}
+
+// Return the backoff probability of LM l, or 0 if the word is not in LM l.
+Prob
+LazyInterpolatedNgramLM::_ComputeLMProb(size_t l, const VocabIndex *words,
+                                        size_t wordsLen) const {
+    VocabIndex lmWords[kMaxOrder];
+    size_t     len = _MapWords(l, words, wordsLen, lmWords);
+    if (len == 0 || _lms[l]->model().Find(&lmWords[len - 1], 1) == -1)
+        return 0;
+    return _lms[l]->ComputeProb(lmWords, len);
+}
+
+Prob
+LazyInterpolatedNgramLM::_ComputeMixedProb(const VocabIndex *words,
+                                           size_t wordsLen) const {
+    const double *weights = &_weights[wordsLen * _lms.size()];
+    double        prob    = 0;
+    for (size_t l = 0; l < _lms.size(); ++l)
+        if (weights[l] > 0)
+            prob += weights[l] * _ComputeLMProb(l, words, wordsLen);
+    return prob;
+}
+
+// Compute the backoff weight of the history from the interpolated
+// probabilities of the union of its children in the component LMs.
+Prob
+LazyInterpolatedNgramLM::_ComputeBow(const VocabIndex *hist,
+                                     size_t histLen) const {
+    VocabIndex         lmWords[kMaxOrder];
+    vector<VocabIndex> childWords;
+    bool               found = false;
+    for (size_t l = 0; l < _lms.size(); ++l) {
+        const NgramModel &model(_lms[l]->model());
+        if (histLen + 1 >= model.size() ||
+            _MapWords(l, hist, histLen, lmWords) != histLen)
+            continue;
+        NgramIndex index = model.Find(lmWords, histLen);
+        if (index == -1)
+            continue;
+        found = true;
+        const IndexVector &starts(_childStarts[l][histLen]);
+        const IndexVector &children(_children[l][histLen]);
+        const VocabVector &words(model.words(histLen + 1));
+        for (NgramIndex i = starts[index]; i < starts[index + 1]; ++i)
+            childWords.push_back(_lmVocabMaps[l][words[children[i]]]);
+    }
+    if (!found)
+        return 1;
+    std::sort(childWords.begin(), childWords.end());
+    childWords.erase(std::unique(childWords.begin(), childWords.end()),
+                     childWords.end());
+
+    VocabIndex words[kMaxOrder];
+    std::copy(hist, hist + histLen, words);
+    double numerator = 0, denominator = 0;
+    for (size_t i = 0; i < childWords.size(); ++i) {
+        words[histLen] = childWords[i];
+        numerator   += _ComputeMixedProb(words, histLen + 1);
+        denominator += ComputeProb(&words[1], histLen);
+    }
+    return (1 - numerator) / (1 - denominator);
+}
+
+Prob
+LazyInterpolatedNgramLM::_FindBow(const VocabIndex *hist,
+                                  size_t histLen) const {
+    static thread_local vector<BowCacheEntry> cache;
+    if (cache.empty())
+        cache.resize(kBowCacheSize);
+    size_t hash = SuperFastHash((const char *)hist,
+                                histLen * sizeof(VocabIndex));
+    BowCacheEntry &entry(cache[hash % kBowCacheSize]);
+    if (entry.cacheId == _cacheId && entry.histLen == histLen &&
+        std::equal(hist, hist + histLen, entry.hist))
+        return entry.bow;
+    Prob bow = _ComputeBow(hist, histLen);
+    entry.cacheId = _cacheId;
+    entry.histLen = histLen;
+    std::copy(hist, hist + histLen, entry.hist);
+    entry.bow = bow;
+    return bow;
+}
+
+}
@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef LAZYINTERPOLATEDNGRAMLM_H
+#define LAZYINTERPOLATEDNGRAMLM_H
+
+#include <vector>
+#include "util/SharedPtr.h"
+#include "Types.h"
+#include "NgramModel.h"
+#include "NgramLM.h"
+
+using std::vector;
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+// LazyInterpolatedNgramLM linearly interpolates component LMs at query time.
+// Unlike InterpolatedNgramLM, the components are not merged into a shared
+// NgramModel, so memory does not grow with the number of components times
+// the union of their n-grams.  The model behaves as the statically
+// interpolated backoff LM over the union of component n-grams: the backoff
+// weight of a history is normalized over the union of its children when it
+// is first needed, and cached per thread.  Only ComputeProb() is supported.
+//
+class LazyInterpolatedNgramLM : public NgramLMBase {
+public:
+    static const size_t kMaxOrder = 10;  // Supported orders are below this
+
+protected:
+    vector<SharedPtr<NgramLMBase> > _lms;
+    vector<VocabVector>             _vocabMaps;    // Vocab to LM vocab index
+    vector<VocabVector>             _lmVocabMaps;  // LM vocab to vocab index
+    vector<vector<IndexVector> >    _childStarts;  // First child of n-grams
+    vector<vector<IndexVector> >    _children;     // N-grams sorted by hist
+    vector<double>                  _weights;      // LM weights of each order
+    bool                            _tieParamOrder;
+    uint64_t                        _cacheId;      // Key of cached bows
+
+public:
+    LazyInterpolatedNgramLM(size_t order = 3, bool tieParamOrder = false);
+    void   LoadLMs(const vector<SharedPtr<NgramLMBase> > &lms);
+    size_t numLMs() const { return _lms.size(); }
+
+    virtual bool Estimate(const ParamVector &params, Mask *pMask=NULL);
+    virtual Prob ComputeProb(const VocabIndex *words, size_t wordsLen) const;
+
+private:
+    size_t _MapWords(size_t l, const VocabIndex *words, size_t wordsLen,
+                     VocabIndex *lmWords) const;
+    bool   _Exists(const VocabIndex *words, size_t wordsLen) const;
+    Prob   _ComputeLMProb(size_t l, const VocabIndex *words,
+                          size_t wordsLen) const;
+    Prob   _ComputeMixedProb(const VocabIndex *words, size_t wordsLen) const;
+    Prob   _ComputeBow(const VocabIndex *hist, size_t histLen) const;
+    Prob   _FindBow(const VocabIndex *hist, size_t histLen) const;
+};
+
+}
+
+#endif // LAZYINTERPOLATEDNGRAMLM_H
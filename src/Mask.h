@@ -66,9 +66,11 @@ struct KneserNeySmoothingMask : public Mask {
 ////////////////////////////////////////////////////////////////////////////////
 
 struct InterpolatedNgramLMMask : public Mask {
+    uint64_t                  Id;  // Unique id of the mask, never 0
     vector<BitVector>         ProbMaskVectors;
     vector<BitVector>         BowMaskVectors;
     vector<BitVector>         WeightMaskVectors;
+    vector<IndexVector>       SparseNgramVectors;  // Probs and their backoffs
     vector<SharedPtr<Mask> >  LMMasks;
 };
 
@@ -32,11 +32,16 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
 ////////////////////////////////////////////////////////////////////////////
 
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include "util/FastIO.h"
 #include "util/CommandOptions.h"
+#include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "Types.h"
 #include "NgramModel.h"
 #include "NgramLM.h"
@@ -50,7 +55,8 @@ namespace mitlm {
 
 NgramLMBase::NgramLMBase(size_t order)
     : _pModel(new NgramModel(order)), _order(order),
-      _probVectors(order + 1), _bowVectors(order + 1) {
+      _probVectors(order + 1), _bowVectors(order + 1), _sparse(false),
+      _pruned(false) {
 }
 
 void
@@ -66,8 +72,8 @@ NgramLMBase::SaveVocab(ZFile &vocabFile, bool asBinary) const {
 void
 NgramLMBase::SaveLM(ZFile &lmFile, bool asBinary) const {
     if (asBinary) {
-        WriteUInt64(lmFile, MITLMv1);
-        Serialize(lmFile);
+        WriteUInt64(lmFile, MITLMv2);
+        SerializeMapped(lmFile);
     } else
         _pModel->SaveLM(_probVectors, _bowVectors, lmFile);
 }
@@ -86,6 +92,7 @@ void
 NgramLMBase::Deserialize(FILE *inFile) {
     VerifyHeader(inFile, "NgramLM");
     _pModel->Deserialize(inFile);
+    _ClearQuantized();
     SetOrder(_pModel->size() - 1);
     for (size_t o = 0; o <= order(); ++o)
         ReadVector(inFile, _probVectors[o]);
@@ -93,12 +100,99 @@ NgramLMBase::Deserialize(FILE *inFile) {
         ReadVector(inFile, _bowVectors[o]);
 }
 
+// Writes the LM in a memory-mappable layout.  If the LM has been quantized,
+// the quantized probabilities and backoff weights are written instead.
+void
+NgramLMBase::SerializeMapped(FILE *outFile) const {
+    if (quantized()) {
+        WriteHeader(outFile, "QuantizedNgramLM");
+        _pModel->SerializeMapped(outFile);
+        for (size_t o = 0; o <= order(); ++o)
+            _quantProbVectors[o].Serialize(outFile);
+        for (size_t o = 0; o < order(); ++o)
+            _quantBowVectors[o].Serialize(outFile);
+    } else {
+        WriteHeader(outFile, "NgramLM");
+        _pModel->SerializeMapped(outFile);
+        for (size_t o = 0; o <= order(); ++o)
+            WriteVector(outFile, _probVectors[o]);
+        for (size_t o = 0; o < order(); ++o)
+            WriteVector(outFile, _bowVectors[o]);
+    }
+}
+
+// Loads the LM written by SaveLM(asBinary=true) from mappedFile, starting with
+// the MITLMv2 version tag.  All vectors are views into the mapped memory, so
+// loading takes constant time and the pages are shared among processes
+// loading the same LM.  Quantized probabilities and backoff weights are
+// decoded into probs() and bows() unless decodeQuantized is false, in which
+// case only ComputeProb() is supported.
+void
+NgramLMBase::DeserializeMapped(const SharedPtr<MappedFile> &mappedFile,
+                               bool decodeQuantized) {
+    char       *p = mappedFile->data();
+    const char *end = p + mappedFile->size();
+    if (MapUInt64(p, end) != MITLMv2)
+        throw std::runtime_error("Invalid file format.");
+    _pMappedFile = mappedFile;
+    bool isQuantized = MatchHeader(p, end, "QuantizedNgramLM");
+    if (!isQuantized)
+        MapHeader(p, end, "NgramLM");
+    _pModel->DeserializeMapped(mappedFile, p);
+    _ClearQuantized();
+    SetOrder(_pModel->size() - 1);
+    if (isQuantized) {
+        _quantProbVectors.resize(order() + 1);
+        _quantBowVectors.resize(order());
+        for (size_t o = 0; o <= order(); ++o) {
+            _quantProbVectors[o].DeserializeMapped(p, end);
+            if (decodeQuantized)
+                _quantProbVectors[o].Decode(_probVectors[o]);
+            else
+                _probVectors[o].reset(0);
+        }
+        for (size_t o = 0; o < order(); ++o) {
+            _quantBowVectors[o].DeserializeMapped(p, end);
+            if (decodeQuantized)
+                _quantBowVectors[o].Decode(_bowVectors[o]);
+            else
+                _bowVectors[o].reset(0);
+        }
+    } else {
+        for (size_t o = 0; o <= order(); ++o)
+            MapVector(p, end, _probVectors[o]);
+        for (size_t o = 0; o < order(); ++o)
+            MapVector(p, end, _bowVectors[o]);
+    }
+}
+
+// Quantizes the probabilities and backoff weights of each order to the
+// specified number of bits.  probs() and bows() are replaced with the
+// quantized values, and SaveLM(asBinary=true) writes the quantized form.
+void
+NgramLMBase::Quantize(size_t bits) {
+    _quantProbVectors.resize(order() + 1);
+    _quantBowVectors.resize(order());
+    for (size_t o = 0; o <= order(); ++o) {
+        _quantProbVectors[o].Quantize(_probVectors[o], bits, (Prob)0);
+        _quantProbVectors[o].Decode(_probVectors[o]);
+    }
+    for (size_t o = 0; o < order(); ++o) {
+        _quantBowVectors[o].Quantize(_bowVectors[o], bits, (Prob)1);
+        _quantBowVectors[o].Decode(_bowVectors[o]);
+    }
+}
+
 void
 NgramLMBase::SetOrder(size_t order) {
     _pModel->SetOrder(order);
     _order = order;
     _probVectors.resize(order + 1);
     _bowVectors.resize(order);
+    if (quantized()) {
+        _quantProbVectors.resize(order + 1);
+        _quantBowVectors.resize(order);
+    }
 }
 
 Mask *
@@ -116,6 +210,10 @@ void
 NgramLMBase::SetModel(const SharedPtr<NgramModel> &m,
                       const VocabVector &vocabMap,
                       const vector<IndexVector> &ngramMap) {
+    if (_sparse) {
+        _SetSparseModel(m, ngramMap);
+        return;
+    }
     for (size_t o = 1; o <= _order; ++o) {
         size_t len = m->sizes(o);
         NgramModel::ApplySort(ngramMap[o], _probVectors[o], len, (Prob)0);
@@ -123,6 +221,7 @@ NgramLMBase::SetModel(const SharedPtr<NgramModel> &m,
             NgramModel::ApplySort(ngramMap[o], _bowVectors[o], len, (Prob)1);
     }
     _pModel = m;
+    _ClearQuantized();
 
     // Fill in missing probabilities with backoff values.
     for (size_t o = 1; o <= _order; ++o) {
@@ -137,14 +236,359 @@ NgramLMBase::SetModel(const SharedPtr<NgramModel> &m,
     }
 }
 
+// Returns the probability of n-gram i of order o of a sparse LM.  N-grams
+// without an explicit probability back off to lower orders, computing the
+// same values as SetModel() fills in for a dense LM.
+Prob
+NgramLMBase::_SparseProb(size_t o, NgramIndex i) const {
+    NgramIndex rank;
+    if (o == 0)
+        return _probVectors[0][i];
+    if (_FindExplicit(o, i, rank) && _probVectors[o][rank] != 0)
+        return _probVectors[o][rank];
+    return _SparseProb(o - 1, backoffs(o)[i]) * _SparseBow(o - 1, hists(o)[i]);
+}
+
+// Computes the probabilities of the n-grams of order o > 0 into probs, given
+// those of order o - 1 in boProbs.  Sparse LMs look up their explicit n-grams
+// in order and fill the gaps by backing off once to boProbs.  If pNgrams is
+// given, only its ascending n-grams are computed, and boProbs need only hold
+// their backoffs.
+void
+NgramLMBase::GetOrderProbs(size_t o, const ProbVector &boProbs,
+                           ProbVector &probs,
+                           const IndexVector *pNgrams) const {
+    assert(o > 0 && boProbs.length() == sizes(o - 1));
+    probs.reset(sizes(o));
+    if (!sparse()) {
+        probs = _probVectors[o];
+        return;
+    }
+    const IndexVector &hists(this->hists(o));
+    const IndexVector &backoffs(this->backoffs(o));
+    const Prob *       explicitProbs = _probVectors[o].begin();
+
+    // Back off for n-grams without an explicit probability, reusing the
+    // backoff weight of the previous history.
+    auto computeProb = [&](NgramIndex i, NgramIndex &hist, Prob &bow) {
+        NgramIndex rank;
+        if (_FindExplicit(o, i, rank) && explicitProbs[rank] != 0) {
+            probs[i] = explicitProbs[rank];
+            return;
+        }
+        if (hists[i] != hist) {
+            hist = hists[i];
+            bow  = _SparseBow(o - 1, hist);
+        }
+        probs[i] = boProbs[backoffs[i]] * bow;
+    };
+    if (pNgrams != NULL) {
+        NgramIndex hist = NgramVector::Invalid;
+        Prob       bow = 1;
+        for (size_t k = 0; k < pNgrams->length(); ++k)
+            computeProb((*pNgrams)[k], hist, bow);
+        return;
+    }
+    size_t numChunks = ThreadPool::NumChunks(probs.length(), 1 << 16);
+    ThreadPool::Run(numChunks, [&](size_t c) {
+        NgramIndex hist = NgramVector::Invalid;
+        Prob       bow = 1;
+        size_t     end = probs.length() * (c + 1) / numChunks;
+        for (size_t i = probs.length() * c / numChunks; i < end; ++i)
+            computeProb(i, hist, bow);
+    });
+}
+
+void
+NgramLMBase::BuildExplicitIndex(const IndexVector &map, size_t len,
+                                DenseVector<uint64_t> &bits,
+                                IndexVector &ranks) {
+    bits.reset((len + 63) / 64, 0);
+    for (size_t j = 0; j < map.length(); ++j)
+        bits[map[j] >> 6] |= (uint64_t)1 << (map[j] & 63);
+    ranks.reset(bits.length());
+    NgramIndex numExplicit = 0;
+    for (size_t w = 0; w < bits.length(); ++w) {
+        ranks[w] = numExplicit;
+        numExplicit += popcount64(bits[w]);
+    }
+}
+
+// Sets the model to the merged model m, keeping only the explicit n-grams of
+// the LM.  Their probabilities and backoff weights are ordered by index in m,
+// and a bitmap of the n-grams of m with a count of explicit n-grams before
+// each word locates them.
+void
+NgramLMBase::_SetSparseModel(const SharedPtr<NgramModel> &m,
+                             const vector<IndexVector> &ngramMap) {
+    _explicitBits.resize(_order + 1);
+    _explicitRanks.resize(_order + 1);
+    for (size_t o = 1; o <= _order; ++o) {
+        const IndexVector &map(ngramMap[o]);
+        BuildExplicitIndex(map, m->sizes(o), _explicitBits[o],
+                           _explicitRanks[o]);
+
+        ProbVector probs(map.length()), bows;
+        if (o < _order) bows.reset(map.length());
+        for (size_t j = 0; j < map.length(); ++j) {
+            NgramIndex rank = 0;
+            _FindExplicit(o, map[j], rank);
+            probs[rank] = _probVectors[o][j];
+            if (o < _order) bows[rank] = _bowVectors[o][j];
+        }
+        _probVectors[o].swap(probs);
+        if (o < _order) _bowVectors[o].swap(bows);
+    }
+    _pModel = m;
+    _ClearQuantized();
+}
+
+// Returns the probability of the last word given the preceding wordsLen - 1
+// words, backing off to shorter histories as needed.  All words must be in
+// the vocabulary and wordsLen must not exceed the model order.
+Prob
+NgramLMBase::ComputeProb(const VocabIndex *words, size_t wordsLen) const {
+    Prob       bow = 1.0;
+    size_t     boOrder = wordsLen;
+    NgramIndex index;
+    while ((index = _pModel->Find(&words[wordsLen - boOrder], boOrder)) == -1) {
+        --boOrder;
+        NgramIndex hist = _pModel->Find(&words[wordsLen - boOrder - 1],
+                                        boOrder);
+        if (hist != -1)
+            bow *= _Bow(boOrder, hist);
+    }
+    return bow * _Prob(boOrder, index);
+}
+
+// Prunes the n-grams whose removal increases the relative entropy of the LM
+// by less than threshold, measured as the relative change in perplexity
+// (Stolcke, 1998).  If numNgrams > 0, the smallest threshold that leaves at
+// most numNgrams n-grams is used instead.  Unigrams and the histories and
+// backoffs of kept n-grams are never pruned.  The model is compacted in
+// place, so a pruned LM keeps its probabilities when estimated.  Returns the
+// number of n-grams removed.
+size_t
+NgramLMBase::Prune(double threshold, size_t numNgrams) {
+    size_t numTotal = 0;
+    for (size_t o = 1; o <= _order; ++o) {
+        if (_probVectors[o].length() != sizes(o) || sparse()) {
+            Logger::Error(1, "Cannot prune LM without all probabilities.\n");
+            throw std::runtime_error("Cannot prune LM.");
+        }
+        numTotal += sizes(o);
+    }
+
+    // Pruning an order only changes the backoff weights of its histories, so
+    // the scores of lower orders are unaffected and computed once.
+    vector<DoubleVector> scores(_order + 1);
+    vector<BitVector>    keepVectors(_order + 1);
+    _ComputePruneScores(scores);
+    if (numNgrams > 0) {
+        // Binary search the sorted scores, since pruning more n-grams of a
+        // higher order can only release more of their histories and backoffs.
+        DoubleVector thresholds(numTotal - sizes(1) + 1);
+        size_t       numScores = 0;
+        for (size_t o = 2; o <= _order; ++o)
+            for (size_t i = 0; i < scores[o].length(); ++i)
+                thresholds[numScores++] = scores[o][i];
+        std::sort(thresholds.begin(), thresholds.begin() + numScores);
+        thresholds[numScores] = std::numeric_limits<double>::infinity();
+        size_t lo = 0, hi = numScores;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (_ComputePruneMasks(scores, thresholds[mid],
+                                   keepVectors) <= numNgrams)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        threshold = thresholds[lo];
+    }
+    size_t numKept = _ComputePruneMasks(scores, threshold, keepVectors);
+    Logger::Log(1, "Pruning %lu of %lu n-grams (threshold = %g)...\n",
+                numTotal - numKept, numTotal, threshold);
+    if (numKept == numTotal)
+        return 0;
+
+    // Renormalize the backoff weights, then drop the pruned n-grams.
+    _PruneBows(keepVectors);
+    vector<IndexVector> ngramMap;
+    _pModel->Compact(keepVectors, ngramMap);
+    for (size_t o = 1; o <= _order; ++o) {
+        NgramModel::ApplyCompact(ngramMap[o], _probVectors[o], sizes(o));
+        if (o < _order)
+            NgramModel::ApplyCompact(ngramMap[o], _bowVectors[o], sizes(o));
+    }
+    _ClearQuantized();
+    _pruned = true;
+    return numTotal - numKept;
+}
+
+// Splits the order o-1 histories into numChunks ranges and returns range c,
+// [histBegin, histEnd), along with the range of order o n-grams with those
+// histories, [ngramBegin, ngramEnd).  Since the model is sorted, the n-grams
+// of each history range are contiguous and ranges can be processed
+// concurrently.
+void
+NgramLMBase::_GetHistoryChunk(size_t o, size_t numChunks, size_t c,
+                              size_t &histBegin, size_t &histEnd,
+                              size_t &ngramBegin, size_t &ngramEnd) const {
+    const IndexVector &hists(this->hists(o));
+    size_t numHists = sizes(o - 1);
+    histBegin  = numHists * c / numChunks;
+    histEnd    = numHists * (c + 1) / numChunks;
+    ngramBegin = std::lower_bound(hists.begin(), hists.end(),
+                                  (NgramIndex)histBegin) - hists.begin();
+    ngramEnd   = std::lower_bound(hists.begin(), hists.end(),
+                                  (NgramIndex)histEnd) - hists.begin();
+}
+
+// Computes the score of each n-gram of order o > 1 as exp(dH) - 1, where dH
+// is the increase in relative entropy from backing off p(w|h) to
+// bow'(h) p(w|h'), with bow'(h) renormalized without the n-gram:
+//   dH = -p(h) [p(w|h) (log p(w|h') + log bow'(h) - log p(w|h))
+//               + (1 - sum_w p(w|h)) (log bow'(h) - log bow(h))]
+void
+NgramLMBase::_ComputePruneScores(vector<DoubleVector> &scores) const {
+    // Compute p(h) = p(h_1) p(h_2|h_1) ... of each history, where <s> as the
+    // first word has probability 1.
+    vector<ProbVector> histProbs(_order);
+    histProbs[0].reset(1, 1);
+    for (size_t o = 1; o < _order; ++o) {
+        const IndexVector &hists(this->hists(o));
+        const ProbVector & probs(_probVectors[o]);
+        histProbs[o].reset(sizes(o));
+        for (size_t i = 0; i < sizes(o); ++i)
+            histProbs[o][i] = histProbs[o-1][hists[i]] * probs[i];
+        if (o == 1)
+            histProbs[o][Vocab::EndOfSentence] = 1;
+    }
+
+    for (size_t o = 2; o <= _order; ++o) {
+        const IndexVector &hists(this->hists(o));
+        const IndexVector &backoffs(this->backoffs(o));
+        const ProbVector & probs(_probVectors[o]);
+        const ProbVector & boProbs(_probVectors[o-1]);
+        const ProbVector & hProbs(histProbs[o-1]);
+        DoubleVector &     oScores(scores[o]);
+        oScores.reset(sizes(o));
+
+        size_t numChunks = ThreadPool::NumChunks(sizes(o), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            for (size_t i = nBegin; i < nEnd;) {
+                NgramIndex h = hists[i];
+                size_t     hNgramEnd = i;
+                Prob       numerator = 1, denominator = 1;
+                for (; hNgramEnd < nEnd && hists[hNgramEnd] == h; ++hNgramEnd) {
+                    numerator   -= probs[hNgramEnd];
+                    denominator -= boProbs[backoffs[hNgramEnd]];
+                }
+                double logBow = std::log(numerator / denominator);
+                for (; i < hNgramEnd; ++i) {
+                    Prob   prob   = probs[i];
+                    Prob   boProb = boProbs[backoffs[i]];
+                    double logNewBow = std::log((numerator + prob) /
+                                                (denominator + boProb));
+                    double deltaEntropy = 0;
+                    if (prob > 0)
+                        deltaEntropy -= prob * (std::log(boProb) + logNewBow -
+                                                std::log(prob));
+                    if (numerator > 0)
+                        deltaEntropy -= numerator * (logNewBow - logBow);
+                    double score = std::expm1(hProbs[h] * deltaEntropy);
+                    oScores[i] = std::isnan(score) ?
+                        std::numeric_limits<double>::infinity() : score;
+                }
+            }
+        });
+    }
+}
+
+// Sets keepVectors to the n-grams kept when pruning those scoring below
+// threshold, from the highest order down, and returns the number kept.
+size_t
+NgramLMBase::_ComputePruneMasks(const vector<DoubleVector> &scores,
+                                double threshold,
+                                vector<BitVector> &keepVectors) const {
+    size_t numKept = 0;
+    keepVectors[0].reset(1, 1);
+    for (size_t o = _order; o > 0; --o) {
+        BitVector &keep(keepVectors[o]);
+        keep.reset(sizes(o), 1);
+        if (o > 1)
+            for (size_t i = 0; i < sizes(o); ++i)
+                keep[i] = !(scores[o][i] < threshold);
+        if (o < _order) {
+            const BitVector &  higherKeep(keepVectors[o+1]);
+            const IndexVector &hists(this->hists(o+1));
+            const IndexVector &backoffs(this->backoffs(o+1));
+            for (size_t i = 0; i < higherKeep.length(); ++i) {
+                if (higherKeep[i]) {
+                    keep[hists[i]]    = 1;
+                    keep[backoffs[i]] = 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < keep.length(); ++i)
+            numKept += keep[i];
+    }
+    return numKept;
+}
+
+// Recomputes the backoff weights of the histories with pruned n-grams from
+// the kept n-grams.  Kept n-grams keep their backoffs, so their backoff
+// probabilities are unchanged.
+void
+NgramLMBase::_PruneBows(const vector<BitVector> &keepVectors) {
+    for (size_t o = 2; o <= _order; ++o) {
+        ProbVector &       bows(_bowVectors[o-1]);
+        const BitVector &  keep(keepVectors[o]);
+        const IndexVector &hists(this->hists(o));
+        const IndexVector &backoffs(this->backoffs(o));
+        const ProbVector & probs(_probVectors[o]);
+        const ProbVector & boProbs(_probVectors[o-1]);
+
+        size_t numChunks = ThreadPool::NumChunks(sizes(o), 1 << 14);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t hBegin, hEnd, nBegin, nEnd;
+            _GetHistoryChunk(o, numChunks, c, hBegin, hEnd, nBegin, nEnd);
+            for (size_t i = nBegin; i < nEnd;) {
+                NgramIndex h = hists[i];
+                Prob       numerator = 1, denominator = 1;
+                bool       pruned = false;
+                for (; i < nEnd && hists[i] == h; ++i) {
+                    if (keep[i]) {
+                        numerator   -= probs[i];
+                        denominator -= boProbs[backoffs[i]];
+                    } else
+                        pruned = true;
+                }
+                if (pruned)
+                    bows[h] = numerator / denominator;
+            }
+        });
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void
-ArpaNgramLM::LoadLM(ZFile &lmFile) {
-    if (ReadUInt64(lmFile) == MITLMv1) {
+ArpaNgramLM::LoadLM(ZFile &lmFile, bool decodeQuantized) {
+    uint64_t version = ReadUInt64(lmFile);
+    if (version == MITLMv2) {
+        // Standard input cannot be reopened, so read the rest of the stream.
+        MappedFile *pFile = (strcmp(lmFile.filename(), "-") == 0) ?
+            new MappedFile(lmFile, &version, sizeof(version)) :
+            new MappedFile(lmFile.filename());
+        DeserializeMapped(SharedPtr<MappedFile>(pFile), decodeQuantized);
+    } else if (version == MITLMv1) {
         Deserialize(lmFile);
     } else {
         lmFile.ReOpen();
+        _ClearQuantized();
         _pModel->LoadLM(_probVectors, _bowVectors, lmFile);
     }
 }
@@ -335,6 +779,9 @@ NgramLM::SetOrder(size_t order) {
 Mask *
 NgramLM::GetMask(vector<BitVector> &probMaskVectors,
                  vector<BitVector> &bowMaskVectors) const {
+    if (_pruned)
+        return NgramLMBase::GetMask(probMaskVectors, bowMaskVectors);
+
     // Copy prob and bow masks.
     NgramLMMask *pMask = new NgramLMMask();
     pMask->ProbMaskVectors = probMaskVectors;
@@ -349,6 +796,12 @@ NgramLM::GetMask(vector<BitVector> &probMaskVectors,
 
 bool
 NgramLM::Estimate(const ParamVector &params, Mask *pMask) {
+    // The counts no longer match the model of a pruned LM.
+    if (_pruned)
+        return NgramLMBase::Estimate(params, pMask);
+
+    // Estimation rewrites probs() and bows(), so drop their quantized copy.
+    _ClearQuantized();
     NgramLMMask *pNgramLMMask = (NgramLMMask *)pMask;
     for (size_t o = 1; o <= _order; o++) {
         Range r(_paramStarts[o], _paramStarts[o+1]);
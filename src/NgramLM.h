@@ -35,11 +35,14 @@
 #ifndef NGRAMLM_H
 #define NGRAMLM_H
 
+#include <cassert>
 #include <vector>
+#include "util/BitOps.h"
 #include "util/SharedPtr.h"
 #include "Types.h"
 #include "Vocab.h"
 #include "NgramModel.h"
+#include "QuantizedVector.h"
 #include "Smoothing.h"
 #include "Mask.h"
 
@@ -57,6 +60,13 @@ protected:
     vector<ProbVector>    _probVectors;
     vector<ProbVector>    _bowVectors;
     ParamVector           _defParams;
+    SharedPtr<MappedFile> _pMappedFile;
+    vector<QuantizedVector> _quantProbVectors;
+    vector<QuantizedVector> _quantBowVectors;
+    bool                  _sparse;
+    vector<DenseVector<uint64_t> > _explicitBits;   // Explicit n-gram bitmap
+    vector<IndexVector>   _explicitRanks;  // Explicit n-grams before each word
+    bool                  _pruned;         // Probabilities fixed by Prune()
 
 public:
     NgramLMBase(size_t order = 3);
@@ -67,6 +77,12 @@ public:
     void SaveLM(ZFile &lmFile, bool asBinary=false) const;
     void Serialize(FILE *outFile) const;
     void Deserialize(FILE *inFile);
+    void SerializeMapped(FILE *outFile) const;
+    void DeserializeMapped(const SharedPtr<MappedFile> &mappedFile,
+                           bool decodeQuantized=true);
+    void Quantize(size_t bits);
+    void SetSparse(bool sparse) { _sparse = sparse; }
+    size_t Prune(double threshold, size_t numNgrams=0);
 
     virtual void  SetOrder(size_t order);
     virtual Mask *GetMask(vector<BitVector> &probMaskVectors,
@@ -75,6 +91,7 @@ public:
     virtual void  SetModel(const SharedPtr<NgramModel> &m,
                            const VocabVector &vocabMap,
                            const vector<IndexVector> &ngramMap);
+    virtual Prob  ComputeProb(const VocabIndex *words, size_t wordsLen) const;
 
     size_t             order() const            { return _order; }
     size_t             sizes(size_t o) const    { return _pModel->sizes(o); }
@@ -83,9 +100,83 @@ public:
     const VocabVector &words(size_t o) const    { return _pModel->words(o); }
     const IndexVector &hists(size_t o) const    { return _pModel->hists(o); }
     const IndexVector &backoffs(size_t o) const { return _pModel->backoffs(o); }
-    const ProbVector  &probs(size_t o) const    { return _probVectors[o]; }
-    const ProbVector  &bows(size_t o) const     { return _bowVectors[o]; }
     const ParamVector &defParams() const        { return _defParams; }
+    bool               quantized() const        { return !_quantProbVectors.empty(); }
+    bool               sparse() const           { return !_explicitBits.empty(); }
+    bool               pruned() const           { return _pruned; }
+
+    // Sparse LMs index their probabilities and backoff weights by explicit
+    // n-gram, so these must not be used with them.  Use GetProb() instead.
+    const ProbVector &probs(size_t o) const {
+        assert(!sparse());
+        return _probVectors[o];
+    }
+    const ProbVector &bows(size_t o) const {
+        assert(!sparse());
+        return _bowVectors[o];
+    }
+
+    // Returns the probability of n-gram i of order o.  Sparse LMs only store
+    // their explicit n-grams, so probs() is not indexed by the model n-grams
+    // and backed-off probabilities are computed on demand.
+    Prob GetProb(size_t o, NgramIndex i) const {
+        return sparse() ? _SparseProb(o, i) : _probVectors[o][i];
+    }
+    void GetOrderProbs(size_t o, const ProbVector &boProbs,
+                       ProbVector &probs,
+                       const IndexVector *pNgrams=NULL) const;
+
+    // Marks the explicit n-grams map among len n-grams in bits, and counts
+    // the explicit n-grams before each word of bits into ranks.
+    static void BuildExplicitIndex(const IndexVector &map, size_t len,
+                                   DenseVector<uint64_t> &bits,
+                                   IndexVector &ranks);
+    // Finds the rank of n-gram i among the explicit n-grams, if explicit.
+    static bool FindExplicit(const DenseVector<uint64_t> &bits,
+                             const IndexVector &ranks,
+                             NgramIndex i, NgramIndex &rank) {
+        uint64_t word = bits[i >> 6];
+        uint64_t bit  = (uint64_t)1 << (i & 63);
+        if (!(word & bit)) return false;
+        rank = ranks[i >> 6] + popcount64(word & (bit - 1));
+        return true;
+    }
+
+protected:
+    // Quantized LMs need not decode probs() and bows(), so read the
+    // quantized values, which equal the decoded ones.  Sparse LMs look up
+    // their explicit n-grams.
+    Prob _Prob(size_t o, NgramIndex i) const {
+        if (sparse()) return _SparseProb(o, i);
+        return quantized() ? _quantProbVectors[o][i] : _probVectors[o][i];
+    }
+    Prob _Bow(size_t o, NgramIndex i) const {
+        if (sparse()) return _SparseBow(o, i);
+        return quantized() ? _quantBowVectors[o][i] : _bowVectors[o][i];
+    }
+    void _ClearQuantized() {
+        _quantProbVectors.clear();
+        _quantBowVectors.clear();
+    }
+    bool _FindExplicit(size_t o, NgramIndex i, NgramIndex &rank) const {
+        return FindExplicit(_explicitBits[o], _explicitRanks[o], i, rank);
+    }
+    Prob _SparseBow(size_t o, NgramIndex i) const {
+        NgramIndex rank;
+        if (o == 0) return _bowVectors[0][i];
+        return _FindExplicit(o, i, rank) ? _bowVectors[o][rank] : 1;
+    }
+    Prob _SparseProb(size_t o, NgramIndex i) const;
+    void _SetSparseModel(const SharedPtr<NgramModel> &m,
+                         const vector<IndexVector> &ngramMap);
+    void _GetHistoryChunk(size_t o, size_t numChunks, size_t c,
+                          size_t &histBegin, size_t &histEnd,
+                          size_t &ngramBegin, size_t &ngramEnd) const;
+    void _ComputePruneScores(vector<DoubleVector> &scores) const;
+    size_t _ComputePruneMasks(const vector<DoubleVector> &scores,
+                              double threshold,
+                              vector<BitVector> &keepVectors) const;
+    void _PruneBows(const vector<BitVector> &keepVectors);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -93,7 +184,7 @@ public:
 class ArpaNgramLM : public NgramLMBase {
 public:
     ArpaNgramLM(size_t order = 3) : NgramLMBase(order) { }
-    void LoadLM(ZFile &lmFile);
+    void LoadLM(ZFile &lmFile, bool decodeQuantized=true);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
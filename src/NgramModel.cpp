@@ -38,6 +38,7 @@
 #include "util/BitOps.h"
 #include "util/FastIO.h"
 #include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "util/ZFile.h"
 #include "util/constants.h"
 #include "Types.h"
@@ -234,27 +235,26 @@ NgramModel::SaveCounts(const vector<CountVector> &countVectors,
     if (countsFile == NULL) throw std::invalid_argument("Invalid file");
 
     // Write counts.
-    StrVector   ngramWords(size());
     if (includeZeroOrder && countVectors[0].length() == 1)
         fprintf(countsFile, "\t%i\n", countVectors[0][0]);
     for (size_t o = 1; o < countVectors.size(); ++o) {
         const CountVector &counts = countVectors[o];
-        for (NgramIndex i = 0; i < (NgramIndex)countVectors[o].length(); ++i) {
-            GetNgramWords(o, i, ngramWords);
-	    fputs(ngramWords[0], countsFile);
-            for (size_t j = 1; j < o; j++) {
-		fputc(' ', countsFile);
-		fputs(ngramWords[j], countsFile);
-            }
-            fprintf( countsFile, "\t%u\n", counts[i]);
-        }
+        _WriteNgrams(countsFile, o, 0, counts.length(),
+                     [&counts](std::string &buf, NgramIndex i,
+                               const std::string &ngram) {
+            char str[16];
+            buf.append(ngram);
+            buf.append(str, snprintf(str, sizeof(str), "\t%u\n", counts[i]));
+        });
     }
 }
 
+// Loads an ARPA LM up to the order of the model, skipping higher orders.  With
+// topOrderBows, also loads the backoff weights of the highest order loaded.
 void
 NgramModel::LoadLM(vector<ProbVector> &probVectors,
                    vector<ProbVector> &bowVectors,
-                   ZFile &lmFile) {
+                   ZFile &lmFile, bool topOrderBows) {
     if (lmFile == NULL) throw std::invalid_argument("Invalid file");
 
     // Read ARPA LM header.
@@ -275,12 +275,13 @@ NgramModel::LoadLM(vector<ProbVector> &probVectors,
     _vocab.Reserve(ngramLengths[1]);
     probVectors.resize(size());
     probVectors[0].resize(1, 0.0);
-    bowVectors.resize(size() - 1);
+    bowVectors.resize(topOrderBows ? size() : size() - 1);
     bowVectors[0].resize(1, 0.0);
+    vector<bool> sortedOrders(size(), true);
     for (o = 1; o < size(); o++) {
         ProbVector &probs  = probVectors[o];
         ProbVector &bows   = bowVectors[o];
-        bool        hasBow = (o < size() - 1);
+        bool        hasBow = (o < bowVectors.size());
 
         // Preallocate buffer for n-grams.
         _vectors[o].Reserve(ngramLengths[o]);
@@ -292,6 +293,11 @@ NgramModel::LoadLM(vector<ProbVector> &probVectors,
         if (sscanf(line, "\\%u-grams:", &i) != 1 || i != o) {
             throw std::invalid_argument("Unexpected file format.");
         }
+        if (o > 1) {
+            sortedOrders[o] = _LoadLMSection(o, probs, hasBow ? &bows : NULL,
+                                             sortedOrders, lmFile);
+            continue;
+        }
         while (true) {
             getline(lmFile, line, mitlm::kMaxLineLength);
             size_t lineLen = strlen(line);
@@ -299,31 +305,30 @@ NgramModel::LoadLM(vector<ProbVector> &probVectors,
             char *p = &line[0];
 
             // Read log probability.
-            Prob prob = (Prob)std::pow(10.0, (double)strtod(p, &p)); p++;
-
-            // Read i words.
-            NgramIndex index  = 0;
-            const char *token = NULL;
-            for (i = 1; i <= o; ++i) {
-                token = p;
-                while (*p != 0 && !isspace(*p)) ++p;
-                len = p - token;
-                *p++ = 0;
-                VocabIndex vocabIndex = _vocab.Add(token, len);
-                if (vocabIndex == Vocab::Invalid) {
-                    index = NgramVector::Invalid;
-                    break;
-                }
-                index = _vectors[i].Add(index, vocabIndex);
+            Prob prob = (Prob)Pow10(ParseDouble(p));
+
+            // Read word.
+            while (isspace(*p)) ++p;
+            const char *token = p;
+            while (*p != 0 && !isspace(*p)) ++p;
+            len = p - token;
+            if (*p != 0) *p++ = 0;
+            VocabIndex vocabIndex = _vocab.Add(token, len);
+            if (vocabIndex == Vocab::Invalid)
+                continue;  // Skip words outside of fixed vocabulary.
+            NgramIndex index = _vectors[1].Add(0, vocabIndex);
+            if ((size_t)index >= probs.length()) {
+                probs.resize(std::max((size_t)index + 1, 2 * probs.length()), 0);
+                if (hasBow) bows.resize(probs.length(), 1);
             }
-            if (index == NgramVector::Invalid) break;
 
             // Set probability and backoff weight.
-            if (index == Vocab::EndOfSentence && o == 1) {
+            while (isspace(*p)) ++p;
+            if (vocabIndex == Vocab::EndOfSentence) {
                 if (strcmp(token, "<s>") == 0) {
                     assert(prob <= std::pow(10.0, -99.0));
                     bows[index] = (p >= &line[lineLen]) ?
-			    (Prob)1 : (Prob)std::pow(10.0, (double)strtod(p, &p));
+                        (Prob)1 : (Prob)Pow10(ParseDouble(p));
                 } else {
                     probs[index] = prob;
                     assert(p >= &line[lineLen]);
@@ -333,10 +338,13 @@ NgramModel::LoadLM(vector<ProbVector> &probVectors,
                 if (hasBow) {
                     // Read optional backoff weight.
                     bows[index] = (p >= &line[lineLen]) ?
-                        (Prob)1 : (Prob)std::pow(10.0, (double)strtod(p, &p));
+                        (Prob)1 : (Prob)Pow10(ParseDouble(p));
                 }
             }
         }
+        for (size_t i = 1; i < _vectors[1].size(); ++i)
+            if (_vectors[1]._words[i] <= _vectors[1]._words[i - 1])
+                sortedOrders[1] = false;
     }
 
     // Read ARPA LM footer.
@@ -362,6 +370,167 @@ NgramModel::LoadLM(vector<ProbVector> &probVectors,
     _ComputeBackoffs();
 }
 
+// Loads the n-grams of order o (> 1) from an ARPA LM section.  Lines are read
+// in blocks and parsed in parallel, resolving the history of each n-gram
+// against the lower orders, which are complete by now.  N-grams that arrive
+// in sorted order, as written by SaveLM, are appended without hashing, and
+// their histories are found by searching forward in the sorted lower orders.
+// Lines with unresolved words or histories fall back to adding the n-gram.
+// Returns whether the n-grams were appended in sorted order.
+bool
+NgramModel::_LoadLMSection(size_t o, ProbVector &probs, ProbVector *pBows,
+                           const vector<bool> &sortedOrders, ZFile &lmFile) {
+    const size_t kBlockLines = 1 << 18;
+    const size_t kChunkLines = 1 << 12;
+    struct ParsedLine {
+        NgramIndex hist;
+        VocabIndex word;
+        Prob       prob;
+        Prob       bow;
+        bool       resolved;
+    };
+
+    NgramVector        &ngrams = _vectors[o];
+    char                line[mitlm::kMaxLineLength];
+    std::string         text;
+    vector<size_t>      offsets;
+    vector<ParsedLine>  parsed;
+    bool                appending = true;
+    bool                done = false;
+    while (!done) {
+        // Read next block of lines.
+        text.clear();
+        offsets.clear();
+        while (offsets.size() < kBlockLines) {
+            if (!getline(lmFile, line, mitlm::kMaxLineLength) ||
+                line[0] == '\0') {
+                done = true;  // Empty line ends section.
+                break;
+            }
+            offsets.push_back(text.size());
+            text.append(line, strlen(line) + 1);
+        }
+
+        // Parse lines in parallel.
+        parsed.resize(offsets.size());
+        size_t numChunks = ThreadPool::NumChunks(offsets.size(), kChunkLines);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            size_t begin = offsets.size() * c / numChunks;
+            size_t end   = offsets.size() * (c + 1) / numChunks;
+            vector<VocabIndex> words(o), prevWords(o);
+            vector<NgramIndex> hists(o), hints(o, 0);
+            size_t             numPrevHists = 0;
+            for (size_t l = begin; l < end; ++l) {
+                ParsedLine &pl = parsed[l];
+                const char *p = &text[offsets[l]];
+                pl.resolved = false;
+                pl.prob = (Prob)Pow10(ParseDouble(p));
+
+                // Look up words.  Find() returns <unk> for unknown words,
+                // which still need to be added to an open vocabulary.
+                size_t i;
+                for (i = 0; i < o; ++i) {
+                    while (isspace(*p)) ++p;
+                    const char *token = p;
+                    while (*p != 0 && !isspace(*p)) ++p;
+                    size_t len = p - token;
+                    words[i] = _vocab.Find(token, len);
+                    if (words[i] == Vocab::Invalid ||
+                        (words[i] != Vocab::EndOfSentence &&
+                         (_vocab.wordlen(words[i]) != len ||
+                          strncmp(_vocab[words[i]], token, len) != 0)))
+                        break;
+                }
+                if (i < o) {
+                    numPrevHists = 0;
+                    continue;
+                }
+
+                // Resolve history, reusing the prefix shared with the
+                // previous line.
+                size_t k = 0;
+                while (k < numPrevHists && words[k] == prevWords[k]) ++k;
+                for (; k < o - 1; ++k) {
+                    NgramIndex hist = k ? hists[k - 1] : 0;
+                    if (sortedOrders[k + 1]) {
+                        hists[k] = _vectors[k + 1].FindSorted(hints[k], hist,
+                                                              words[k]);
+                        if (hists[k] != NgramVector::Invalid)
+                            hints[k] = hists[k];
+                    } else
+                        hists[k] = _vectors[k + 1].Find(hist, words[k]);
+                    if (hists[k] == NgramVector::Invalid) break;
+                }
+                numPrevHists = k;
+                std::swap(words, prevWords);
+                if (k < o - 1) continue;
+                pl.hist = hists[o - 2];
+                pl.word = prevWords[o - 1];
+
+                // Read optional backoff weight.
+                while (isspace(*p)) ++p;
+                pl.bow = (pBows && *p) ? (Prob)Pow10(ParseDouble(p)) : (Prob)1;
+                pl.resolved = true;
+            }
+        });
+
+        // Add n-grams in order.
+        for (size_t l = 0; l < parsed.size(); ++l) {
+            ParsedLine &pl = parsed[l];
+            NgramIndex  index;
+            if (pl.resolved && appending &&
+                (ngrams.size() == 0 ||
+                 pl.hist > ngrams._hists[ngrams.size() - 1] ||
+                 (pl.hist == ngrams._hists[ngrams.size() - 1] &&
+                  pl.word > ngrams._words[ngrams.size() - 1]))) {
+                index = ngrams.Append(pl.hist, pl.word);
+            } else {
+                if (appending) {
+                    ngrams._Reindex(ngrams.capacity());
+                    appending = false;
+                }
+                if (pl.resolved)
+                    index = ngrams.Add(pl.hist, pl.word);
+                else {
+                    index = _AddLMLine(&text[offsets[l]], o, pl.bow);
+                    if (index == NgramVector::Invalid)
+                        continue;  // Skip n-grams outside of fixed vocabulary.
+                }
+            }
+            if ((size_t)index >= probs.length()) {
+                probs.resize(std::max((size_t)index + 1, 2 * probs.length()), 0);
+                if (pBows) pBows->resize(probs.length(), 1);
+            }
+            probs[index] = pl.prob;
+            if (pBows) (*pBows)[index] = pl.bow;
+        }
+    }
+    if (appending)
+        ngrams._Reindex(ngrams.capacity());
+    return appending;
+}
+
+// Adds the n-gram of order o on an ARPA LM line, including any missing words
+// or histories, and reads its backoff weight.  Returns the n-gram index, or
+// Invalid if a word is not in a fixed vocabulary.
+NgramIndex
+NgramModel::_AddLMLine(const char *p, size_t o, Prob &bow) {
+    ParseDouble(p);
+    NgramIndex index = 0;
+    for (size_t i = 1; i <= o; ++i) {
+        while (isspace(*p)) ++p;
+        const char *token = p;
+        while (*p != 0 && !isspace(*p)) ++p;
+        VocabIndex vocabIndex = _vocab.Add(token, p - token);
+        if (vocabIndex == Vocab::Invalid)
+            return NgramVector::Invalid;
+        index = _vectors[i].Add(index, vocabIndex);
+    }
+    while (isspace(*p)) ++p;
+    bow = *p ? (Prob)Pow10(ParseDouble(p)) : (Prob)1;
+    return index;
+}
+
 void
 NgramModel::SaveLM(const vector<ProbVector> &probVectors,
                    const vector<ProbVector> &bowVectors,
@@ -376,68 +545,63 @@ NgramModel::SaveLM(const vector<ProbVector> &probVectors,
                 (unsigned long)o, (unsigned long)_vectors[o].size());
 
     // Write lower order n-grams with probabilities and backoff weights.
-    StrVector   ngramWords(size() - 1);
-    for (size_t o = 1; o < size() - 1; o++) {
-        fprintf(lmFile, "\n\\%lu-grams:\n", (unsigned long)o);
-        const ProbVector &probs = probVectors[o];
-        const ProbVector &bows  = bowVectors[o];
-        assert(probs.length() == _vectors[o].size());
-        assert(bows.length() == _vectors[o].size());
-        assert(!anyTrue(isnan(probs)));
-        assert(!anyTrue(isnan(bows)));
-        NgramIndex iStart = 0;
-        if (o == 1) {
-            iStart = 1;
-	    fprint_LProb(lmFile, probs[Vocab::EndOfSentence]);
-	    fputs("\t</s>\n-99\t<s>\t", lmFile);
-	    fprint_LProb(lmFile, bows[Vocab::EndOfSentence]);
-	    fputc('\n', lmFile);
-        }
-        for (NgramIndex i = iStart; i < (NgramIndex)_vectors[o].size(); ++i) {
-            GetNgramWords(o, i, ngramWords);
-	    fprint_LProb(lmFile, probs[i]);
-	    fputc('\t', lmFile);
-	    fputs(ngramWords[0], lmFile);
-            for (size_t j = 1; j < o; ++j) {
-		fputc(' ', lmFile);
-		fputs(ngramWords[j], lmFile);
-            }
-            if (bows[i] != 1) {
-		fputc('\t', lmFile);
-		fprint_LProb(lmFile, bows[i]);
-            }
-	    fputc('\n', lmFile);
-        }
-    }
+    for (size_t o = 1; o < size() - 1; o++)
+        _SaveLMSection(lmFile, o, probVectors[o], &bowVectors[o]);
 
     // Write highest order n-grams without backoff weights.
-    {
-        size_t o = size() - 1;
-        fprintf(lmFile, "\n\\%lu-grams:\n", (unsigned long)o);
-        const ProbVector &probs = probVectors[o];
-        NgramIndex iStart = 0;
-        if (o == 1) {
-            iStart = 1;
-	    fprint_LProb(lmFile, probs[Vocab::EndOfSentence]);
-	    fputs("\t</s>\n-99\t<s>\n", lmFile);
-        }
-        for (NgramIndex i = iStart; i < (NgramIndex)_vectors[o].size(); ++i) {
-            GetNgramWords(o, i, ngramWords);
-	    fprint_LProb(lmFile, probs[i]);
-	    fputc('\t', lmFile);
-	    fputs(ngramWords[0], lmFile);
-            for (size_t j = 1; j < o; ++j) {
-		fputc(' ', lmFile);
-		fputs(ngramWords[j], lmFile);
-            }
-	    fputc('\n', lmFile);
-        }
-    }
+    _SaveLMSection(lmFile, size() - 1, probVectors[size() - 1], NULL);
 
     // Write ARPA backoff LM footer.
     fputs("\n\\end\\\n", lmFile);
 }
 
+// Writes the n-grams of order o as an ARPA LM section, with backoff weights
+// unless pBows is NULL.
+void
+NgramModel::_SaveLMSection(FILE *lmFile, size_t o, const ProbVector &probs,
+                           const ProbVector *pBows) const {
+    fprintf(lmFile, "\n\\%lu-grams:\n", (unsigned long)o);
+    assert(probs.length() == _vectors[o].size());
+    assert(!anyTrue(isnan(probs)));
+    NgramIndex iStart = 0;
+    if (o == 1) {
+        iStart = 1;
+        fprint_LProb(lmFile, probs[Vocab::EndOfSentence]);
+        if (pBows) {
+            fputs("\t</s>\n-99\t<s>\t", lmFile);
+            fprint_LProb(lmFile, (*pBows)[Vocab::EndOfSentence]);
+            fputc('\n', lmFile);
+        } else
+            fputs("\t</s>\n-99\t<s>\n", lmFile);
+    }
+    if (pBows) {
+        const ProbVector &bows = *pBows;
+        assert(bows.length() == _vectors[o].size());
+        assert(!anyTrue(isnan(bows)));
+        _WriteNgrams(lmFile, o, iStart, _vectors[o].size(),
+                     [&probs, &bows](std::string &buf, NgramIndex i,
+                                     const std::string &ngram) {
+            sprint_LProb(buf, probs[i]);
+            buf.push_back('\t');
+            buf.append(ngram);
+            if (bows[i] != 1) {
+                buf.push_back('\t');
+                sprint_LProb(buf, bows[i]);
+            }
+            buf.push_back('\n');
+        });
+    } else {
+        _WriteNgrams(lmFile, o, iStart, _vectors[o].size(),
+                     [&probs](std::string &buf, NgramIndex i,
+                              const std::string &ngram) {
+            sprint_LProb(buf, probs[i]);
+            buf.push_back('\t');
+            buf.append(ngram);
+            buf.push_back('\n');
+        });
+    }
+}
+
 void
 NgramModel::LoadEvalCorpus(vector<CountVector> &probCountVectors,
                            vector<CountVector> &bowCountVectors,
@@ -693,6 +857,72 @@ NgramModel::GetNgramWords(size_t order,
     return totalLength;
 }
 
+// Write the n-grams of order o in [begin, end) to file.  Consecutive chunks
+// of n-grams are formatted into separate buffers in parallel and written out
+// in order.  Each line is produced by format(buffer, index, ngram), where
+// ngram holds the space-separated words.  The words of the history are
+// reused while consecutive n-grams share the same history.
+void
+NgramModel::_WriteNgrams(FILE *file, size_t o, size_t begin, size_t end,
+                         const NgramFormatter &format) const {
+    const size_t kChunkSize = 1 << 16;
+    if (begin >= end) return;
+    size_t numChunks = (end - begin + kChunkSize - 1) / kChunkSize;
+    size_t maxChunks = std::min(numChunks, 2 * ThreadPool::GetNumThreads());
+    vector<std::string> buffers(maxChunks);
+    for (size_t chunk = 0; chunk < numChunks; chunk += maxChunks) {
+        size_t numRoundChunks = std::min(maxChunks, numChunks - chunk);
+        ThreadPool::Run(numRoundChunks, [&](size_t c) {
+            size_t       chunkBegin = begin + (chunk + c) * kChunkSize;
+            size_t       chunkEnd   = std::min(chunkBegin + kChunkSize, end);
+            std::string &buf        = buffers[c];
+            std::string  prefix, ngram;
+            NgramIndex   prefixHist = NgramVector::Invalid;
+            vector<VocabIndex> histWords(o);
+            buf.clear();
+            for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+                NgramIndex hist = _vectors[o]._hists[i];
+                VocabIndex word = _vectors[o]._words[i];
+                if (o > 1 && hist != prefixHist) {
+                    // Build words of new history.
+                    NgramIndex index = hist;
+                    for (size_t j = o - 1; j > 0; --j) {
+                        histWords[j - 1] = _vectors[j]._words[index];
+                        index = _vectors[j]._hists[index];
+                    }
+                    prefix.clear();
+                    for (size_t j = 0; j < o - 1; ++j) {
+                        if (j == 0 && histWords[j] == Vocab::EndOfSentence)
+                            prefix.append("<s>");
+                        else
+                            prefix.append(_vocab[histWords[j]],
+                                          _vocab.wordlen(histWords[j]));
+                        prefix.push_back(' ');
+                    }
+                    prefixHist = hist;
+                }
+                ngram.assign(prefix);
+                if (o == 1 && word == Vocab::EndOfSentence)
+                    ngram.append("<s>");
+                else
+                    ngram.append(_vocab[word], _vocab.wordlen(word));
+                format(buf, i, ngram);
+            }
+        });
+        for (size_t c = 0; c < numRoundChunks; ++c)
+            fwrite(buffers[c].data(), 1, buffers[c].size(), file);
+    }
+}
+
+// Add the words of vocab missing from the model vocabulary, and map vocab
+// indices to model vocab indices.
+void
+NgramModel::ExtendVocab(const Vocab &vocab, VocabVector &vocabMap) {
+    vocabMap.reset(vocab.size());
+    for (size_t i = 0; i < vocab.size(); ++i)
+        vocabMap[i] = _vocab.Add(vocab[i]);
+}
+
 // Add all n-grams in m to current model.  Call FinalizeModel() afterwards to
 // sort n-grams and compute backoffs.
 void
@@ -700,9 +930,7 @@ NgramModel::ExtendModel(const NgramModel &m,
                         VocabVector &vocabMap,
                         vector<IndexVector> &ngramMap) {
     // Map vocabulary.
-    vocabMap.reset(m._vocab.size());
-    for (size_t i = 0; i < m._vocab.size(); ++i)
-        vocabMap[i] = _vocab.Add(m._vocab[i]);
+    ExtendVocab(m._vocab, vocabMap);
 
     // Map n-grams.
     if (size() == 0) {
@@ -730,6 +958,128 @@ NgramModel::ExtendModel(const NgramModel &m,
     }
 }
 
+// Orders n-gram indices by (hist, word) after mapping into another model.
+struct MappedNgramCompare {
+    const IndexVector &_hists;
+    const VocabVector &_words;
+    MappedNgramCompare(const IndexVector &hists, const VocabVector &words)
+        : _hists(hists), _words(words) { }
+    bool operator()(NgramIndex i, NgramIndex j) {
+        return (_hists[i] == _hists[j]) ? (_words[i] < _words[j]) :
+                                          (_hists[i] < _hists[j]);
+    }
+};
+
+// Builds this model as the sorted union of models, equivalent to calling
+// ExtendModel() for each model followed by SortModel(), but without hashing
+// every n-gram into the union.  Each model's n-grams are sorted by their
+// (hist, word) in the union and then combined by a linear k-way merge, so
+// the maps are produced directly in sorted index space.
+void
+NgramModel::MergeModels(const vector<const NgramModel *> &models,
+                        vector<VocabVector> &vocabMaps,
+                        vector<vector<IndexVector> > &ngramMaps) {
+    assert(_vectors.size() > 0 && _vectors[0].size() == 1);
+    size_t numModels = models.size();
+
+    // Map and sort vocabulary.
+    VocabVector vocabSortMap;
+    vocabMaps.resize(numModels);
+    for (size_t l = 0; l < numModels; ++l)
+        ExtendVocab(models[l]->_vocab, vocabMaps[l]);
+    _vocab.Sort(vocabSortMap);
+    for (size_t l = 0; l < numModels; ++l) {
+        VocabVector vocabMap = vocabSortMap[vocabMaps[l]];
+        vocabMaps[l].swap(vocabMap);
+    }
+
+    size_t maxSize = size();
+    for (size_t l = 0; l < numModels; ++l)
+        maxSize = std::max(maxSize, models[l]->size());
+    _vectors.resize(maxSize);
+    ngramMaps.resize(numModels);
+    for (size_t l = 0; l < numModels; ++l) {
+        ngramMaps[l].resize(models[l]->size());
+        ngramMaps[l][0].reset(1, 0);
+    }
+
+    vector<IndexVector> hists(numModels), orders(numModels);
+    vector<VocabVector> words(numModels);
+    vector<size_t>      heads(numModels);
+    for (size_t o = 1; o < maxSize; ++o) {
+        // Map each model's n-grams into the union and sort them.
+        size_t capacity = 0;
+        for (size_t l = 0; l < numModels; ++l)
+            if (o < models[l]->size())
+                capacity += models[l]->sizes(o);
+        ThreadPool::Run(numModels, [&](size_t l) {
+            const NgramModel &m = *models[l];
+            size_t len = (o < m.size()) ? m.sizes(o) : 0;
+            hists[l].reset(len);
+            words[l].reset(len);
+            orders[l] = Range(len);
+            if (len == 0) return;
+            const IndexVector &histMap(ngramMaps[l][o-1]);
+            const VocabVector &vocabMap(vocabMaps[l]);
+            const IndexVector &mHists(m.hists(o));
+            const VocabVector &mWords(m.words(o));
+            for (size_t i = 0; i < len; ++i) {
+                hists[l][i] = histMap[mHists[i]];
+                words[l][i] = vocabMap[mWords[i]];
+            }
+            orders[l].sort(MappedNgramCompare(hists[l], words[l]));
+        });
+
+        // Merge sorted n-grams, appending each distinct n-gram once.
+        NgramVector &v = _vectors[o];
+        v._words.reset(capacity);
+        v._hists.reset(capacity);
+        v._length = 0;
+        for (size_t l = 0; l < numModels; ++l) {
+            heads[l] = 0;
+            if (o < models[l]->size())
+                ngramMaps[l][o].reset(orders[l].length());
+        }
+        while (true) {
+            bool       found = false;
+            NgramIndex hist  = 0;
+            VocabIndex word  = 0;
+            for (size_t l = 0; l < numModels; ++l) {
+                if (heads[l] == orders[l].length()) continue;
+                NgramIndex i = orders[l][heads[l]];
+                if (!found || hists[l][i] < hist ||
+                    (hists[l][i] == hist && words[l][i] < word)) {
+                    found = true;
+                    hist  = hists[l][i];
+                    word  = words[l][i];
+                }
+            }
+            if (!found)
+                break;
+            NgramIndex index = v._length++;
+            v._hists[index] = hist;
+            v._words[index] = word;
+            for (size_t l = 0; l < numModels; ++l) {
+                if (heads[l] == orders[l].length()) continue;
+                NgramIndex i = orders[l][heads[l]];
+                if (hists[l][i] == hist && words[l][i] == word) {
+                    ngramMaps[l][o][i] = index;
+                    heads[l]++;
+                }
+            }
+        }
+
+        // Trim to the union size and build the index table.
+        v._words.resize(v._length);
+        v._hists.resize(v._length);
+        v._Reindex(nextPowerOf2(v._length + v._length / 4));
+        Range r(v._length);
+        v._wordsView.attach(v._words[r]);
+        v._histsView.attach(v._hists[r]);
+    }
+    _ComputeBackoffs();
+}
+
 void
 NgramModel::SortModel(VocabVector &vocabMap,
                       vector<IndexVector> &ngramMap) {
@@ -742,6 +1092,43 @@ NgramModel::SortModel(VocabVector &vocabMap,
     _ComputeBackoffs();
 }
 
+// Removes the n-grams not in keepVectors, which must include the history and
+// backoff of each kept n-gram, and maps each n-gram to its new index in
+// ngramMap, or Invalid if removed.  Kept n-grams remain sorted.
+void
+NgramModel::Compact(const vector<BitVector> &keepVectors,
+                    vector<IndexVector> &ngramMap) {
+    ngramMap.resize(size());
+    ngramMap[0].reset(1, 0);
+    for (size_t o = 1; o < size(); ++o) {
+        NgramVector &      v = _vectors[o];
+        const BitVector &  keep(keepVectors[o]);
+        const IndexVector &histMap(ngramMap[o-1]);
+        IndexVector &      map(ngramMap[o]);
+        map.reset(v.size(), NgramVector::Invalid);
+        size_t len = 0;
+        for (size_t i = 0; i < v.size(); ++i)
+            if (keep[i]) map[i] = len++;
+
+        VocabVector words(len);
+        IndexVector hists(len);
+        for (size_t i = 0; i < v.size(); ++i) {
+            if (map[i] == NgramVector::Invalid) continue;
+            assert(histMap[v.hists()[i]] != NgramVector::Invalid);
+            words[map[i]] = v.words()[i];
+            hists[map[i]] = histMap[v.hists()[i]];
+        }
+        v._words.swap(words);
+        v._hists.swap(hists);
+        v._length = len;
+        v._Reindex(nextPowerOf2(len + len / 4));
+        Range r(len);
+        v._wordsView.attach(v._words[r]);
+        v._histsView.attach(v._hists[r]);
+    }
+    _ComputeBackoffs();
+}
+
 void
 NgramModel::Serialize(FILE *outFile) const {
     WriteHeader(outFile, "NgramModel");
@@ -761,6 +1148,35 @@ NgramModel::Deserialize(FILE *inFile) {
     _ComputeBackoffs();
 }
 
+// Writes the model along with the index tables and backoff vectors, so that
+// it can be loaded from a memory-mapped file without further processing.
+void
+NgramModel::SerializeMapped(FILE *outFile) const {
+    WriteHeader(outFile, "NgramModel");
+    _vocab.SerializeMapped(outFile);
+    WriteUInt64(outFile, size());
+    for (size_t i = 0; i < size(); i++) {
+        _vectors[i].SerializeMapped(outFile);
+        WriteVector(outFile, _backoffVectors[i]);
+    }
+}
+
+// Loads the model written by SerializeMapped at p as views into mappedFile,
+// which is kept open for the lifetime of the model.
+void
+NgramModel::DeserializeMapped(const SharedPtr<MappedFile> &mappedFile,
+                              char *&p) {
+    const char *end = mappedFile->data() + mappedFile->size();
+    _pMappedFile = mappedFile;
+    MapHeader(p, end, "NgramModel");
+    _vocab.DeserializeMapped(p, end);
+    SetOrder(MapUInt64(p, end) - 1);
+    for (size_t i = 0; i < size(); i++) {
+        _vectors[i].DeserializeMapped(p, end);
+        MapVector(p, end, _backoffVectors[i]);
+    }
+}
+
 // template <class T>
 // void
 // NgramModel::ApplySort(const IndexVector &ngramMap,
@@ -794,8 +1210,13 @@ NgramModel::_ComputeBackoffs() {
     if (size() > 2) {
         IndexVector &backoffs(_backoffVectors[2]);
         backoffs.resize(_vectors[2].size());
-        for (NgramIndex i = 0; i < (NgramIndex)backoffs.length(); ++i)
-            backoffs[i] = _vectors[1].Find(0, _vectors[2]._words[i]);
+        size_t numChunks = ThreadPool::NumChunks(backoffs.length(), 1 << 16);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            NgramIndex begin = backoffs.length() * c / numChunks;
+            NgramIndex end   = backoffs.length() * (c + 1) / numChunks;
+            for (NgramIndex i = begin; i < end; ++i)
+                backoffs[i] = _vectors[1].Find(0, _vectors[2]._words[i]);
+        });
         assert(allTrue(backoffs != NgramVector::Invalid));
     }
 
@@ -804,9 +1225,14 @@ NgramModel::_ComputeBackoffs() {
         IndexVector &loBackoffs(_backoffVectors[o - 1]);
         IndexVector &backoffs(_backoffVectors[o]);
         backoffs.resize(_vectors[o].size());
-        for (NgramIndex i = 0; i < (NgramIndex)backoffs.length(); ++i)
-            backoffs[i] = _vectors[o-1].Find(loBackoffs[_vectors[o]._hists[i]],
-                                             _vectors[o]._words[i]);
+        size_t numChunks = ThreadPool::NumChunks(backoffs.length(), 1 << 16);
+        ThreadPool::Run(numChunks, [&](size_t c) {
+            NgramIndex begin = backoffs.length() * c / numChunks;
+            NgramIndex end   = backoffs.length() * (c + 1) / numChunks;
+            for (NgramIndex i = begin; i < end; ++i)
+                backoffs[i] = _vectors[o-1].Find(
+                    loBackoffs[_vectors[o]._hists[i]], _vectors[o]._words[i]);
+        });
         assert(allTrue(backoffs != NgramVector::Invalid));
     }
 }
@@ -36,8 +36,12 @@
 #ifndef NGRAMMODEL_H
 #define NGRAMMODEL_H
 
+#include <functional>
+#include <string>
 #include <vector>
 #include "util/ZFile.h"
+#include "util/SharedPtr.h"
+#include "util/MappedFile.h"
 #include "Types.h"
 #include "Vocab.h"
 #include "NgramVector.h"
@@ -55,10 +59,16 @@ namespace mitlm {
 // Various methods are provides for efficiently loading/saving n-gram data.
 //
 class NgramModel {
+    friend class StreamingArpaMixer;
+
 protected:
+    typedef std::function<void (std::string &, NgramIndex,
+                                const std::string &)> NgramFormatter;
+
     Vocab               _vocab;
     vector<NgramVector> _vectors;
     vector<IndexVector> _backoffVectors;
+    SharedPtr<MappedFile> _pMappedFile;
 
 public:
     NgramModel(size_t order = 3);
@@ -74,7 +84,7 @@ public:
                       ZFile &countsFile, bool includeZeroOrder=false) const;
     void   LoadLM(vector<ProbVector> &probVectors,
                   vector<ProbVector> &bowVectors,
-                  ZFile &lmFile);
+                  ZFile &lmFile, bool topOrderBows=false);
     void   SaveLM(const vector<ProbVector> &probVectors,
                   const vector<ProbVector> &bowVectors,
                   ZFile &lmFile) const;
@@ -90,11 +100,22 @@ public:
     void   SaveFeatures(vector<DoubleVector> &featureVectors,
                         ZFile &featureFile) const;
     size_t GetNgramWords(size_t order, NgramIndex index, StrVector &wrds) const;
+    NgramIndex Find(const VocabIndex *words, size_t wordsLen) const
+    { return _Find(words, wordsLen); }
+    void   ExtendVocab(const Vocab &vocab, VocabVector &vocabMap);
     void   ExtendModel(const NgramModel &m, VocabVector &vocabMap,
                        vector<IndexVector> &ngramMap);
     void   SortModel(VocabVector &vocabMap, vector<IndexVector> &ngramMap);
+    void   Compact(const vector<BitVector> &keepVectors,
+                   vector<IndexVector> &ngramMap);
+    void   MergeModels(const vector<const NgramModel *> &models,
+                       vector<VocabVector> &vocabMaps,
+                       vector<vector<IndexVector> > &ngramMaps);
     void   Serialize(FILE *outFile) const;
     void   Deserialize(FILE *inFile);
+    void   SerializeMapped(FILE *outFile) const;
+    void   DeserializeMapped(const SharedPtr<MappedFile> &mappedFile,
+                             char *&p);
 
     template <class T>
     static void ApplySort(const IndexVector &ngramMap, DenseVector<T> &data,
@@ -107,6 +128,18 @@ public:
     data.swap(sortedData);
     }
 
+    // Keeps the data of the n-grams kept by Compact(), in their new order.
+    template <class T>
+    static void ApplyCompact(const IndexVector &ngramMap, DenseVector<T> &data,
+                             size_t length) {
+        assert(data.length() >= ngramMap.length());
+        DenseVector<T> compactData(length);
+        for (size_t i = 0; i < ngramMap.length(); ++i)
+            if (ngramMap[i] != NgramVector::Invalid)
+                compactData[ngramMap[i]] = data[i];
+        data.swap(compactData);
+    }
+
     size_t             size() const             { return _vectors.size(); }
     size_t             sizes(size_t o) const    { return _vectors[o].size(); }
     const Vocab &      vocab() const            { return _vocab; }
@@ -118,6 +151,13 @@ public:
 protected:
     NgramIndex _Find(const VocabIndex *words, size_t wordsLen) const;
     void       _ComputeBackoffs();
+    void       _WriteNgrams(FILE *file, size_t o, size_t begin, size_t end,
+                            const NgramFormatter &format) const;
+    void       _SaveLMSection(FILE *lmFile, size_t o, const ProbVector &probs,
+                              const ProbVector *pBows) const;
+    bool       _LoadLMSection(size_t o, ProbVector &probs, ProbVector *pBows,
+                              const vector<bool> &sortedOrders, ZFile &lmFile);
+    NgramIndex _AddLMLine(const char *p, size_t o, Prob &bow);
     void       _LoadFrequency(vector<DoubleVector> &freqVectors,
                               ZFile &corpusFile, size_t maxSize=0) const;
     void       _LoadEntropy(vector<DoubleVector> &entropyVectors,
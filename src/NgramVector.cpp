@@ -91,6 +91,42 @@ NgramVector::Find(NgramIndex hist, VocabIndex word) const {
     return index;
 }
 
+// Return index of the value in a vector sorted by (hist, word), or -1 if not
+// found.  The search gallops forward from hint, so sequential lookups in sorted
+// order only touch nearby memory, unlike the scattered probes of Find().
+NgramIndex
+NgramVector::FindSorted(NgramIndex hint, NgramIndex hist,
+                        VocabIndex word) const {
+    // Search for the first element not less than (hist, word) in [lo, hi).
+    size_t lo = 0, hi = _length;
+    if ((size_t)hint < _length) {
+        if (_hists[hint] < hist ||
+            (_hists[hint] == hist && _words[hint] < word)) {
+            lo = hint + 1;
+            for (size_t step = 1; lo + step < _length; step *= 2) {
+                size_t i = lo + step - 1;
+                if (_hists[i] > hist ||
+                    (_hists[i] == hist && _words[i] >= word)) {
+                    hi = i + 1;
+                    break;
+                }
+                lo = i + 1;
+            }
+        } else
+            hi = hint + 1;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (_hists[mid] < hist || (_hists[mid] == hist && _words[mid] < word))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < _length && _hists[lo] == hist && _words[lo] == word)
+        return lo;
+    return Invalid;
+}
+
 // Add value to the hash vector and return the associated index.
 // If value already exists, return the existing index.
 NgramIndex
@@ -133,6 +169,19 @@ NgramVector::Add(NgramIndex hist, VocabIndex word, bool *outNew) {
     return *pIndex;
 }
 
+// Append an n-gram known not to exist without updating the index table.
+// The index table must be rebuilt before the next Find() or Add().
+NgramIndex
+NgramVector::Append(NgramIndex hist, VocabIndex word) {
+    assert(hist != Invalid);
+    assert(word != Invalid);
+    if (size() >= _words.length())
+        Reserve(std::max((size_t)1<<16, _words.length()*2));  // Double capacity.
+    _words[_length] = word;
+    _hists[_length] = hist;
+    return _length++;
+}
+
 void
 NgramVector::Reserve(size_t capacity) {
     // Reserve index table and value vector with specified capacity.
@@ -148,15 +197,25 @@ bool NgramVector::Sort(const VocabVector &vocabMap,
                        const IndexVector &boNgramMap,
                        IndexVector &ngramMap) {
     // Update word and hist indices.
+    bool remapped = false;
     for (size_t i = 0; i < size(); ++i) {
-        _words[i] = vocabMap[_words[i]];
-        _hists[i] = boNgramMap[_hists[i]];
+        VocabIndex word = vocabMap[_words[i]];
+        NgramIndex hist = boNgramMap[_hists[i]];
+        remapped |= (word != _words[i] || hist != _hists[i]);
+        _words[i] = word;
+        _hists[i] = hist;
     }
 
     // Sort indices.
     NgramIndexCompare compare(*this);
     IndexVector       sortIndices = Range(0, size());
     if (!sortIndices.sort(compare)) {
+        // Already sorted.  Rebuild index map if the indices changed.
+        if (remapped)
+            _Reindex(_indices.length());
+        Range r(_length);
+        _wordsView.attach(_words[r]);
+        _histsView.attach(_hists[r]);
         ngramMap = Range(size());
         return false;
     }
@@ -205,6 +264,35 @@ NgramVector::Deserialize(FILE *inFile) {
     _histsView.attach(_hists);
 }
 
+// Writes the n-grams along with the index table, so that they can be loaded
+// from a memory-mapped file without rebuilding the index.
+void
+NgramVector::SerializeMapped(FILE *outFile) const {
+    Range r(_length);
+    WriteUInt64(outFile, _length);
+    WriteVector(outFile, _words[r]);
+    WriteVector(outFile, _hists[r]);
+    WriteVector(outFile, _indices);
+    WriteUInt64(outFile, _hashMask);
+}
+
+// Loads the n-grams written by SerializeMapped at p as views into the mapped
+// memory.  The vectors are copied if the n-grams are subsequently modified.
+void
+NgramVector::DeserializeMapped(char *&p, const char *end) {
+    _length = MapUInt64(p, end);
+    MapVector(p, end, _words);
+    MapVector(p, end, _hists);
+    MapVector(p, end, _indices);
+    _hashMask = MapUInt64(p, end);
+    if (_words.length() != _length || _hists.length() != _length ||
+        _indices.length() != _hashMask + 1)
+        throw std::runtime_error("Invalid file format.");
+
+    _wordsView.attach(_words);
+    _histsView.attach(_hists);
+}
+
 // Return the iterator to the position of the value.
 // If value is not found, return the position to insert the value.
 // In case of collision, apply quadratic probing.
@@ -65,13 +65,18 @@ public:
     NgramVector();
     NgramVector(const NgramVector &v);
     NgramIndex Find(NgramIndex hist, VocabIndex word) const;
+    NgramIndex FindSorted(NgramIndex hint, NgramIndex hist,
+                          VocabIndex word) const;
     NgramIndex Add(NgramIndex hist, VocabIndex word);
     NgramIndex Add(NgramIndex hist, VocabIndex word, bool *outNew);
+    NgramIndex Append(NgramIndex hist, VocabIndex word);
     void       Reserve(size_t capacity);
     bool       Sort(const VocabVector &vocabMap, const IndexVector &boNgramMap,
                     IndexVector &ngramMap);
     void       Serialize(FILE *outFile) const;
     void       Deserialize(FILE *inFile);
+    void       SerializeMapped(FILE *outFile) const;
+    void       DeserializeMapped(char *&p, const char *end);
 
     size_t             size() const     { return _length; }
     size_t             capacity() const { return _indices.length(); }
@@ -34,6 +34,7 @@
 
 #include <ctime>
 #include "util/Logger.h"
+#include "InterpolatedNgramLM.h"
 #include "PerplexityOptimizer.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -123,6 +124,10 @@ PerplexityOptimizer::Optimize(ParamVector &params, Optimization technique) {
     case LBFGSBOptimization:
         minEntropy = MinimizeLBFGSB(func, params, numIter);
         break;
+    case EMOptimization:
+        numIter = _OptimizeEM(params);
+        minEntropy = ComputeEntropy(params);
+        break;
     default:
         throw std::runtime_error("Unsupported optimization technique.");
     }
@@ -142,4 +147,244 @@ PerplexityOptimizer::Optimize(ParamVector &params, Optimization technique) {
     return minEntropy;
 }
 
+// Tune the interpolation weights of an InterpolatedNgramLM by EM over the
+// component probabilities of the development set n-grams, which are
+// computed once from the masked component estimates.  The backoff weight of
+// a linearly interpolated history is (1 - sum of its n-gram probabilities) /
+// (1 - sum of their backoff probabilities), where both sums mix the
+// components linearly.  Each numerator is thus another mixture term, and
+// each denominator is bounded by its tangent at the current weights, so
+// each update still increases the likelihood of the full model.  Only
+// CM/GLI feature or component parameters are then tuned along with the
+// weights by LBFGS.  Return the number of iterations.
+int
+PerplexityOptimizer::_OptimizeEM(ParamVector &params) {
+    InterpolatedNgramLM *pLM = dynamic_cast<InterpolatedNgramLM *>(&_lm);
+    if (pLM == NULL)
+        throw std::runtime_error("EM optimization requires an "
+                                 "interpolated LM.");
+    size_t numLMs     = pLM->numLMs();
+    size_t numGroups  = pLM->tieParamOrder() ? 1 : _order;
+    size_t biasStart  = pLM->biasParamStart();
+    size_t biasEnd    = biasStart + (numLMs - 1) * numGroups;
+    if (numLMs < 2 || params.length() < biasEnd)
+        throw std::runtime_error("Unexpected interpolation parameters.");
+    if (!_lm.Estimate(params, _mask))
+        throw std::runtime_error("Invalid initial parameters.");
+
+    // Cache component probabilities of each development set n-gram.
+    vector<double> counts;
+    vector<size_t> groups;
+    vector<double> lmProbs;
+    for (size_t o = 1; o <= _order; o++) {
+        const CountVector &probCounts(_probCountVectors[o]);
+        for (size_t i = 0; i < probCounts.length(); i++) {
+            if (probCounts[i] <= 0) continue;
+            counts.push_back(probCounts[i]);
+            groups.push_back(pLM->tieParamOrder() ? 0 : o - 1);
+            for (size_t l = 0; l < numLMs; ++l)
+                lmProbs.push_back(pLM->lms(l)->GetProb(o, i));
+        }
+    }
+    double totCount = 0;
+    for (size_t e = 0; e < counts.size(); ++e)
+        totCount += counts[e];
+
+    // Cache the component backoff masses of each development set history.
+    // Numerators are mixed with the weights of the n-gram order, and
+    // denominators with those of the history order.
+    vector<double> boCounts;
+    vector<size_t> boGroups;
+    vector<double> boMasses;
+    for (size_t o = 1; o < _order; o++) {
+        const CountVector &bowCounts(_bowCountVectors[o]);
+        const IndexVector &hists(pLM->hists(o + 1));
+        const IndexVector &backoffs(pLM->backoffs(o + 1));
+        vector<int> histIndex(bowCounts.length(), -1);
+        size_t      numHists = 0;
+        for (size_t h = 0; h < bowCounts.length(); h++)
+            if (bowCounts[h] > 0)
+                histIndex[h] = numHists++;
+        if (numHists == 0) continue;
+        vector<double> numerators(numHists * numLMs, 1);
+        vector<double> denominators(numHists * numLMs, 1);
+        for (size_t i = 0; i < hists.length(); i++) {
+            int k = histIndex[hists[i]];
+            if (k < 0) continue;
+            for (size_t l = 0; l < numLMs; ++l) {
+                numerators[k * numLMs + l] -=
+                    pLM->lms(l)->GetProb(o + 1, i);
+                denominators[k * numLMs + l] -=
+                    pLM->lms(l)->GetProb(o, backoffs[i]);
+            }
+        }
+        for (size_t h = 0; h < bowCounts.length(); h++) {
+            int k = histIndex[h];
+            if (k < 0) continue;
+            counts.push_back(bowCounts[h]);
+            groups.push_back(pLM->tieParamOrder() ? 0 : o);
+            boCounts.push_back(bowCounts[h]);
+            boGroups.push_back(pLM->tieParamOrder() ? 0 : o - 1);
+            for (size_t l = 0; l < numLMs; ++l) {
+                lmProbs.push_back(std::max(numerators[k * numLMs + l], 0.0));
+                boMasses.push_back(
+                    std::max(denominators[k * numLMs + l], 0.0));
+            }
+        }
+    }
+
+    // Initialize weights from bias parameters of each order.
+    vector<double> weights(numGroups * numLMs);
+    for (size_t g = 0; g < numGroups; ++g) {
+        double *w = &weights[g * numLMs];
+        double  totWeight = w[0] = 1;
+        for (size_t l = 1; l < numLMs; ++l)
+            totWeight += w[l] = std::exp(params[biasStart +
+                                                g * (numLMs - 1) + l - 1]);
+        for (size_t l = 0; l < numLMs; ++l)
+            w[l] /= totWeight;
+    }
+
+    // Computes the log likelihood of weights w and their EM update newW.
+    vector<double> posteriors(numGroups * numLMs);
+    vector<double> costs(numGroups * numLMs);
+    auto emStep = [&](const vector<double> &w, vector<double> &newW) {
+        double totLogProb = 0;
+        std::fill(posteriors.begin(), posteriors.end(), 0.0);
+        std::fill(costs.begin(), costs.end(), 0.0);
+        for (size_t e = 0; e < counts.size(); ++e) {
+            const double *we = &w[groups[e] * numLMs];
+            const double *p  = &lmProbs[e * numLMs];
+            double prob = 0;
+            for (size_t l = 0; l < numLMs; ++l)
+                prob += we[l] * p[l];
+            if (prob <= 0) continue;
+            totLogProb += counts[e] * std::log(prob);
+            double *post = &posteriors[groups[e] * numLMs];
+            for (size_t l = 0; l < numLMs; ++l)
+                post[l] += counts[e] * we[l] * p[l] / prob;
+        }
+        for (size_t e = 0; e < boCounts.size(); ++e) {
+            const double *we = &w[boGroups[e] * numLMs];
+            const double *m  = &boMasses[e * numLMs];
+            double mass = 0;
+            for (size_t l = 0; l < numLMs; ++l)
+                mass += we[l] * m[l];
+            if (mass <= 0) continue;
+            totLogProb -= boCounts[e] * std::log(mass);
+            double *cost = &costs[boGroups[e] * numLMs];
+            for (size_t l = 0; l < numLMs; ++l)
+                cost[l] += boCounts[e] * m[l] / mass;
+        }
+
+        // Maximize sum(post * log(w)) - sum(cost * w) subject to sum(w) = 1,
+        // where w = post / (cost + mu).  Find mu by bisection, between the
+        // pole of the smallest cost and the value where sum(w) <= 1.
+        newW = w;
+        for (size_t g = 0; g < numGroups; ++g) {
+            double *wg   = &newW[g * numLMs];
+            double *post = &posteriors[g * numLMs];
+            double *cost = &costs[g * numLMs];
+            double  totPost = 0;
+            double  minCost = std::numeric_limits<double>::infinity();
+            for (size_t l = 0; l < numLMs; ++l) {
+                totPost += post[l];
+                if (post[l] > 0)
+                    minCost = std::min(minCost, cost[l]);
+            }
+            if (totPost <= 0) continue;
+            double lo = -minCost, hi = totPost - minCost;
+            for (int i = 0; i < 200; ++i) {
+                double mu = 0.5 * (lo + hi), totWeight = 0;
+                if (mu <= lo || mu >= hi) break;
+                for (size_t l = 0; l < numLMs; ++l)
+                    if (post[l] > 0)
+                        totWeight += post[l] / (cost[l] + mu);
+                if (totWeight > 1)
+                    lo = mu;
+                else
+                    hi = mu;
+            }
+            double totWeight = 0;
+            for (size_t l = 0; l < numLMs; ++l)
+                totWeight += wg[l] =
+                    (post[l] > 0) ? post[l] / (cost[l] + hi) : 0;
+            for (size_t l = 0; l < numLMs; ++l)
+                wg[l] /= totWeight;
+        }
+        return totLogProb;
+    };
+
+    // Iterate until the log likelihood converges.  EM converges slowly when
+    // the components are similar, so each pair of EM steps is extrapolated
+    // with SQUAREM (Varadhan and Roland, 2008), falling back to the second
+    // EM step when the extrapolation is worse than it.
+    const int    maxIter = 100;
+    const double tolerance = 1e-7;
+    vector<double> weights1, weights2, extrapolated, nextWeights;
+    double prevLogProb = -std::numeric_limits<double>::infinity();
+    int  iter = 0;
+    bool converged = false;
+    while (iter < maxIter) {
+        ++iter;
+        double logProb  = emStep(weights, weights1);
+        Logger::Log(2, "EM iteration %i: %f\n", iter,
+                    std::exp(-logProb / totCount));
+        if (logProb - prevLogProb < tolerance * totCount) {
+            weights.swap(weights1);
+            converged = true;
+            break;
+        }
+        prevLogProb = logProb;
+        double logProb1 = emStep(weights1, weights2);
+
+        // Step length from the first and second differences.
+        double rr = 0, vv = 0;
+        for (size_t i = 0; i < weights.size(); ++i) {
+            double r = weights1[i] - weights[i];
+            double v = weights2[i] - 2 * weights1[i] + weights[i];
+            rr += r * r;
+            vv += v * v;
+        }
+        double alpha = (vv > 0) ? -std::sqrt(rr / vv) : -1;
+        for (; alpha < -1; alpha = (alpha - 1) / 2) {
+            bool feasible = true;
+            extrapolated.resize(weights.size());
+            for (size_t i = 0; i < weights.size(); ++i) {
+                double r = weights1[i] - weights[i];
+                double v = weights2[i] - 2 * weights1[i] + weights[i];
+                extrapolated[i] = weights[i] - 2 * alpha * r + alpha * alpha * v;
+                if (extrapolated[i] < 0) feasible = false;
+            }
+            if (feasible) break;
+        }
+        if (alpha < -1 && emStep(extrapolated, nextWeights) >= logProb1)
+            weights.swap(nextWeights);
+        else
+            weights.swap(weights2);
+    }
+    if (!converged)
+        Logger::Warn(1, "EM did not converge in %i iterations.\n", maxIter);
+
+    // Map weights back to bias parameters relative to the first LM.
+    const double minWeight = 1e-8;
+    for (size_t g = 0; g < numGroups; ++g) {
+        const double *w = &weights[g * numLMs];
+        for (size_t l = 1; l < numLMs; ++l)
+            params[biasStart + g * (numLMs - 1) + l - 1] =
+                std::log(std::max(w[l], minWeight) /
+                         std::max(w[0], minWeight));
+    }
+
+    // Tune remaining parameters starting from the EM weights.
+    if (pLM->interpolation() != LI || biasStart > 0 ||
+        params.length() > biasEnd) {
+        ComputeEntropyFunc func(*this);
+        int numLBFGSIter;
+        MinimizeLBFGS(func, params, numLBFGSIter);
+        iter += numLBFGSIter;
+    }
+    return iter;
+}
+
 }
@@ -77,6 +77,9 @@ public:
     { return std::exp(ComputeEntropy(params)); }
     double Optimize(ParamVector &params,
                     Optimization technique=PowellOptimization);
+
+private:
+    int    _OptimizeEM(ParamVector &params);
 };
 
 }
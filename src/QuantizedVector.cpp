@@ -0,0 +1,165 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "util/FastIO.h"
+#include "util/Logger.h"
+#include "QuantizedVector.h"
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const size_t kMaxSamples = 1 << 20;
+static const size_t kMaxIterations = 20;
+
+// Return the index of the center nearest to x, given the midpoints between
+// consecutive sorted centers.
+static inline size_t
+NearestCenter(const std::vector<double> &bounds, double x) {
+    return std::upper_bound(bounds.begin(), bounds.end(), x) - bounds.begin();
+}
+
+static void
+ComputeBounds(const std::vector<double> &centers, std::vector<double> &bounds) {
+    bounds.resize(centers.size() - 1);
+    for (size_t j = 0; j < bounds.size(); ++j)
+        bounds[j] = 0.5 * (centers[j] + centers[j + 1]);
+}
+
+void
+QuantizedVector::Quantize(const ProbVector &values, size_t bits,
+                          Prob exactValue) {
+    if (bits < 1 || bits > 16)
+        throw std::invalid_argument("Quantization bits must be from 1 to 16.");
+    _length = values.length();
+    _bits   = bits;
+
+    // Collect log values, excluding the exact value.
+    std::vector<double> logValues;
+    logValues.reserve(_length);
+    for (size_t i = 0; i < _length; ++i)
+        if (values[i] != exactValue)
+            logValues.push_back(std::log(values[i]));
+
+    // Initialize centers to quantiles of a sample of the log values.
+    size_t              numCenters = ((size_t)1 << bits) - 1;
+    std::vector<double> centers;
+    if (!logValues.empty()) {
+        std::vector<double> samples;
+        size_t stride = (logValues.size() + kMaxSamples - 1) / kMaxSamples;
+        for (size_t i = 0; i < logValues.size(); i += stride)
+            samples.push_back(logValues[i]);
+        std::sort(samples.begin(), samples.end());
+        for (size_t j = 0; j < numCenters; ++j)
+            centers.push_back(samples[(2 * j + 1) * samples.size() /
+                                      (2 * numCenters)]);
+        centers.erase(std::unique(centers.begin(), centers.end()),
+                      centers.end());
+    }
+
+    // Refine centers using Lloyd's algorithm.
+    std::vector<double> bounds, sums;
+    std::vector<size_t> counts;
+    for (size_t iter = 0; iter < kMaxIterations && centers.size() > 1; ++iter) {
+        ComputeBounds(centers, bounds);
+        sums.assign(centers.size(), 0);
+        counts.assign(centers.size(), 0);
+        for (size_t i = 0; i < logValues.size(); ++i) {
+            size_t j = NearestCenter(bounds, logValues[i]);
+            sums[j] += logValues[i];
+            counts[j]++;
+        }
+        double maxDelta = 0;
+        for (size_t j = 0; j < centers.size(); ++j) {
+            if (counts[j] == 0) continue;
+            double center = sums[j] / counts[j];
+            maxDelta = std::max(maxDelta, std::fabs(center - centers[j]));
+            centers[j] = center;
+        }
+        std::sort(centers.begin(), centers.end());
+        if (maxDelta < 1e-9) break;
+    }
+
+    // Build codebook and encode values.
+    _codebook.reset(centers.size() + 1);
+    _codebook[0] = exactValue;
+    for (size_t j = 0; j < centers.size(); ++j)
+        _codebook[j + 1] = std::exp(centers[j]);
+    if (centers.size() > 1)
+        ComputeBounds(centers, bounds);
+    else
+        bounds.clear();
+    _codes.reset(_length * ((bits <= 8) ? 1 : 2));
+    for (size_t i = 0; i < _length; ++i) {
+        size_t code = (values[i] == exactValue) ? 0 :
+            NearestCenter(bounds, std::log(values[i])) + 1;
+        if (bits <= 8)
+            _codes[i] = (byte)code;
+        else
+            reinterpret_cast<ushort *>(_codes.data())[i] = (ushort)code;
+    }
+}
+
+void
+QuantizedVector::Decode(ProbVector &values) const {
+    values.reset(_length);
+    for (size_t i = 0; i < _length; ++i)
+        values[i] = (*this)[i];
+}
+
+void
+QuantizedVector::Serialize(FILE *outFile) const {
+    WriteUInt64(outFile, _length);
+    WriteUInt64(outFile, _bits);
+    WriteVector(outFile, _codebook);
+    WriteVector(outFile, _codes);
+}
+
+// Loads the vector written by Serialize at p as views into the mapped memory.
+void
+QuantizedVector::DeserializeMapped(char *&p, const char *end) {
+    _length = MapUInt64(p, end);
+    _bits   = MapUInt64(p, end);
+    MapVector(p, end, _codebook);
+    MapVector(p, end, _codes);
+    if (_bits < 1 || _bits > 16 ||
+        _codes.length() != _length * ((_bits <= 8) ? 1 : 2))
+        throw std::runtime_error("Invalid file format.");
+}
+
+}
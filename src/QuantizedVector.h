@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef QUANTIZEDVECTOR_H
+#define QUANTIZEDVECTOR_H
+
+#include <cstdio>
+#include "Types.h"
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+// QuantizedVector stores a vector of probabilities (or backoff weights) as
+// 8 or 16-bit codes into a codebook of at most 2^bits values.  The codebook is
+// trained with k-means on the log values, initialized from their quantiles.
+// Code 0 is reserved for an exact value, such as a zero probability or a unit
+// backoff weight, which is common and should not incur quantization error.
+//
+class QuantizedVector {
+protected:
+    size_t     _length;
+    size_t     _bits;
+    ProbVector _codebook;
+    ByteVector _codes;    // 1 byte per code if bits <= 8; otherwise 2 bytes.
+
+public:
+    QuantizedVector() : _length(0), _bits(0) { }
+
+    void Quantize(const ProbVector &values, size_t bits, Prob exactValue);
+    void Decode(ProbVector &values) const;
+    void Serialize(FILE *outFile) const;
+    void DeserializeMapped(char *&p, const char *end);
+
+    size_t length() const { return _length; }
+    size_t bits() const   { return _bits; }
+    Prob operator[](size_t i) const {
+        return _codebook[(_bits <= 8) ? _codes[i] :
+            reinterpret_cast<const ushort *>(_codes.data())[i]];
+    }
+};
+
+}
+
+#endif // QUANTIZEDVECTOR_H
@@ -0,0 +1,328 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include "util/FastIO.h"
+#include "util/Logger.h"
+#include "util/constants.h"
+#include "SentenceScorer.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace mitlm {
+
+// A batch of consecutive input lines.  The words of line i are stored in
+// words[starts[i]..starts[i+1]), including the sentence boundary markers.
+// Lines that are not scored (document markup) have no words.
+struct SentenceScorer::Batch {
+    vector<VocabIndex> words;
+    vector<size_t>     starts;
+    std::string        output;
+    size_t             numSentences;
+    size_t             numOOV;
+    size_t             numWords;
+    double             totLogProb;
+
+    Batch() : numSentences(0), numOOV(0), numWords(0), totLogProb(0) { }
+};
+
+// Work queue shared by the reader, the workers, and the writer.  At most
+// maxInFlight batches exist between being read and being written.
+class SentenceScorer::Pipeline {
+    std::mutex                  _mutex;
+    std::condition_variable     _readerCond;
+    std::condition_variable     _workerCond;
+    std::condition_variable     _writerCond;
+    std::deque<std::pair<size_t, Batch *> > _work;
+    std::map<size_t, Batch *>   _done;
+    size_t                      _maxInFlight;
+    size_t                      _numInFlight;
+    size_t                      _numBatches;
+    bool                        _closed;
+    std::exception_ptr          _error;
+
+public:
+    Pipeline(size_t maxInFlight)
+        : _maxInFlight(maxInFlight), _numInFlight(0), _numBatches(0),
+          _closed(false) { }
+    ~Pipeline() {
+        for (size_t i = 0; i < _work.size(); ++i)
+            delete _work[i].second;
+        std::map<size_t, Batch *>::iterator it;
+        for (it = _done.begin(); it != _done.end(); ++it)
+            delete it->second;
+    }
+
+    // Queues a batch for scoring.  Blocks while too many batches are in
+    // flight.  Returns false if the pipeline was aborted.
+    bool PushWork(Batch *batch) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_numInFlight >= _maxInFlight && !_error)
+            _readerCond.wait(lock);
+        if (_error) {
+            delete batch;
+            return false;
+        }
+        ++_numInFlight;
+        _work.push_back(std::make_pair(_numBatches++, batch));
+        _workerCond.notify_one();
+        return true;
+    }
+
+    // Returns the next batch to score, or NULL if no more work remains.
+    Batch *PopWork(size_t &seq) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_work.empty() && !_closed && !_error)
+            _workerCond.wait(lock);
+        if (_work.empty() || _error)
+            return NULL;
+        seq = _work.front().first;
+        Batch *batch = _work.front().second;
+        _work.pop_front();
+        return batch;
+    }
+
+    void PushDone(size_t seq, Batch *batch) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done[seq] = batch;
+        _writerCond.notify_one();
+    }
+
+    // Returns batch seq once it is scored, or NULL if all batches have
+    // been written.
+    Batch *PopDone(size_t seq) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_done.find(seq) == _done.end() && !_error &&
+               !(_closed && seq == _numBatches))
+            _writerCond.wait(lock);
+        if (_error || seq == _numBatches)
+            return NULL;
+        Batch *batch = _done[seq];
+        _done.erase(seq);
+        return batch;
+    }
+
+    // Signals that a batch has been written and its memory released.
+    void Release() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_numInFlight;
+        _readerCond.notify_one();
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _workerCond.notify_all();
+        _writerCond.notify_all();
+    }
+
+    void Abort(std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error) _error = error;
+        _readerCond.notify_all();
+        _workerCond.notify_all();
+        _writerCond.notify_all();
+    }
+
+    std::exception_ptr error() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _error;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+SentenceScorer::ScoreCorpus(ZFile &corpusFile, ZFile &scoresFile) {
+    if (scoresFile == NULL) throw std::invalid_argument("Invalid file");
+    _ScoreCorpus(corpusFile, scoresFile);
+}
+
+void
+SentenceScorer::ScoreCorpus(ZFile &corpusFile) {
+    _ScoreCorpus(corpusFile, NULL);
+}
+
+// Score corpusFile, writing the scores to scoresFile unless it is NULL.
+void
+SentenceScorer::_ScoreCorpus(ZFile &corpusFile, FILE *scoresFile) {
+    if (corpusFile == NULL) throw std::invalid_argument("Invalid file");
+
+    size_t numThreads = _numThreads;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    Pipeline pipeline(4 * numThreads);
+
+    // Start workers to score batches.
+    vector<std::thread> workers;
+    for (size_t t = 0; t < numThreads; ++t)
+        workers.push_back(std::thread([this, &pipeline]() {
+            try {
+                size_t seq;
+                Batch *batch;
+                while ((batch = pipeline.PopWork(seq)) != NULL) {
+                    _ScoreBatch(*batch);
+                    pipeline.PushDone(seq, batch);
+                }
+            } catch (...) {
+                pipeline.Abort(std::current_exception());
+            }
+        }));
+
+    // Start writer to output batches in input order.
+    _numSentences = _numOOV = _numWords = 0;
+    _totLogProb = 0;
+    std::thread writer([this, &pipeline, scoresFile]() {
+        try {
+            Batch *batch;
+            for (size_t seq = 0; (batch = pipeline.PopDone(seq)); ++seq) {
+                if (scoresFile != NULL && !batch->output.empty() &&
+                    fwrite(batch->output.data(), batch->output.size(), 1,
+                           scoresFile) != 1) {
+                    delete batch;
+                    throw std::runtime_error("Write failed.");
+                }
+                _numSentences += batch->numSentences;
+                _numOOV       += batch->numOOV;
+                _numWords     += batch->numWords;
+                _totLogProb   += batch->totLogProb;
+                delete batch;
+                pipeline.Release();
+            }
+        } catch (...) {
+            pipeline.Abort(std::current_exception());
+        }
+    });
+
+    // Read and tokenize batches of lines.
+    const Vocab &vocab(_lm.vocab());
+    char         line[kMaxLineLength];
+    bool         more = true;
+    while (more) {
+        Batch *batch = new Batch();
+        batch->starts.push_back(0);
+        while (batch->starts.size() <= _batchSize &&
+               (more = getline(corpusFile, line, kMaxLineLength))) {
+            if (strncmp(line, "<DOC ", 5) != 0 && strcmp(line, "</DOC>") != 0) {
+                batch->words.push_back(Vocab::EndOfSentence);
+                char *p = &line[0];
+                while (*p != 0) {
+                    while (isspace(*p)) ++p;  // Skip consecutive spaces.
+                    if (*p == 0) break;
+                    const char *token = p;
+                    while (*p != 0 && !isspace(*p))  ++p;
+                    size_t len = p - token;
+                    if (*p != 0) *p++ = 0;
+                    batch->words.push_back(vocab.Find(token, len));
+                }
+                batch->words.push_back(Vocab::EndOfSentence);
+            }
+            batch->starts.push_back(batch->words.size());
+        }
+        if (batch->starts.size() == 1) {
+            delete batch;
+            break;
+        }
+        if (!pipeline.PushWork(batch))
+            break;
+    }
+    pipeline.Close();
+
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+    writer.join();
+    if (pipeline.error())
+        std::rethrow_exception(pipeline.error());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+SentenceScorer::_ScoreBatch(Batch &batch) const {
+    size_t order = _lm.model().size() - 1;
+    char   buf[64];
+    for (size_t l = 0; l < batch.starts.size() - 1; ++l) {
+        const VocabIndex *words = &batch.words[batch.starts[l]];
+        size_t            numWords = batch.starts[l+1] - batch.starts[l];
+        if (numWords == 0) {
+            batch.output += '\n';
+            continue;
+        }
+
+        // Score each word, resetting the history at OOV words.
+        std::string wordScores;
+        double      logProb = 0;
+        size_t      numOOV = 0, numScored = 0;
+        size_t      ngramOrder = std::min((size_t)2, order);
+        for (size_t i = 1; i < numWords; ++i) {
+            if (words[i] == Vocab::Invalid) {
+                ngramOrder = 1;
+                numOOV++;
+                if (_wordScores) wordScores += " OOV";
+            } else {
+                double wordLogProb = std::log10(
+                    _lm.ComputeProb(&words[i - ngramOrder + 1], ngramOrder));
+                logProb += wordLogProb;
+                numScored++;
+                ngramOrder = std::min(ngramOrder + 1, order);
+                if (_wordScores) {
+                    sprintf(buf, " %.6f", wordLogProb);
+                    wordScores += buf;
+                }
+            }
+        }
+
+        sprintf(buf, "%.6f\t%lu\t%lu", logProb, numScored, numOOV);
+        batch.output += buf;
+        if (_wordScores) {
+            batch.output += '\t';
+            batch.output.append(wordScores, 1, std::string::npos);
+        }
+        batch.output += '\n';
+        batch.numSentences++;
+        batch.numOOV     += numOOV;
+        batch.numWords   += numScored;
+        batch.totLogProb += logProb;
+    }
+}
+
+}
@@ -0,0 +1,96 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef SENTENCESCORER_H
+#define SENTENCESCORER_H
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include "util/ZFile.h"
+#include "Types.h"
+#include "NgramLM.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+// SentenceScorer streams a corpus through an LM and writes the log10
+// probability of each sentence, in input order, one line per input line.
+// A reader (the calling thread) tokenizes fixed-size batches of lines, a pool
+// of workers scores them, and a writer thread emits the batches in order.
+// The number of batches in flight is bounded, so memory usage does not grow
+// with the size of the corpus.
+//
+class SentenceScorer {
+protected:
+    const NgramLMBase &_lm;
+    size_t             _numThreads;
+    size_t             _batchSize;
+    bool               _wordScores;
+    size_t             _numSentences;
+    size_t             _numOOV;
+    size_t             _numWords;
+    double             _totLogProb;
+
+    struct Batch;
+    class  Pipeline;
+
+    void _ScoreBatch(Batch &batch) const;
+    void _ScoreCorpus(ZFile &corpusFile, FILE *scoresFile);
+
+public:
+    SentenceScorer(const NgramLMBase &lm, size_t numThreads=1)
+        : _lm(lm), _numThreads(numThreads), _batchSize(1024),
+          _wordScores(false), _numSentences(0), _numOOV(0), _numWords(0),
+          _totLogProb(0) { }
+
+    void   SetNumThreads(size_t numThreads) { _numThreads = numThreads; }
+    void   SetBatchSize(size_t batchSize)   { _batchSize = batchSize; }
+    void   SetWordScores(bool wordScores)   { _wordScores = wordScores; }
+    void   ScoreCorpus(ZFile &corpusFile, ZFile &scoresFile);
+    void   ScoreCorpus(ZFile &corpusFile);  // Only accumulate the totals.
+
+    size_t numSentences() const { return _numSentences; }
+    size_t numOOV() const       { return _numOOV; }
+    size_t numWords() const     { return _numWords; }
+    double totLogProb() const   { return _totLogProb; }
+    double ComputePerplexity() const
+    { return std::pow(10.0, -_totLogProb / _numWords); }
+};
+
+}
+
+#endif // SENTENCESCORER_H
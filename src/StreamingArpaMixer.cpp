@@ -0,0 +1,498 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "util/FastIO.h"
+#include "util/Logger.h"
+#include "util/SharedPtr.h"
+#include "util/constants.h"
+#include "NgramLM.h"
+#include "StreamingArpaMixer.h"
+
+using std::vector;
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads the n-grams of one order of an ARPA LM in file order, resolving their
+// histories and words in the merged model.
+
+class StreamingArpaMixer::_SectionReader {
+public:
+    NgramIndex hist;  // Merged history of the current n-gram
+    VocabIndex word;  // Merged word of the current n-gram
+    Prob       prob;
+    bool       done;
+
+    _SectionReader(const NgramModel &model, const char *filename, size_t o);
+    void Next();
+
+private:
+    const NgramModel  &_model;
+    ZFile              _file;
+    size_t             _order;
+    vector<char>       _line;
+    vector<VocabIndex> _words;
+    vector<NgramIndex> _hists;
+    vector<NgramIndex> _hints;     // Last history found of each order
+    size_t             _numHists;  // Histories resolved for previous words
+};
+
+StreamingArpaMixer::_SectionReader::_SectionReader(const NgramModel &model,
+                                                   const char *filename,
+                                                   size_t o)
+    : hist(NgramVector::Invalid), word(Vocab::Invalid), prob(0),
+      done(false), _model(model), _file(filename, "r"), _order(o),
+      _line(mitlm::kMaxLineLength), _words(o), _hists(o), _hints(o, 0),
+      _numHists(0) {
+    // Skip to the section header.  Components of lower order have no
+    // n-grams of this order.
+    unsigned int i;
+    while (true) {
+        if (!getline(_file, &_line[0], _line.size()) ||
+            strcmp(&_line[0], "\\end\\") == 0) {
+            done = true;
+            return;
+        }
+        if (_line[0] == '\\' &&
+            sscanf(&_line[0], "\\%u-grams:", &i) == 1 && i == o)
+            break;
+    }
+    Next();
+}
+
+// Advances to the next n-gram of the section, which must follow the current
+// one in the sorted order of the merged model.
+void
+StreamingArpaMixer::_SectionReader::Next() {
+    if (!getline(_file, &_line[0], _line.size()) || _line[0] == '\0') {
+        done = true;  // Empty line ends section.
+        return;
+    }
+    const char *p = &_line[0];
+    prob = (Prob)Pow10(ParseDouble(p));
+
+    // Look up words, reusing the words and histories of the prefix shared
+    // with the previous n-gram.  Since n-grams are sorted, the histories are
+    // found by searching forward in the sorted merged model.
+    const Vocab &vocab(_model.vocab());
+    size_t       k = 0;
+    for (size_t i = 0; i < _order; ++i) {
+        while (isspace(*p)) ++p;
+        const char *token = p;
+        while (*p != 0 && !isspace(*p)) ++p;
+        size_t len = p - token;
+        if (k == i && k < _numHists && vocab.wordlen(_words[i]) == len &&
+            strncmp(vocab[_words[i]], token, len) == 0) {
+            ++k;
+            continue;
+        }
+        VocabIndex w = vocab.Find(token, len);
+        if (w == Vocab::Invalid) {
+            Logger::Error(1, "Unknown word in %s: %s\n",
+                          _file.filename(), &_line[0]);
+            throw std::runtime_error("Unknown word.");
+        }
+        if (k == i && k < _numHists && _words[i] == w)
+            ++k;
+        _words[i] = w;
+    }
+    for (; k < _order - 1; ++k) {
+        _hists[k] = _model.vectors(k + 1).FindSorted(
+            _hints[k], k ? _hists[k - 1] : 0, _words[k]);
+        if (_hists[k] == NgramVector::Invalid) {
+            Logger::Error(1, "Missing history in %s: %s\n",
+                          _file.filename(), &_line[0]);
+            throw std::runtime_error("Missing n-gram history.");
+        }
+        _hints[k] = _hists[k];
+    }
+    _numHists = _order - 1;
+
+    NgramIndex prevHist = hist;
+    VocabIndex prevWord = word;
+    hist = _hists[_order - 2];
+    word = _words[_order - 1];
+    if (prevHist != NgramVector::Invalid &&
+        (hist < prevHist || (hist == prevHist && word <= prevWord))) {
+        Logger::Error(1, "Unsorted %lu-grams in %s: %s\n",
+                      (unsigned long)_order, _file.filename(), &_line[0]);
+        throw std::runtime_error("Unsorted n-grams.");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+StreamingArpaMixer::StreamingArpaMixer(size_t order, bool tieParamOrder)
+    : _order(order), _tieParamOrder(tieParamOrder),
+      _model(order > 1 ? order - 1 : 1) { }
+
+void
+StreamingArpaMixer::LoadLMs(const vector<string> &lmFiles) {
+    if (_order < 2)
+        throw std::invalid_argument("Unsupported n-gram order.");
+    _lmFiles = lmFiles;
+    size_t numLMs = _lmFiles.size();
+
+    // Load the lower orders of each component, along with the backoff
+    // weights of the highest of them.
+    vector<SharedPtr<NgramModel> > models(numLMs);
+    vector<const NgramModel *>     modelPtrs(numLMs);
+    _lmProbs.resize(numLMs);
+    _lmBows.resize(numLMs);
+    for (size_t l = 0; l < numLMs; ++l) {
+        Logger::Log(1, "Loading lower orders of component LM %s...\n",
+                    _lmFiles[l].c_str());
+        ZFile lmFile(_lmFiles[l].c_str(), "r");
+        uint64_t version = ReadUInt64(lmFile);
+        if (version == MITLMv1 || version == MITLMv2)
+            throw std::invalid_argument("Streaming mix requires ARPA LMs.");
+        lmFile.ReOpen();
+        models[l] = new NgramModel(_order - 1);
+        models[l]->LoadLM(_lmProbs[l], _lmBows[l], lmFile, true);
+        modelPtrs[l] = models[l].get();
+    }
+
+    // Merge lower orders, and reorder the explicit probabilities and backoff
+    // weights of each component by merged index.  Missing probabilities are
+    // filled in with backoff values on demand, as in NgramLMBase::SetModel().
+    vector<VocabVector>          vocabMaps;
+    vector<vector<IndexVector> > ngramMaps;
+    _model.MergeModels(modelPtrs, vocabMaps, ngramMaps);
+    models.clear();
+    _explicitBits.resize(numLMs);
+    _explicitRanks.resize(numLMs);
+    for (size_t l = 0; l < numLMs; ++l) {
+        _explicitBits[l].resize(_order);
+        _explicitRanks[l].resize(_order);
+        for (size_t o = 1; o < _order; ++o) {
+            const IndexVector &map(ngramMaps[l][o]);
+            NgramLMBase::BuildExplicitIndex(map, _model.sizes(o),
+                                            _explicitBits[l][o],
+                                            _explicitRanks[l][o]);
+            ProbVector probs(map.length()), bows(map.length());
+            for (size_t j = 0; j < map.length(); ++j) {
+                NgramIndex rank = 0;
+                NgramLMBase::FindExplicit(_explicitBits[l][o],
+                                          _explicitRanks[l][o], map[j], rank);
+                probs[rank] = _lmProbs[l][o][j];
+                bows[rank]  = _lmBows[l][o][j];
+            }
+            _lmProbs[l][o].swap(probs);
+            _lmBows[l][o].swap(bows);
+        }
+    }
+
+    // Allocate mixed probabilities and backoff weights.
+    _probVectors.resize(_order);
+    _bowVectors.resize(_order);
+    for (size_t o = 0; o < _order; ++o) {
+        _probVectors[o].reset(_model.sizes(o), 0);
+        _bowVectors[o].reset(_model.sizes(o), 1);
+    }
+
+    // Default to equal weights.
+    _defParams.reset((numLMs - 1) * (_tieParamOrder ? 1 : _order), 0);
+}
+
+// Interpolates the components with weights from the bias parameters, laid out
+// as in InterpolatedNgramLM with linear interpolation, and saves the result.
+void
+StreamingArpaMixer::SaveLM(const ParamVector &params, ZFile &lmFile) {
+    if (lmFile == NULL) throw std::invalid_argument("Invalid file");
+    if (params.length() != _defParams.length())
+        throw std::invalid_argument("Number of parameters mismatched.");
+
+    // Estimate lower orders, then count the highest order n-grams and
+    // normalize the backoff weights of their histories.
+    _EstimateLowerOrders(params);
+    size_t numTopNgrams = _MixTopOrder(params, NULL);
+
+    // Write ARPA backoff LM header.  Add <s> to 1-grams.
+    fputs("\n\\data\\\n", lmFile);
+    fprintf(lmFile, "ngram 1=%lu\n", (unsigned long)_model.sizes(1) + 1);
+    for (size_t o = 2; o < _order; o++)
+        fprintf(lmFile, "ngram %lu=%lu\n",
+                (unsigned long)o, (unsigned long)_model.sizes(o));
+    fprintf(lmFile, "ngram %lu=%lu\n",
+            (unsigned long)_order, (unsigned long)numTopNgrams);
+
+    // Write lower order n-grams, then stream the highest order n-grams.
+    for (size_t o = 1; o < _order; o++)
+        _model._SaveLMSection(lmFile, o, _probVectors[o], &_bowVectors[o]);
+    fprintf(lmFile, "\n\\%lu-grams:\n", (unsigned long)_order);
+    _MixTopOrder(params, lmFile);
+
+    // Write ARPA backoff LM footer.
+    fputs("\n\\end\\\n", lmFile);
+}
+
+// Returns the probability of merged n-gram i of order o in component l,
+// backing off for n-grams without an explicit probability.
+Prob
+StreamingArpaMixer::_LMProb(size_t l, size_t o, NgramIndex i) const {
+    NgramIndex rank;
+    if (o == 0)
+        return _lmProbs[l][0][i];
+    if (NgramLMBase::FindExplicit(_explicitBits[l][o], _explicitRanks[l][o],
+                                  i, rank) && _lmProbs[l][o][rank] != 0)
+        return _lmProbs[l][o][rank];
+    return _LMProb(l, o - 1, _model.backoffs(o)[i]) *
+           _LMBow(l, o - 1, _model.hists(o)[i]);
+}
+
+// Returns the backoff weight of merged n-gram i of order o in component l.
+Prob
+StreamingArpaMixer::_LMBow(size_t l, size_t o, NgramIndex i) const {
+    NgramIndex rank;
+    if (o == 0)
+        return _lmBows[l][0][i];
+    return NgramLMBase::FindExplicit(_explicitBits[l][o],
+                                     _explicitRanks[l][o], i, rank) ?
+        _lmBows[l][o][rank] : 1;
+}
+
+// Computes the unnormalized weight of each component for order o into
+// weights, as InterpolatedNgramLM does without features.
+void
+StreamingArpaMixer::_ComputeWeights(const ParamVector &params, size_t o,
+                                    vector<Param> &weights,
+                                    Param &totWeight) const {
+    size_t       numLMs = _lmFiles.size();
+    const Param *pBiasParams =
+        &params[_tieParamOrder ? 0 : (o - 1) * (numLMs - 1)];
+    weights.resize(numLMs);
+    totWeight = 0;
+    for (size_t l = 0; l < numLMs; ++l) {
+        weights[l] = std::exp((l == 0) ? 0 : pBiasParams[l - 1]);
+        totWeight += weights[l];
+    }
+}
+
+void
+StreamingArpaMixer::_EstimateLowerOrders(const ParamVector &params) {
+    size_t                 numLMs = _lmFiles.size();
+    vector<vector<Param> > weights(_order);
+    vector<Param>          totWeights(_order);
+    for (size_t o = 1; o < _order; ++o) {
+        _ComputeWeights(params, o, weights[o], totWeights[o]);
+        _probVectors[o] = 0;
+    }
+
+    // Accumulate the weighted probabilities of each component, computing
+    // each order from the one below with a single backoff for n-grams
+    // without an explicit probability.
+    ProbVector boProbs, lmProbs;
+    for (size_t l = 0; l < numLMs; ++l) {
+        boProbs.reset(1, _lmProbs[l][0][0]);
+        for (size_t o = 1; o < _order; ++o) {
+            ProbVector &       probs(_probVectors[o]);
+            const IndexVector &hists(_model.hists(o));
+            const IndexVector &backoffs(_model.backoffs(o));
+            const ProbVector & explicitProbs(_lmProbs[l][o]);
+            NgramIndex         hist = NgramVector::Invalid;
+            Prob               bow = 1;
+            lmProbs.reset(probs.length());
+            for (size_t i = 0; i < probs.length(); ++i) {
+                NgramIndex rank;
+                if (NgramLMBase::FindExplicit(_explicitBits[l][o],
+                                              _explicitRanks[l][o], i, rank) &&
+                    explicitProbs[rank] != 0) {
+                    lmProbs[i] = explicitProbs[rank];
+                } else {
+                    if (hists[i] != hist) {
+                        hist = hists[i];
+                        bow  = _LMBow(l, o - 1, hist);
+                    }
+                    lmProbs[i] = boProbs[backoffs[i]] * bow;
+                }
+                probs[i] += lmProbs[i] * weights[o][l];
+            }
+            boProbs.swap(lmProbs);
+        }
+    }
+    for (size_t o = 1; o < _order; ++o) {
+        ProbVector &probs(_probVectors[o]);
+        for (size_t i = 0; i < probs.length(); ++i)
+            probs[i] /= totWeights[o];
+        assert(!anyTrue(isnan(probs)));
+    }
+
+    // Normalize backoff weights of histories below order _order - 1.
+    for (size_t o = 2; o < _order; ++o) {
+        ProbVector &       bows(_bowVectors[o - 1]);
+        const ProbVector & probs(_probVectors[o]);
+        const ProbVector & boProbs(_probVectors[o - 1]);
+        const IndexVector &hists(_model.hists(o));
+        const IndexVector &backoffs(_model.backoffs(o));
+        ProbVector         numerator(bows.length(), 0);
+        ProbVector         denominator(bows.length(), 0);
+        for (size_t i = 0; i < probs.length(); ++i) {
+            numerator[hists[i]] += probs[i];
+            denominator[hists[i]] += boProbs[backoffs[i]];
+        }
+        for (size_t i = 0; i < bows.length(); ++i)
+            bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
+        assert(!anyTrue(isnan(bows)));
+    }
+}
+
+// Merges the highest order n-grams of the components and interpolates them,
+// backing off for components without the n-gram.  If lmFile is NULL, the
+// backoff weights of their histories are normalized; otherwise, the n-grams
+// are written to lmFile.  Returns the number of merged n-grams.
+size_t
+StreamingArpaMixer::_MixTopOrder(const ParamVector &params, FILE *lmFile) {
+    const size_t       kBufferSize = 1 << 16;
+    size_t             o = _order;
+    size_t             numLMs = _lmFiles.size();
+    const Vocab &      vocab(_model.vocab());
+    const NgramVector &boNgrams(_model.vectors(o - 1));
+    const IndexVector &histBackoffs(_model.backoffs(o - 1));
+    const ProbVector & boProbs(_probVectors[o - 1]);
+    vector<Param>      weights;
+    Param              totWeight;
+    _ComputeWeights(params, o, weights, totWeight);
+
+    vector<SharedPtr<_SectionReader> > readers(numLMs);
+    for (size_t l = 0; l < numLMs; ++l)
+        readers[l] = new _SectionReader(_model, _lmFiles[l].c_str(), o);
+
+    ProbVector numerator, denominator;
+    if (lmFile == NULL) {
+        numerator.reset(_model.sizes(o - 1), 0);
+        denominator.reset(_model.sizes(o - 1), 0);
+    }
+    std::string        buf, prefix;
+    NgramIndex         prefixHist = NgramVector::Invalid;
+    vector<VocabIndex> histWords(o - 1);
+    size_t             numNgrams = 0;
+    vector<NgramIndex> bowHists(numLMs, NgramVector::Invalid);
+    ProbVector         lmBows(numLMs);  // Component bows of bowHists
+    while (true) {
+        // Find the next n-gram in merged order.
+        NgramIndex hist = NgramVector::Invalid;
+        VocabIndex word = Vocab::Invalid;
+        bool       found = false;
+        for (size_t l = 0; l < numLMs; ++l) {
+            const _SectionReader &r(*readers[l]);
+            if (!r.done && (!found || r.hist < hist ||
+                            (r.hist == hist && r.word < word))) {
+                hist  = r.hist;
+                word  = r.word;
+                found = true;
+            }
+        }
+        if (!found) break;
+        // Find the backoff n-gram when needed.
+        NgramIndex bo = NgramVector::Invalid;
+        auto       findBackoff = [&]() {
+            if (bo == NgramVector::Invalid)
+                bo = boNgrams.Find(histBackoffs[hist], word);
+            if (bo == NgramVector::Invalid)
+                throw std::runtime_error("Missing backoff n-gram.");
+        };
+
+        // Interpolate component probabilities.
+        Prob prob = 0;
+        for (size_t l = 0; l < numLMs; ++l) {
+            _SectionReader &r(*readers[l]);
+            Prob lmProb = 0;
+            if (!r.done && r.hist == hist && r.word == word) {
+                lmProb = r.prob;
+                r.Next();
+            }
+            if (lmProb == 0) {
+                findBackoff();
+                if (bowHists[l] != hist) {
+                    bowHists[l] = hist;
+                    lmBows[l]   = _LMBow(l, o - 1, hist);
+                }
+                lmProb = _LMProb(l, o - 1, bo) * lmBows[l];
+            }
+            prob += lmProb * weights[l];
+        }
+        prob /= totWeight;
+        ++numNgrams;
+
+        if (lmFile == NULL) {
+            findBackoff();
+            numerator[hist] += prob;
+            denominator[hist] += boProbs[bo];
+            continue;
+        }
+
+        // Write n-gram, as NgramModel::_WriteNgrams().
+        if (hist != prefixHist) {
+            NgramIndex index = hist;
+            for (size_t j = o - 1; j > 0; --j) {
+                histWords[j - 1] = _model.words(j)[index];
+                index = _model.hists(j)[index];
+            }
+            prefix.clear();
+            for (size_t j = 0; j < o - 1; ++j) {
+                if (j == 0 && histWords[j] == Vocab::EndOfSentence)
+                    prefix.append("<s>");
+                else
+                    prefix.append(vocab[histWords[j]],
+                                  vocab.wordlen(histWords[j]));
+                prefix.push_back(' ');
+            }
+            prefixHist = hist;
+        }
+        sprint_LProb(buf, prob);
+        buf.push_back('\t');
+        buf.append(prefix);
+        buf.append(vocab[word], vocab.wordlen(word));
+        buf.push_back('\n');
+        if (buf.size() >= kBufferSize) {
+            fwrite(buf.data(), 1, buf.size(), lmFile);
+            buf.clear();
+        }
+    }
+
+    if (lmFile == NULL) {
+        ProbVector &bows(_bowVectors[o - 1]);
+        for (size_t i = 0; i < bows.length(); ++i)
+            bows[i] = (1 - numerator[i]) / (1 - denominator[i]);
+        assert(!anyTrue(isnan(bows)));
+    } else
+        fwrite(buf.data(), 1, buf.size(), lmFile);
+    return numNgrams;
+}
+
+}
@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef STREAMINGARPAMIXER_H
+#define STREAMINGARPAMIXER_H
+
+#include <string>
+#include <vector>
+#include "util/ZFile.h"
+#include "Types.h"
+#include "NgramModel.h"
+
+using std::vector;
+using std::string;
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+// StreamingArpaMixer writes the linear interpolation of ARPA LMs with fixed
+// weights, as InterpolatedNgramLM would estimate and save it, without holding
+// the highest order n-grams in memory.  The lower orders of the components are
+// merged, but each component keeps only its explicit n-grams, located among
+// the merged n-grams with a bitmap as in sparse NgramLMBase components, and
+// backs off on demand.  The lower orders are mixed one component at a time, so
+// only the mixed lower orders are dense.  The highest order sections, which
+// must be sorted as written by SaveLM, are then read in lockstep by a k-way
+// merge, once to count the merged n-grams and normalize the backoff weights of
+// their histories, and again to write them out.
+//
+class StreamingArpaMixer {
+protected:
+    size_t                       _order;
+    bool                         _tieParamOrder;
+    NgramModel                   _model;     // Merged orders below _order
+    vector<string>               _lmFiles;
+    vector<vector<ProbVector> >  _lmProbs;   // Component explicit probs
+    vector<vector<ProbVector> >  _lmBows;    // Component explicit bows
+    vector<vector<DenseVector<uint64_t> > > _explicitBits;  // Explicit n-grams
+    vector<vector<IndexVector> > _explicitRanks;  // Explicit before each word
+    vector<ProbVector>           _probVectors;
+    vector<ProbVector>           _bowVectors;
+    ParamVector                  _defParams;
+
+public:
+    StreamingArpaMixer(size_t order = 3, bool tieParamOrder = false);
+    void   LoadLMs(const vector<string> &lmFiles);
+    void   SaveLM(const ParamVector &params, ZFile &lmFile);
+
+    size_t             order() const     { return _order; }
+    size_t             numLMs() const    { return _lmFiles.size(); }
+    const ParamVector &defParams() const { return _defParams; }
+
+private:
+    class _SectionReader;
+
+    Prob   _LMProb(size_t l, size_t o, NgramIndex i) const;
+    Prob   _LMBow(size_t l, size_t o, NgramIndex i) const;
+    void   _ComputeWeights(const ParamVector &params, size_t o,
+                           vector<Param> &weights, Param &totWeight) const;
+    void   _EstimateLowerOrders(const ParamVector &params);
+    size_t _MixTopOrder(const ParamVector &params, FILE *lmFile);
+};
+
+}
+
+#endif // STREAMINGARPAMIXER_H
@@ -84,7 +84,7 @@ Vocab::UseUnknown() {
 // In case of collision, apply quadratic probing.
 VocabIndex
 Vocab::Find(const char *word, size_t len) const {
-    if (len == 3 && strcmp(word, "<s>") == 0)
+    if (len == 3 && strncmp(word, "<s>", 3) == 0)
         return EndOfSentence;
 
     size_t     skip = 0;
@@ -101,7 +101,7 @@ Vocab::Find(const char *word, size_t len) const {
 // If word already exists, return the existing index.
 VocabIndex
 Vocab::Add(const char *word, size_t len) {
-    if (len == 3 && strcmp(word, "<s>") == 0)
+    if (len == 3 && strncmp(word, "<s>", 3) == 0)
         return EndOfSentence;
 
     VocabIndex *pIndex = _FindIndex(word, len);
@@ -232,6 +232,31 @@ Vocab::Deserialize(FILE *inFile) {
     _Reindex(nextPowerOf2(_length + _length/4));
 }
 
+// Writes the vocabulary along with its index table, so that it can be loaded
+// from a memory-mapped file without rebuilding the index.
+void
+Vocab::SerializeMapped(FILE *outFile) const {
+    WriteHeader(outFile, "Vocab");
+    WriteString(outFile, _buffer);
+    WriteVector(outFile, _offsetLens[Range(_length)]);
+    WriteVector(outFile, _indices);
+    WriteUInt64(outFile, _hashMask);
+    WriteUInt64(outFile, (uint64_t)(int64_t)_unkIndex);
+}
+
+// Loads the vocabulary written by SerializeMapped at p.  The offsets and index
+// table reference the mapped memory; only the string buffer is copied.
+void
+Vocab::DeserializeMapped(char *&p, const char *end) {
+    MapHeader(p, end, "Vocab");
+    MapString(p, end, _buffer);
+    MapVector(p, end, _offsetLens);
+    MapVector(p, end, _indices);
+    _length   = _offsetLens.length();
+    _hashMask = MapUInt64(p, end);
+    _unkIndex = (VocabIndex)(int64_t)MapUInt64(p, end);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // Return the iterator to the position of the word.
@@ -86,6 +86,8 @@ public:
     void       SaveVocab(ZFile &vocabFile, bool asBinary=false) const;
     void       Serialize(FILE *outFile) const;
     void       Deserialize(FILE *inFile);
+    void       SerializeMapped(FILE *outFile) const;
+    void       DeserializeMapped(char *&p, const char *end);
 
     bool        IsFixedVocab() const        { return _fixedVocab; }
     size_t      size() const                { return _length; }
@@ -32,7 +32,9 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
 ////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "util/constants.h"
 #include "WordErrorRateOptimizer.h"
 
@@ -47,10 +49,17 @@ WordErrorRateOptimizer::~WordErrorRateOptimizer() {
 
 void
 WordErrorRateOptimizer::LoadLattices(ZFile &latticesFile) {
-    if (ReadUInt64(latticesFile) == MITLMv1) {
+    uint64_t version = ReadUInt64(latticesFile);
+    if (version == MITLMv2) {
+        _LoadLatticeArchive(latticesFile.filename());
+        if (_pruneThreshold > 0)
+            _PruneLattices();
+        return;
+    } else if (version == MITLMv1) {
         _lattices.resize(ReadUInt64(latticesFile));
         for (size_t l = 0; l < _lattices.size(); ++l) {
             _lattices[l] = new Lattice(_lm);
+            _lattices[l]->SetFastLogAdd(_fastLogAdd);
             _lattices[l]->Deserialize(latticesFile);
         }
     } else {
@@ -70,12 +79,17 @@ WordErrorRateOptimizer::LoadLattices(ZFile &latticesFile) {
             Logger::Log(2, "Loading lattice %s...\n", line);
             Lattice *pLattice = new Lattice(_lm);
             pLattice->SetTag(line);
+            pLattice->SetExpandHistories(_expandHistories);
+            pLattice->SetFastLogAdd(_fastLogAdd);
             pLattice->LoadLattice(zfile);
             pLattice->SetReferenceText(trans);
             _lattices.push_back(pLattice);
         }
     }
 
+    if (_pruneThreshold > 0)
+        _PruneLattices();
+
     // Compute prob/bow masks.
     vector<BitVector> probMaskVectors(_order + 1);
     vector<BitVector> bowMaskVectors(_order);
@@ -94,14 +108,33 @@ WordErrorRateOptimizer::LoadLattices(ZFile &latticesFile) {
         }
     }
     _mask = _lm.GetMask(probMaskVectors, bowMaskVectors);
+    _AssignWeightSlots(probMaskVectors, bowMaskVectors);
+    _PackLattices();
 }
 
+// Save lattices as an archive that LoadLattices maps into memory.  The
+// archive holds the weight slots, each lattice in its mapped format, and a
+// table of lattice offsets, followed by the offset of the table.
 void
 WordErrorRateOptimizer::SaveLattices(ZFile &latticesFile) {
-    WriteUInt64(latticesFile, MITLMv1);
+    const char *header = "LatticeArchive";
+    WriteUInt64(latticesFile, MITLMv2);
+    WriteHeader(latticesFile, header);
     WriteUInt64(latticesFile, _lattices.size());
-    for (size_t l = 0; l < _lattices.size(); ++l)
-        _lattices[l]->Serialize(latticesFile);
+    WriteVector(latticesFile, _slots);
+
+    DenseVector<uint64_t> offsets(_lattices.size());
+    uint64_t offset = sizeof(uint64_t) + ((strlen(header) + 7) & ~(size_t)7) +
+        sizeof(uint64_t) + sizeof(uint64_t) +
+        ((_slots.size() * sizeof(WeightSlot) + 7) & ~(size_t)7);
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        const Lattice &lattice = _GetLattice(l);
+        offsets[l] = offset;
+        offset    += lattice.MappedSize();
+        lattice.SerializeMapped(latticesFile);
+    }
+    WriteVector(latticesFile, offsets);
+    WriteUInt64(latticesFile, offset);
 }
 
 void
@@ -109,7 +142,7 @@ WordErrorRateOptimizer::SaveTranscript(ZFile &transcriptFile) {
     string             line;
     vector<VocabIndex> bestPath;
     for (size_t l = 0; l < _lattices.size(); ++l) {
-        const Lattice *lattice = _lattices[l];
+        const Lattice *lattice = &_GetLattice(l);
         lattice->GetBestPath(bestPath);
 
         line = "";
@@ -127,7 +160,7 @@ WordErrorRateOptimizer::SaveTranscript(ZFile &transcriptFile) {
 void
 WordErrorRateOptimizer::SaveUttConfidence(ZFile &confidenceFile) {
     for (size_t l = 0; l < _lattices.size(); ++l) {
-        Lattice *lattice = _lattices[l];
+        Lattice *lattice = &_GetLattice(l);
         fprintf(confidenceFile, "%s\t%f\n",
                 lattice->tag(), lattice->BuildConfusionNetwork());
     }
@@ -136,24 +169,65 @@ WordErrorRateOptimizer::SaveUttConfidence(ZFile &confidenceFile) {
 void
 WordErrorRateOptimizer::SaveWER(ZFile &werFile) {
     for (size_t l = 0; l < _lattices.size(); ++l) {
-        Lattice *lattice = _lattices[l];
+        Lattice *lattice = &_GetLattice(l);
         fprintf(werFile, "%s\t%lu\t%i\n", lattice->tag(),
                 (unsigned long)lattice->refWords().length(),
                 lattice->ComputeWER());
     }
 }
 
+// Write the reference length, word errors, substitutions, deletions, and
+// insertions of each lattice.
+void
+WordErrorRateOptimizer::SaveWERDetails(ZFile &werFile) {
+    Lattice::Scratch    scratch;
+    Lattice::EditCounts counts;
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        const Lattice &lattice = _GetLattice(l);
+        int wer = lattice.ComputeWER(scratch, counts);
+        fprintf(werFile, "%s\t%lu\t%i\t%i\t%i\t%i\n", lattice.tag(),
+                (unsigned long)lattice.refWords().length(), wer,
+                counts.substitutions, counts.deletions, counts.insertions);
+    }
+}
+
+// Write the n best paths of each lattice as "tag rank score words".
+void
+WordErrorRateOptimizer::SaveNBest(ZFile &nbestFile, size_t n) {
+    vector<float>               nbestScores;
+    vector<vector<VocabIndex> > nbestPaths;
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        const Lattice &lattice = _GetLattice(l);
+        lattice.GetNBestPaths(n, nbestScores, nbestPaths);
+        for (size_t k = 0; k < nbestPaths.size(); ++k) {
+            fprintf(nbestFile, "%s\t%lu\t%f\t", lattice.tag(),
+                    (unsigned long)k + 1, nbestScores[k]);
+            for (size_t i = 0; i < nbestPaths[k].size(); ++i) {
+                if (i > 0) fputc(' ', nbestFile);
+                fputs(_lm.vocab()[nbestPaths[k][i]], nbestFile);
+            }
+            fputc('\n', nbestFile);
+        }
+    }
+}
+
 double
 WordErrorRateOptimizer::ComputeWER(const ParamVector &params) {
     // Estimate model.
     if (!_lm.Estimate(params, _mask))
         return 100;  // Out of bounds.
 
+    // Evaluate lattices in parallel.  Sum errors in lattice order.
+    _UpdateLatticeWeights(_UpdateSlotLogs());
+    vector<int> wers(_lattices.size());
+    _ForEachLattice([&](size_t l, Lattice::Scratch &scratch) {
+        wers[l] = _GetLattice(l).ComputeWER(scratch);
+    });
+
     size_t numErrors = 0;
     size_t totWords  = 0;
     for (size_t l = 0; l < _lattices.size(); ++l) {
-        _lattices[l]->UpdateWeights();
-        int wer = _lattices[l]->ComputeWER();
+        int wer = wers[l];
         if (Logger::GetVerbosity() > 2) {
             Logger::Log(3, "Lattice %lu: (%lu / %lu)\n", 
                         l, wer, _lattices[l]->refWords().length());
@@ -174,12 +248,13 @@ WordErrorRateOptimizer::ComputeWER(const ParamVector &params) {
 }
 
 double
-WordErrorRateOptimizer::ComputeOracleWER() const {
+WordErrorRateOptimizer::ComputeOracleWER() {
     size_t numErrors = 0;
     size_t totWords  = 0;
     for (size_t l = 0; l < _lattices.size(); ++l) {
-        numErrors += _lattices[l]->oracleWER();
-        totWords  += _lattices[l]->refWords().length();
+        const Lattice &lattice = _GetLattice(l);
+        numErrors += lattice.oracleWER();
+        totWords  += lattice.refWords().length();
     }
     return (double)numErrors / totWords * 100;
 }
@@ -190,11 +265,16 @@ WordErrorRateOptimizer::ComputeMargin(const ParamVector &params) {
     if (!_lm.Estimate(params, _mask))
         return _worstMargin - 10;  // Out of bounds.
 
+    // Evaluate lattices in parallel.  Sum margins in lattice order.
+    _UpdateLatticeWeights(_UpdateSlotLogs());
+    vector<float> margins(_lattices.size());
+    _ForEachLattice([&](size_t l, Lattice::Scratch &scratch) {
+        margins[l] = _GetLattice(l).ComputeMargin(scratch);
+    });
+
     double totMargin = 0;
-    for (size_t l = 0; l < _lattices.size(); ++l) {
-        _lattices[l]->UpdateWeights();
-        totMargin += _lattices[l]->ComputeMargin();
-    }
+    for (size_t l = 0; l < _lattices.size(); ++l)
+        totMargin += margins[l];
 
     totMargin /= _lattices.size();
     if (Logger::GetVerbosity() > 2)
@@ -206,6 +286,424 @@ WordErrorRateOptimizer::ComputeMargin(const ParamVector &params) {
     return totMargin;
 }
 
+// Prune arcs with posterior probability below _pruneThreshold under the
+// current LM from each lattice, and report the change in WER and margin.
+// Archived lattices are materialized to be pruned, and their entries are
+// mapped back to the archive slots.
+void
+WordErrorRateOptimizer::_PruneLattices() {
+    vector<size_t> numArcs(_lattices.size()), numPruned(_lattices.size());
+    vector<int>    oldWERs(_lattices.size()), newWERs(_lattices.size());
+    vector<float>  oldMargins(_lattices.size()), newMargins(_lattices.size());
+    _ForEachLattice([&](size_t l, Lattice::Scratch &scratch) {
+        Lattice &lattice = _GetLattice(l);
+        numArcs[l]    = lattice.arcWeights().length();
+        oldWERs[l]    = lattice.ComputeWER(scratch);
+        oldMargins[l] = lattice.ComputeMargin(scratch);
+        numPruned[l]  = lattice.Prune(_pruneThreshold);
+        if (_pArchive && numPruned[l] > 0)
+            _AssignLatticeSlots(lattice);
+        newWERs[l]    = lattice.ComputeWER(scratch);
+        newMargins[l] = lattice.ComputeMargin(scratch);
+    });
+
+    size_t totArcs = 0, totPruned = 0, totWords = 0;
+    size_t oldErrors = 0, newErrors = 0;
+    double oldMargin = 0, newMargin = 0;
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        totArcs   += numArcs[l];
+        totPruned += numPruned[l];
+        totWords  += _lattices[l]->refWords().length();
+        oldErrors += oldWERs[l];
+        newErrors += newWERs[l];
+        oldMargin += oldMargins[l];
+        newMargin += newMargins[l];
+    }
+    Logger::Log(1, "Pruned %lu of %lu lattice arcs below posterior %g.\n",
+                (unsigned long)totPruned, (unsigned long)totArcs,
+                _pruneThreshold);
+    if (_lattices.size() > 0)
+        Logger::Log(1, "WER %.2f%% -> %.2f%%, margin %f -> %f\n",
+                    (double)oldErrors / totWords * 100,
+                    (double)newErrors / totWords * 100,
+                    oldMargin / _lattices.size(), newMargin / _lattices.size());
+}
+
+// Map the lattice archive written by SaveLattices.  Lattices are
+// materialized on first use by _GetLattice.
+void
+WordErrorRateOptimizer::_LoadLatticeArchive(const char *filename) {
+    _pArchive = new MappedFile(filename);
+    char       *p   = _pArchive->data();
+    const char *end = p + _pArchive->size();
+    if (_pArchive->size() < 2 * sizeof(uint64_t) ||
+        MapUInt64(p, end) != MITLMv2)
+        throw std::runtime_error("Invalid file format.");
+    MapHeader(p, end, "LatticeArchive");
+    size_t numLattices = MapUInt64(p, end);
+    size_t numSlots    = MapUInt64(p, end);
+    const WeightSlot *slots = reinterpret_cast<const WeightSlot *>(
+        MapBytes(p, end, numSlots * sizeof(WeightSlot)));
+    _slots.assign(slots, slots + numSlots);
+
+    char *q = _pArchive->data() + *reinterpret_cast<const uint64_t *>(
+        end - sizeof(uint64_t));
+    if (q < p || q > end)
+        throw std::runtime_error("Invalid file format.");
+    MapVector(q, end, _latticeOffsets);
+    if (_latticeOffsets.length() != numLattices)
+        throw std::runtime_error("Invalid file format.");
+
+    for (size_t l = 0; l < _lattices.size(); ++l)
+        delete _lattices[l];
+    _lattices.assign(numLattices, NULL);
+    _arena = LatticeArena();
+
+    // Compute prob/bow masks from the slots.
+    vector<BitVector> probMaskVectors(_order + 1);
+    vector<BitVector> bowMaskVectors(_order);
+    for (size_t o = 0; o <= _order; o++)
+        probMaskVectors[o].reset(_lm.sizes(o), false);
+    for (size_t o = 0; o < _order; o++)
+        bowMaskVectors[o].reset(_lm.sizes(o), false);
+    for (size_t s = 0; s < _slots.size(); ++s) {
+        const WeightSlot &slot = _slots[s];
+        if (slot.order > (slot.isBow ? _order - 1 : _order) ||
+            (size_t)slot.ngramIndex >= _lm.sizes(slot.order))
+            throw std::runtime_error("Lattices do not match LM.");
+        if (slot.isBow)
+            bowMaskVectors[slot.order][slot.ngramIndex] = true;
+        else
+            probMaskVectors[slot.order][slot.ngramIndex] = true;
+    }
+    _mask = _lm.GetMask(probMaskVectors, bowMaskVectors);
+    _slotLogs.reset(_slots.size(), std::numeric_limits<double>::quiet_NaN());
+    _changedSlots.reset(_slots.size(), true);
+    _UpdateSlotLogs();
+}
+
+// Return lattice l, mapping it from the archive if not yet loaded.  Weights
+// of mapped lattices are computed from the slot log probabilities of the
+// last update, so that later updates apply to them as to loaded lattices.
+Lattice &
+WordErrorRateOptimizer::_GetLattice(size_t l) {
+    if (_lattices[l] == NULL) {
+        char       *p   = _pArchive->data() + _latticeOffsets[l];
+        const char *end = _pArchive->data() + _pArchive->size();
+        if (p > end)
+            throw std::runtime_error("Invalid file format.");
+        Lattice *pLattice = new Lattice(_lm);
+        pLattice->SetFastLogAdd(_fastLogAdd);
+        try {
+            pLattice->DeserializeMapped(p, end);
+            for (size_t i = 0; i < pLattice->_arcProbSlots.length(); ++i)
+                if (pLattice->_arcProbSlots[i] >= _slots.size())
+                    throw std::runtime_error("Invalid lattice format.");
+            for (size_t i = 0; i < pLattice->_arcBowSlots.length(); ++i)
+                if (pLattice->_arcBowSlots[i] >= _slots.size())
+                    throw std::runtime_error("Invalid lattice format.");
+            pLattice->UpdateWeights(_slotLogs, _changedSlots);
+        } catch (...) {
+            delete pLattice;
+            throw;
+        }
+        _lattices[l] = pLattice;
+    }
+    return *_lattices[l];
+}
+
+// Assign a slot to each unique n-gram prob/bow referenced by the lattices,
+// so that its log probability is computed once per update rather than once
+// per arc.  Slots are ordered by order and n-gram index.
+void
+WordErrorRateOptimizer::_AssignWeightSlots(
+    const vector<BitVector> &probMaskVectors,
+    const vector<BitVector> &bowMaskVectors) {
+    vector<vector<NgramIndex> > probSlots(probMaskVectors.size());
+    vector<vector<NgramIndex> > bowSlots(bowMaskVectors.size());
+    _slots.clear();
+    for (size_t o = 0; o < probMaskVectors.size(); ++o) {
+        probSlots[o].resize(probMaskVectors[o].length(), (NgramIndex)-1);
+        for (size_t i = 0; i < probMaskVectors[o].length(); ++i) {
+            if (probMaskVectors[o][i]) {
+                probSlots[o][i] = _slots.size();
+                _slots.push_back(WeightSlot(o, false, i));
+            }
+        }
+    }
+    for (size_t o = 0; o < bowMaskVectors.size(); ++o) {
+        bowSlots[o].resize(bowMaskVectors[o].length(), (NgramIndex)-1);
+        for (size_t i = 0; i < bowMaskVectors[o].length(); ++i) {
+            if (bowMaskVectors[o][i]) {
+                bowSlots[o][i] = _slots.size();
+                _slots.push_back(WeightSlot(o, true, i));
+            }
+        }
+    }
+    _slotLogs.reset(_slots.size(), std::numeric_limits<double>::quiet_NaN());
+    _changedSlots.reset(_slots.size(), true);
+
+    // Map lattice entries to slots.  Lattices without exactly one prob entry
+    // per arc, in arc order, are left unassigned and fully updated instead.
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        Lattice &lattice = *_lattices[l];
+        const Lattice::ArcNgramIndexVector &arcProbs(lattice._arcProbs);
+        const Lattice::ArcNgramIndexVector &arcBows(lattice._arcBows);
+        bool valid = (arcProbs.length() == lattice._arcWeights.length());
+        for (size_t i = 0; valid && i < arcProbs.length(); ++i)
+            valid = (arcProbs[i].arcIndex == i);
+        if (!valid) {
+            lattice._arcProbSlots.reset(0);
+            lattice._arcBowSlots.reset(0);
+            continue;
+        }
+        lattice._arcProbSlots.reset(arcProbs.length());
+        for (size_t i = 0; i < arcProbs.length(); ++i)
+            lattice._arcProbSlots[i] =
+                probSlots[arcProbs[i].order][arcProbs[i].ngramIndex];
+        lattice._arcBowSlots.reset(arcBows.length());
+        for (size_t i = 0; i < arcBows.length(); ++i)
+            lattice._arcBowSlots[i] =
+                bowSlots[arcBows[i].order][arcBows[i].ngramIndex];
+    }
+}
+
+// Map the prob and bow entries of a lattice rebuilt by pruning to the
+// existing slots.  If an entry has no slot, the lattice is left unassigned
+// and fully updated instead.
+void
+WordErrorRateOptimizer::_AssignLatticeSlots(Lattice &lattice) {
+    auto findSlot = [&](bool isBow, const Lattice::ArcNgramIndex &e) {
+        WeightSlot key(e.order, isBow, e.ngramIndex);
+        vector<WeightSlot>::const_iterator it = std::lower_bound(
+            _slots.begin(), _slots.end(), key,
+            [](const WeightSlot &a, const WeightSlot &b) {
+                if (a.isBow != b.isBow) return a.isBow < b.isBow;
+                if (a.order != b.order) return a.order < b.order;
+                return a.ngramIndex < b.ngramIndex;
+            });
+        if (it == _slots.end() || it->isBow != key.isBow ||
+            it->order != key.order || it->ngramIndex != key.ngramIndex)
+            return (uint)-1;
+        return (uint)(it - _slots.begin());
+    };
+
+    const Lattice::ArcNgramIndexVector &arcProbs(lattice._arcProbs);
+    const Lattice::ArcNgramIndexVector &arcBows(lattice._arcBows);
+    bool valid = (arcProbs.length() == lattice._arcWeights.length());
+    UIntVector probSlots(valid ? arcProbs.length() : 0);
+    UIntVector bowSlots(valid ? arcBows.length() : 0);
+    for (size_t i = 0; valid && i < arcProbs.length(); ++i) {
+        probSlots[i] = findSlot(false, arcProbs[i]);
+        valid = (arcProbs[i].arcIndex == i && probSlots[i] != (uint)-1);
+    }
+    for (size_t i = 0; valid && i < arcBows.length(); ++i) {
+        bowSlots[i] = findSlot(true, arcBows[i]);
+        valid = (bowSlots[i] != (uint)-1);
+    }
+    if (!valid) {
+        probSlots.reset(0);
+        bowSlots.reset(0);
+    }
+    lattice._arcProbSlots.swap(probSlots);
+    lattice._arcBowSlots.swap(bowSlots);
+}
+
+// Recompute the log probability of each slot from the current LM, marking
+// the slots that changed.  Return the number of slots that changed.
+size_t
+WordErrorRateOptimizer::_UpdateSlotLogs() {
+    const size_t   kMinChunkSize = 1 << 14;
+    size_t         numChunks = ThreadPool::NumChunks(_slots.size(),
+                                                     kMinChunkSize);
+    vector<size_t> chunkChanged(numChunks, 0);
+    ThreadPool::Run(numChunks, [&](size_t c) {
+        size_t begin = _slots.size() * c / numChunks;
+        size_t end   = _slots.size() * (c + 1) / numChunks;
+        for (size_t s = begin; s < end; ++s) {
+            const WeightSlot &slot = _slots[s];
+            double logProb = std::log(slot.isBow ?
+                                      _lm.bows(slot.order)[slot.ngramIndex] :
+                                      _lm.probs(slot.order)[slot.ngramIndex]);
+            bool changed = !(logProb == _slotLogs[s]);  // Unset slots are NaN.
+            _changedSlots[s] = changed;
+            _slotLogs[s]     = logProb;
+            chunkChanged[c] += changed;
+        }
+    });
+    size_t numChanged = 0;
+    for (size_t c = 0; c < numChunks; ++c)
+        numChanged += chunkChanged[c];
+    return numChanged;
+}
+
+// Copy the member vector of each lattice into packed, and replace it with a
+// view of the copy.  The lattices may already view the old packed vector.
+template <typename T>
+static void
+PackLatticeVectors(vector<Lattice *> &lattices,
+                   DenseVector<T> Lattice::*member, DenseVector<T> &packed) {
+    size_t length = 0;
+    for (size_t l = 0; l < lattices.size(); ++l)
+        length += (lattices[l]->*member).length();
+    DenseVector<T> newPacked(length);
+    T *p = newPacked.data();
+    for (size_t l = 0; l < lattices.size(); ++l) {
+        DenseVector<T> &v = lattices[l]->*member;
+        std::copy(v.begin(), v.end(), p);
+        v.attach(p, v.length());
+        p += v.length();
+    }
+    packed.swap(newPacked);
+}
+
+// Pack the arc data of the loaded lattices into _arena, and index the arcs
+// weighted by each slot, so that weights are updated over all lattices at
+// once.  The index is left empty unless every lattice has weight slots with
+// its bows in arc order.
+void
+WordErrorRateOptimizer::_PackLattices() {
+    PackLatticeVectors(_lattices, &Lattice::_arcStarts, _arena.arcStarts);
+    PackLatticeVectors(_lattices, &Lattice::_arcEnds, _arena.arcEnds);
+    PackLatticeVectors(_lattices, &Lattice::_arcWords, _arena.arcWords);
+    PackLatticeVectors(_lattices, &Lattice::_arcBaseWeights,
+                       _arena.arcBaseWeights);
+    PackLatticeVectors(_lattices, &Lattice::_arcWeights, _arena.arcWeights);
+    PackLatticeVectors(_lattices, &Lattice::_nodeArcs, _arena.nodeArcs);
+    PackLatticeVectors(_lattices, &Lattice::_ref, _arena.ref);
+    PackLatticeVectors(_lattices, &Lattice::_oraclePath, _arena.oraclePath);
+    PackLatticeVectors(_lattices, &Lattice::_arcProbs, _arena.arcProbs);
+    PackLatticeVectors(_lattices, &Lattice::_arcBows, _arena.arcBows);
+    PackLatticeVectors(_lattices, &Lattice::_arcProbSlots,
+                       _arena.arcProbSlots);
+    PackLatticeVectors(_lattices, &Lattice::_arcBowSlots, _arena.arcBowSlots);
+    for (size_t l = 0; l < _lattices.size(); ++l)
+        _lattices[l]->_packed = true;  // Views must not be reallocated.
+
+    size_t numArcs = _arena.arcWeights.length();
+    _arena.latticeArcs.reset(_lattices.size() + 1);
+    _arena.arcBowOffsets.reset(0);
+    _arena.slotArcOffsets.reset(0);
+    _arena.slotArcs.reset(0);
+    size_t arc = 0;
+    bool   indexed = (_arena.arcProbSlots.length() == numArcs);
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        const Lattice &lattice = *_lattices[l];
+        _arena.latticeArcs[l] = arc;
+        arc += lattice._arcWeights.length();
+        if (lattice._arcProbSlots.length() != lattice._arcWeights.length())
+            indexed = false;
+        for (size_t j = 1; indexed && j < lattice._arcBows.length(); ++j)
+            indexed = (lattice._arcBows[j - 1].arcIndex <=
+                       lattice._arcBows[j].arcIndex);
+    }
+    _arena.latticeArcs[_lattices.size()] = arc;
+    if (!indexed)
+        return;
+
+    // Map bow entries to arcs.
+    _arena.arcBowOffsets.reset(numArcs + 1, 0);
+    for (size_t l = 0; l < _lattices.size(); ++l) {
+        const Lattice::ArcNgramIndexVector &arcBows(_lattices[l]->_arcBows);
+        for (size_t i = 0; i < arcBows.length(); ++i)
+            _arena.arcBowOffsets[_arena.latticeArcs[l] +
+                                 arcBows[i].arcIndex + 1]++;
+    }
+    for (size_t a = 0; a < numArcs; ++a)
+        _arena.arcBowOffsets[a + 1] += _arena.arcBowOffsets[a];
+
+    // Build the slot to arcs index.
+    _arena.slotArcOffsets.reset(_slots.size() + 1, 0);
+    for (size_t a = 0; a < numArcs; ++a)
+        _arena.slotArcOffsets[_arena.arcProbSlots[a] + 1]++;
+    for (size_t j = 0; j < _arena.arcBowSlots.length(); ++j)
+        _arena.slotArcOffsets[_arena.arcBowSlots[j] + 1]++;
+    for (size_t s = 0; s < _slots.size(); ++s)
+        _arena.slotArcOffsets[s + 1] += _arena.slotArcOffsets[s];
+    _arena.slotArcs.reset(_arena.slotArcOffsets[_slots.size()]);
+    UIntVector next(_slots.size());
+    std::copy(_arena.slotArcOffsets.begin(), _arena.slotArcOffsets.end() - 1,
+              next.begin());
+    for (size_t a = 0; a < numArcs; ++a) {
+        _arena.slotArcs[next[_arena.arcProbSlots[a]]++] = a;
+        for (size_t j = _arena.arcBowOffsets[a];
+             j < _arena.arcBowOffsets[a + 1]; ++j)
+            _arena.slotArcs[next[_arena.arcBowSlots[j]]++] = a;
+    }
+}
+
+// Update the arc weights of the lattices for the changed slots.  Packed
+// lattices are updated as one batch.  If few slots changed, only the arcs
+// they weight are recomputed.  Arcs are computed in the same order as
+// Lattice::UpdateWeights(), so the results are identical.
+void
+WordErrorRateOptimizer::_UpdateLatticeWeights(size_t numChangedSlots) {
+    if (numChangedSlots == 0)
+        return;
+    if (_arena.slotArcOffsets.length() == 0) {
+        _ForEachLattice([&](size_t l, Lattice::Scratch &) {
+            if (_lattices[l] != NULL)
+                _lattices[l]->UpdateWeights(_slotLogs, _changedSlots);
+        });
+        return;
+    }
+
+    const UIntVector  &probSlots(_arena.arcProbSlots);
+    const UIntVector  &bowSlots(_arena.arcBowSlots);
+    const UIntVector  &bowOffsets(_arena.arcBowOffsets);
+    const FloatVector &baseWeights(_arena.arcBaseWeights);
+    FloatVector       &weights(_arena.arcWeights);
+    size_t             numArcs = weights.length();
+    size_t             numEntries = _arena.slotArcs.length();
+    if (numChangedSlots * (numEntries / _slots.size()) < numArcs / 8) {
+        for (size_t s = 0; s < _slots.size(); ++s) {
+            if (!_changedSlots[s]) continue;
+            for (size_t i = _arena.slotArcOffsets[s];
+                 i < _arena.slotArcOffsets[s + 1]; ++i) {
+                uint  a = _arena.slotArcs[i];
+                float weight = baseWeights[a] - _slotLogs[probSlots[a]];
+                for (size_t j = bowOffsets[a]; j < bowOffsets[a + 1]; ++j)
+                    weight -= _slotLogs[bowSlots[j]];
+                weights[a] = weight;
+            }
+        }
+        return;
+    }
+
+    const size_t kMinChunkSize = 1 << 14;
+    size_t numChunks = ThreadPool::NumChunks(numArcs, kMinChunkSize);
+    ThreadPool::Run(numChunks, [&](size_t c) {
+        size_t begin = numArcs * c / numChunks;
+        size_t end   = numArcs * (c + 1) / numChunks;
+        for (size_t a = begin; a < end; ++a) {
+            bool changed = _changedSlots[probSlots[a]];
+            for (size_t j = bowOffsets[a]; j < bowOffsets[a + 1]; ++j)
+                changed |= _changedSlots[bowSlots[j]];
+            if (changed) {
+                float weight = baseWeights[a] - _slotLogs[probSlots[a]];
+                for (size_t j = bowOffsets[a]; j < bowOffsets[a + 1]; ++j)
+                    weight -= _slotLogs[bowSlots[j]];
+                weights[a] = weight;
+            }
+        }
+    });
+}
+
+// Calls func(l, scratch) for each lattice l, distributing contiguous ranges
+// of lattices across the ThreadPool.  Each range uses its own scratch buffers.
+void
+WordErrorRateOptimizer::_ForEachLattice(const LatticeFunc &func) {
+    const size_t kMinChunkSize = 16;
+    size_t numChunks = ThreadPool::NumChunks(_lattices.size(), kMinChunkSize);
+    ThreadPool::Run(numChunks, [this, &func, numChunks](size_t c) {
+        Lattice::Scratch scratch;
+        size_t begin = _lattices.size() * c / numChunks;
+        size_t end   = _lattices.size() * (c + 1) / numChunks;
+        for (size_t l = begin; l < end; ++l)
+            func(l, scratch);
+    });
+}
+
 double
 WordErrorRateOptimizer::OptimizeMargin(ParamVector &params,
                                        Optimization technique) {
@@ -35,8 +35,10 @@
 #ifndef WORDERRORRATEOPTIMIZER_H
 #define WORDERRORRATEOPTIMIZER_H
 
+#include <functional>
 #include <vector>
 #include "optimize/Optimization.h"
+#include "util/MappedFile.h"
 #include "Types.h"
 #include "NgramLM.h"
 #include "Mask.h"
@@ -50,12 +52,56 @@ namespace mitlm {
 
 class WordErrorRateOptimizer {
 protected:
+    typedef std::function<void (size_t, Lattice::Scratch &)> LatticeFunc;
+
+    // N-gram prob or bow referenced by the lattices.
+    struct WeightSlot {
+        WeightSlot(size_t o, bool b, NgramIndex i)
+            : order(o), isBow(b), ngramIndex(i) { }
+        uint       order : 31;
+        uint       isBow : 1;
+        NgramIndex ngramIndex;
+    };
+
+    // Arc data of all loaded lattices, packed into contiguous arrays that
+    // the lattices view.  The arcs of lattice l are numbered from
+    // latticeArcs[l].  If every lattice has weight slots, arcBowOffsets holds
+    // the first arcBowSlots entry of each arc, and slotArcs lists the arcs
+    // weighted by slot s from slotArcOffsets[s].
+    struct LatticeArena {
+        NodeVector                   arcStarts;
+        NodeVector                   arcEnds;
+        VocabVector                  arcWords;
+        FloatVector                  arcBaseWeights;
+        FloatVector                  arcWeights;
+        UIntVector                   nodeArcs;
+        VocabVector                  ref;
+        UIntVector                   oraclePath;
+        Lattice::ArcNgramIndexVector arcProbs;
+        Lattice::ArcNgramIndexVector arcBows;
+        UIntVector                   arcProbSlots;
+        UIntVector                   arcBowSlots;
+        UIntVector                   latticeArcs;
+        UIntVector                   arcBowOffsets;
+        UIntVector                   slotArcOffsets;
+        UIntVector                   slotArcs;
+    };
+
     NgramLMBase &       _lm;
     size_t              _order;
     vector<Lattice *>   _lattices;
     size_t              _numCalls;
     double              _worstMargin;
+    float               _pruneThreshold;  // Min arc posterior, if positive
+    bool                _expandHistories; // Split nodes by n-gram history
+    bool                _fastLogAdd;      // Approximate lattice posteriors
     SharedPtr<Mask>     _mask;
+    vector<WeightSlot>  _slots;         // Unique n-grams in lattices
+    DoubleVector        _slotLogs;      // Log probability of each slot
+    BitVector           _changedSlots;  // Slots changed by last update
+    LatticeArena        _arena;         // Packed arcs of loaded lattices
+    SharedPtr<MappedFile> _pArchive;    // Mapped compiled lattices, if any
+    DenseVector<uint64_t> _latticeOffsets;  // Offset of each archived lattice
 
     class ComputeMarginFunc {
         WordErrorRateOptimizer &_obj;
@@ -75,22 +121,41 @@ protected:
 
 public:
     WordErrorRateOptimizer(NgramLMBase &lm, size_t order=3)
-        : _lm(lm), _order(order), _worstMargin(-100) { }
+        : _lm(lm), _order(order), _worstMargin(-100), _pruneThreshold(0),
+          _expandHistories(false), _fastLogAdd(false) { }
     ~WordErrorRateOptimizer();
 
     void   SetOrder(size_t order) { _order = order; }
+    void   SetPruneThreshold(float minPosterior)
+    { _pruneThreshold = minPosterior; }
+    void   SetExpandHistories(bool expand) { _expandHistories = expand; }
+    void   SetFastLogAdd(bool fast) { _fastLogAdd = fast; }
     void   LoadLattices(ZFile &latticesFile);
     void   SaveLattices(ZFile &latticesFile);
     void   SaveTranscript(ZFile &transcriptFile);
     void   SaveUttConfidence(ZFile &confidenceFile);
     void   SaveWER(ZFile &werFile);
+    void   SaveWERDetails(ZFile &werFile);
+    void   SaveNBest(ZFile &nbestFile, size_t n);
     double ComputeMargin(const ParamVector &params);
     double ComputeWER(const ParamVector &params);
-    double ComputeOracleWER() const;
+    double ComputeOracleWER();
     double OptimizeMargin(ParamVector &params,
                           Optimization technique=PowellOptimization);
     double OptimizeWER(ParamVector &params,
                        Optimization technique=PowellOptimization);
+
+protected:
+    void   _LoadLatticeArchive(const char *filename);
+    void   _PruneLattices();
+    Lattice &_GetLattice(size_t l);
+    void   _AssignWeightSlots(const vector<BitVector> &probMaskVectors,
+                              const vector<BitVector> &bowMaskVectors);
+    void   _AssignLatticeSlots(Lattice &lattice);
+    void   _PackLattices();
+    size_t _UpdateSlotLogs();
+    void   _UpdateLatticeWeights(size_t numChangedSlots);
+    void   _ForEachLattice(const LatticeFunc &func);
 };
 
 }
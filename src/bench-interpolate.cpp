@@ -0,0 +1,222 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// Copyright (c) 2010-2013, Giulio Paci <giuliopaci@gmail.com>            //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <chrono>
+#include "util/CommandOptions.h"
+#include "util/Logger.h"
+#include "util/ThreadPool.h"
+#include "Types.h"
+#include "NgramLM.h"
+#include "InterpolatedNgramLM.h"
+
+#ifdef F77_DUMMY_MAIN
+#  ifdef __cplusplus
+extern "C"
+#  endif
+int F77_DUMMY_MAIN () { return 1; }
+#endif
+
+using std::vector;
+using std::string;
+using namespace mitlm;
+
+////////////////////////////////////////////////////////////////////////////////
+
+const char *headerDesc =
+"Usage: bench-interpolate [Options]\n"
+"\n"
+"Times the generalized linear interpolation of the n-gram models trained from\n"
+"the -text files, with synthetic history features, against a reference that\n"
+"computes the weights of each history from history-major double features\n"
+"with std::exp.\n";
+
+const char *footerDesc = "";
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Exposes the interpolation kernels, and interpolates into refProbs the way
+// they did before the feature matrix was tiled.
+class BenchInterpolatedNgramLM : public InterpolatedNgramLM {
+public:
+    vector<DoubleVector> features;  // [o][h * _numFeatures + k]
+    vector<ProbVector>   refProbs;
+
+    BenchInterpolatedNgramLM(size_t order) : InterpolatedNgramLM(order) { }
+    using InterpolatedNgramLM::_EstimateProbs;
+
+    void EstimateReference(const ParamVector &params) {
+        const Param *pBiasParams = &params[0];
+        const Param *pFeatParams = &params[(_lms.size() - 1) * order()];
+        vector<Param> biases(_lms.size());
+        vector<Param> flatParams(_numFeatures);
+        vector<Param> weights(_lms.size());
+        vector<const Prob *> lmProbs(_lms.size());
+        refProbs.resize(_order + 1);
+        for (size_t o = 1; o <= _order; o++) {
+            ProbVector &       probs(refProbs[o]);
+            const IndexVector &hists(this->hists(o));
+            _UnpackOrderParams(params, pBiasParams, pFeatParams,
+                               biases, flatParams);
+            probs.reset(sizes(o));
+            for (size_t l = 0; l < _lms.size(); l++)
+                lmProbs[l] = _lms[l]->probs(o).begin();
+            for (size_t i = 0; i < probs.length();) {
+                NgramIndex    h = hists[i];
+                const double *f = &features[o - 1][h * _numFeatures];
+                Param totWeight = 0;
+                size_t k = 0;
+                for (size_t l = 0; l < _lms.size(); l++) {
+                    Param weight = biases[l];
+                    for (size_t j = 0; j < _lmNumFeatures[l]; j++, k++)
+                        if (flatParams[k] != 0)
+                            weight += f[k] * flatParams[k];
+                    weights[l] = std::exp(weight);
+                    totWeight += weights[l];
+                }
+                for (; i < probs.length() && hists[i] == h; ++i) {
+                    Prob prob = 0;
+                    for (size_t l = 0; l < _lms.size(); l++)
+                        prob += lmProbs[l][i] * weights[l];
+                    probs[i] = prob / totWeight;
+                }
+            }
+        }
+    }
+};
+
+// Returns the best of repeats timings of f in milliseconds.
+template <class F>
+double Time(size_t repeats, F f) {
+    double best = 1e30;
+    for (size_t r = 0; r < repeats; r++) {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    CommandOptions opts(headerDesc, footerDesc);
+    opts.AddOption("h,help", "Print this message.");
+    opts.AddOption("verbose", "Set verbosity level.", "0", "int");
+    opts.AddOption("o,order", "Set the n-gram order of the estimated LMs.", "3", "int");
+    opts.AddOption("t,text", "Interpolate models trained from text files.", NULL, "files");
+    opts.AddOption("s,smoothing", "Specify smoothing algorithm.", "FixModKN", "ML, FixKN, FixModKN, FixKN#, KN, ModKN, KN#");
+    opts.AddOption("f,features", "Set the number of features of each LM.", "2", "int");
+    opts.AddOption("r,repeats", "Report the best of the specified number of runs.", "20", "int");
+    if (!opts.ParseArguments(argc, (const char **)argv) ||
+        opts["help"] != NULL || !opts["text"]) {
+        std::cout << std::endl;
+        opts.PrintHelp();
+        return 1;
+    }
+    size_t order = atoi(opts["order"]);
+    size_t numFeatures = atoi(opts["features"]);
+    size_t repeats = atoi(opts["repeats"]);
+    Logger::SetVerbosity(atoi(opts["verbose"]));
+    ThreadPool::SetNumThreads(1);
+
+    vector<string> corpusFiles;
+    trim_split(corpusFiles, opts["text"], ',');
+    vector<SharedPtr<NgramLMBase> > lms(corpusFiles.size());
+    for (size_t l = 0; l < lms.size(); l++) {
+        NgramLM *pLM = new NgramLM(order);
+        pLM->Initialize(NULL, false, corpusFiles[l].c_str(), NULL,
+                        opts["smoothing"], NULL);
+        lms[l] = pLM;
+    }
+    BenchInterpolatedNgramLM ilm(order);
+    ilm.LoadLMs(lms);
+    ParamVector lmParams(ilm.defParams());
+    ilm.Estimate(lmParams);
+
+    // Give each history deterministic pseudo-random features in [-1, 1).
+    size_t totFeatures = lms.size() * numFeatures;
+    vector<vector<FeatureVectors> > featureList(lms.size());
+    ilm.features.resize(order);
+    for (size_t o = 0; o < order; o++)
+        ilm.features[o].reset(ilm.sizes(o) * totFeatures);
+    for (size_t l = 0; l < lms.size(); l++) {
+        featureList[l].resize(numFeatures);
+        for (size_t f = 0; f < numFeatures; f++) {
+            size_t k = l * numFeatures + f;
+            featureList[l][f].resize(order);
+            for (size_t o = 0; o < order; o++) {
+                DoubleVector &feature(featureList[l][f][o]);
+                feature.reset(ilm.sizes(o));
+                for (size_t i = 0; i < feature.length(); i++) {
+                    uint32_t x = (uint32_t)((i + 1) * 2654435761u) ^
+                                 (uint32_t)(k * 40503u + o);
+                    feature[i] = (x % 2048) / 1024.0 - 1;
+                    ilm.features[o][i * totFeatures + k] =
+                        (float)feature[i];
+                }
+            }
+        }
+    }
+    ilm.SetInterpolation(GeneralizedLinearInterpolation, featureList);
+
+    ParamVector params(ilm.defParams());
+    for (size_t i = ilm.biasParamStart(); i < params.length(); i++)
+        params[i] = 0.1 * ((int)(i % 7) - 3);
+    ParamVector mixParams(params[Range(ilm.biasParamStart(),
+                                       params.length())]);
+    double refTime = Time(repeats, [&] { ilm.EstimateReference(mixParams); });
+    double newTime = Time(repeats, [&] { ilm._EstimateProbs(mixParams); });
+
+    double maxError = 0;
+    size_t numNgrams = 0;
+    for (size_t o = 1; o <= order; o++) {
+        numNgrams += ilm.sizes(o);
+        for (size_t i = 0; i < ilm.sizes(o); i++)
+            maxError = std::max(maxError, std::fabs(
+                ilm.probs(o)[i] / ilm.refProbs[o][i] - 1));
+    }
+    printf("%lu n-grams, %lu LMs, %lu features/LM\n",
+           (unsigned long)numNgrams, (unsigned long)lms.size(),
+           (unsigned long)numFeatures);
+    printf("reference\t%.3f ms\n", refTime);
+    printf("tiled\t%.3f ms\t%.2fx\n", newTime, refTime / newTime);
+    printf("max relative difference\t%.3g\n", maxError);
+    return 0;
+}
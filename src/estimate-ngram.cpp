@@ -38,6 +38,7 @@
 #include "util/CommandOptions.h"
 #include "util/ZFile.h"
 #include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "Types.h"
 #include "NgramLM.h"
 #include "Smoothing.h"
@@ -93,8 +94,13 @@ int main(int argc, char* argv[]) {
     opts.AddOption("p,params", "Set initial model params.", NULL, "file");
     opts.AddOption("oa,opt-alg", "Specify optimization algorithm.", "Powell", "Powell, LBFGS, LBFGSB");
     opts.AddOption("op,opt-perp", "Tune params to minimize dev set perplexity.", NULL, "file");
+    opts.AddOption("pl,prune-lattices", "[SLS] Prune development lattice arcs with posterior probability below the specified threshold.", NULL, "float");
+    opts.AddOption("xl,expand-lattices", "[SLS] Expand nodes of development lattices reached with different n-gram histories.", "false", "boolean");
+    opts.AddOption("fla,fast-log-add", "[SLS] Sum development lattice scores for -pl with a faster approximate log-add.", "false", "boolean");
     opts.AddOption("ow,opt-wer", "Tune params to minimize lattice word error rate.", NULL, "file");
     opts.AddOption("om,opt-margin", "Tune params to minimize lattice margin.", NULL, "file");
+    opts.AddOption("pr,prune", "Prune n-grams whose removal increases perplexity by less than the specified relative threshold.", NULL, "float");
+    opts.AddOption("ps,prune-size", "Prune the least significant n-grams until at most the specified number of n-grams remain.", NULL, "int");
     opts.AddOption("wb,write-binary", "Write LM/counts files in binary format.", "false", "boolean");
     opts.AddOption("wp,write-params", "Write tuned model params to file.", NULL, "file");
     opts.AddOption("wv,write-vocab", "Write LM vocab to file.", NULL, "file");
@@ -106,6 +112,7 @@ int main(int argc, char* argv[]) {
     opts.AddOption("ep,eval-perp", "Compute test set perplexity.", NULL, "files");
     opts.AddOption("ew,eval-wer", "Compute test set lattice word error rate.", NULL, "files");
     opts.AddOption("em,eval-margin", "Compute test set lattice margin.", NULL, "files");
+    opts.AddOption("threads", "Set number of worker threads (0 = number of cores).", "0", "int");
     if (!opts.ParseArguments(argc, (const char **)argv) ||
         opts["help"] != NULL) {
         std::cout << std::endl;
@@ -117,6 +124,7 @@ int main(int argc, char* argv[]) {
     size_t order = atoi(opts["order"]);
     bool writeBinary = mitlm::AsBoolean(opts["write-binary"]);
     mitlm::Logger::SetVerbosity(atoi(opts["verbose"]));
+    mitlm::ThreadPool::SetNumThreads(atoi(opts["threads"]));
 
     if (!opts["text"] && !opts["counts"]) {
         mitlm::Logger::Error(1, "Specify training data using -text or -counts.\n");
@@ -171,6 +179,13 @@ int main(int argc, char* argv[]) {
                         opts["opt-margin"]);
             mitlm::ZFile devZFile(opts["opt-margin"]);
             mitlm::WordErrorRateOptimizer dev(lm, order);
+            if (opts["prune-lattices"]) {
+                // Prune under the initial parameters.
+                lm.Estimate(params);
+                dev.SetPruneThreshold(atof(opts["prune-lattices"]));
+            }
+            dev.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            dev.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             dev.LoadLattices(devZFile);
 
             mitlm::Logger::Log(1, "Optimizing %lu parameters...\n", params.length());
@@ -186,6 +201,13 @@ int main(int argc, char* argv[]) {
                         opts["opt-wer"]);
             mitlm::ZFile devZFile(opts["opt-wer"]);
             mitlm::WordErrorRateOptimizer dev(lm, order);
+            if (opts["prune-lattices"]) {
+                // Prune under the initial parameters.
+                lm.Estimate(params);
+                dev.SetPruneThreshold(atof(opts["prune-lattices"]));
+            }
+            dev.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            dev.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             dev.LoadLattices(devZFile);
 
             mitlm::Logger::Log(1, "Optimizing %lu parameters...\n", params.length());
@@ -195,7 +217,8 @@ int main(int argc, char* argv[]) {
     }
 
     // Estimate full model.
-    if (opts["write-lm"] || opts["eval-perp"] || 
+    bool prune = opts["prune"] || opts["prune-size"];
+    if (prune || opts["write-lm"] || opts["eval-perp"] || 
         opts["eval-margin"] || opts["eval-wer"]) {
         mitlm::Logger::Log(1, "Estimating full n-gram model...\n");
         lm.Estimate(params);
@@ -248,6 +271,11 @@ int main(int argc, char* argv[]) {
         }
         lm.model().SaveCounts(countVectors, countZFile, true);
     }
+    if (prune) {
+        mitlm::Logger::Log(1, "Pruning LM...\n");
+        lm.Prune(opts["prune"] ? atof(opts["prune"]) : 0,
+                 opts["prune-size"] ? atol(opts["prune-size"]) : 0);
+    }
     if (opts["write-lm"]) {
         mitlm::Logger::Log(1, "Saving LM to %s...\n", opts["write-lm"]);
         mitlm::ZFile lmZFile(opts["write-lm"], "w");
@@ -37,10 +37,12 @@
 #include <cstdio>
 #include "util/CommandOptions.h"
 #include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "util/ZFile.h"
 #include "Types.h"
 #include "Lattice.h"
 #include "PerplexityOptimizer.h"
+#include "SentenceScorer.h"
 #include "WordErrorRateOptimizer.h"
 
 #ifdef F77_DUMMY_MAIN
@@ -85,13 +87,25 @@ int main(int argc, char* argv[]) {
     opts.AddOption("o,order", "Set the n-gram order of the estimated LM.", "3", "int");
     opts.AddOption("v,vocab", "Fix the vocab to only words from the specified file.", NULL, "file");
     opts.AddOption("l,lm", "Load specified LM.", NULL, "file");
+    opts.AddOption("pl,prune-lattices", "[SLS] Prune lattice arcs with posterior probability below the specified threshold.", NULL, "float");
+    opts.AddOption("xl,expand-lattices", "[SLS] Expand lattice nodes reached with different n-gram histories.", "false", "boolean");
+    opts.AddOption("fla,fast-log-add", "[SLS] Sum lattice scores for -pl with a faster approximate log-add.", "false", "boolean");
     opts.AddOption("cl,compile-lattices", "[SLS] Compile lattices into a binary format.", NULL, "file");
     opts.AddOption("wb,write-binary", "Write LM/counts files in binary format.", "false", "boolean");
+    opts.AddOption("qb,quantize-bits", "Quantize LM probabilities and backoff weights to the specified number of bits (1-16).", NULL, "int");
     opts.AddOption("wv,write-vocab", "Write LM vocab to file.", NULL, "file");
     opts.AddOption("wl,write-lm", "Write ARPA backoff LM to file.", NULL, "file");
     opts.AddOption("ep,eval-perp", "Compute test set perplexity.", NULL, "files");
+    opts.AddOption("eq,eval-quantization", "Compute test set perplexity before and after quantization.", NULL, "files");
     opts.AddOption("ew,eval-wer", "Compute test set lattice word error rate.", NULL, "files");
+    opts.AddOption("wwd,write-wer-details", "Write substitutions, deletions, and insertions of each -ew lattice to file.", NULL, "file");
+    opts.AddOption("wnb,write-nbest", "Write the n-best paths of each -ew lattice to file.", NULL, "file");
+    opts.AddOption("nb,nbest-size", "Set the number of paths per lattice written with -wnb.", "100", "int");
     opts.AddOption("em,eval-margin", "Compute test set lattice margin.", NULL, "files");
+    opts.AddOption("es,eval-sentences", "Compute log10 probability of each sentence in files.", NULL, "files");
+    opts.AddOption("esw,eval-sentence-words", "Also output log10 probability of each word with -es.", "false", "boolean");
+    opts.AddOption("ws,write-sentence-scores", "Write sentence log10 probabilities to file.", "-", "file");
+    opts.AddOption("threads", "Set number of worker threads (0 = number of cores).", "0", "int");
     if (!opts.ParseArguments(argc, (const char **)argv) ||
         opts["help"] != NULL) {
         std::cout << std::endl;
@@ -102,11 +116,20 @@ int main(int argc, char* argv[]) {
     // Process basic command line arguments.
     size_t order = atoi(opts["order"]);
     bool writeBinary = mitlm::AsBoolean(opts["write-binary"]);
+    size_t numThreads = atoi(opts["threads"]);
     mitlm::Logger::SetVerbosity(atoi(opts["verbose"]));
+    mitlm::ThreadPool::SetNumThreads(numThreads);
     if (!opts["lm"]) {
         mitlm::Logger::Error(0, "Language model must be specified using -lm.");
         exit(1);
     }
+    if (opts["quantize-bits"]) {
+        int bits = atoi(opts["quantize-bits"]);
+        if (bits < 1 || bits > 16) {
+            mitlm::Logger::Error(0, "Quantization bits must be from 1 to 16.\n");
+            exit(1);
+        }
+    }
 
     // Load language model.
     mitlm::ArpaNgramLM lm(order);
@@ -117,13 +140,57 @@ int main(int argc, char* argv[]) {
     }
     mitlm::Logger::Log(1, "Loading LM %s...\n", opts["lm"]);
     mitlm::ZFile lmZFile(opts["lm"], "r");
-    lm.LoadLM(lmZFile);
+    // Quantized binary LMs used only for sentence scoring need not be decoded.
+    bool scoreOnly = opts["eval-sentences"] && !opts["compile-lattices"] &&
+        !opts["eval-perp"] && !opts["eval-wer"] && !opts["eval-margin"] &&
+        !opts["eval-quantization"] && !opts["quantize-bits"] &&
+        !opts["write-lm"];
+    lm.LoadLM(lmZFile, !scoreOnly);
+
+    // Quantize LM.
+    mitlm::ParamVector params(lm.defParams());
+    if (opts["quantize-bits"]) {
+        size_t bits = atoi(opts["quantize-bits"]);
+        vector<double> perps;
+        vector<string> evalFiles;
+        if (opts["eval-quantization"])
+            mitlm::trim_split(evalFiles, opts["eval-quantization"], ',');
+        vector<mitlm::PerplexityOptimizer *> evals;
+        for (size_t i = 0; i < evalFiles.size(); i++) {
+            mitlm::Logger::Log(1, "Loading eval set %s...\n", evalFiles[i].c_str());
+            mitlm::ZFile evalZFile(evalFiles[i].c_str());
+            evals.push_back(new mitlm::PerplexityOptimizer(lm, order));
+            evals[i]->LoadCorpus(evalZFile);
+            perps.push_back(evals[i]->ComputePerplexity(params));
+        }
+
+        mitlm::Logger::Log(1, "Quantizing LM to %lu bits...\n", bits);
+        lm.Quantize(bits);
+
+        if (!evals.empty())
+            mitlm::Logger::Log(0, "Quantization Evaluations:\n");
+        for (size_t i = 0; i < evals.size(); i++) {
+            double perp = evals[i]->ComputePerplexity(params);
+            mitlm::Logger::Log(0, "\t%s\t%.3f\t%.3f\t%+.3f (%+.2f%%)\n",
+                               evalFiles[i].c_str(), perps[i], perp,
+                               perp - perps[i],
+                               100.0 * (perp - perps[i]) / perps[i]);
+            delete evals[i];
+        }
+    } else if (opts["eval-quantization"]) {
+        mitlm::Logger::Error(0, "Quantization must be specified using -qb.\n");
+        exit(1);
+    }
 
     // Compile lattices.
     if (opts["compile-lattices"]) {
         mitlm::Logger::Log(0, "Compiling lattices %s:\n", opts["compile-lattices"]);
         mitlm::ZFile latticesZFile(opts["compile-lattices"]);
 	mitlm::WordErrorRateOptimizer eval(lm, order);
+        if (opts["prune-lattices"])
+            eval.SetPruneThreshold(atof(opts["prune-lattices"]));
+        eval.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+        eval.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
         eval.LoadLattices(latticesZFile);
         string outFile(opts["compile-lattices"]);
         outFile += ".bin";
@@ -132,7 +199,6 @@ int main(int argc, char* argv[]) {
     }
 
     // Evaluate LM.
-    mitlm::ParamVector params(lm.defParams());
     if (opts["eval-perp"]) {
         mitlm::Logger::Log(0, "Perplexity Evaluations:\n");
         vector<string> evalFiles;
@@ -147,6 +213,23 @@ int main(int argc, char* argv[]) {
                         eval.ComputePerplexity(params));
         }
     }
+    if (opts["eval-sentences"]) {
+        mitlm::Logger::Log(0, "Sentence Evaluations:\n");
+        vector<string> evalFiles;
+        mitlm::trim_split(evalFiles, opts["eval-sentences"], ',');
+        mitlm::ZFile scoresZFile(opts["write-sentence-scores"], "w");
+        mitlm::SentenceScorer scorer(lm, numThreads);
+        scorer.SetWordScores(mitlm::AsBoolean(opts["eval-sentence-words"]));
+        for (size_t i = 0; i < evalFiles.size(); i++) {
+            mitlm::Logger::Log(1, "Scoring sentences %s...\n", evalFiles[i].c_str());
+            mitlm::ZFile evalZFile(evalFiles[i].c_str());
+            scorer.ScoreCorpus(evalZFile, scoresZFile);
+
+            mitlm::Logger::Log(0, "\t%s\t%lu sentences\t%lu OOVs\t%.3f\n",
+                        evalFiles[i].c_str(), scorer.numSentences(),
+                        scorer.numOOV(), scorer.ComputePerplexity());
+        }
+    }
     if (opts["eval-margin"]) {
         mitlm::Logger::Log(0, "Margin Evaluations:\n");
         vector<string> evalFiles;
@@ -156,6 +239,10 @@ int main(int argc, char* argv[]) {
                         evalFiles[i].c_str());
             mitlm::ZFile evalZFile(evalFiles[i].c_str());
 	    mitlm::WordErrorRateOptimizer eval(lm, order);
+            if (opts["prune-lattices"])
+                eval.SetPruneThreshold(atof(opts["prune-lattices"]));
+            eval.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            eval.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             eval.LoadLattices(evalZFile);
 
             mitlm::Logger::Log(0, "\t%s\t%.3f\n", evalFiles[i].c_str(),
@@ -166,15 +253,29 @@ int main(int argc, char* argv[]) {
         mitlm::Logger::Log(0, "WER Evaluations:\n");
         vector<string> evalFiles;
         mitlm::trim_split(evalFiles, opts["eval-wer"], ',');
+        mitlm::SharedPtr<mitlm::ZFile> detailsZFile;
+        if (opts["write-wer-details"])
+            detailsZFile = new mitlm::ZFile(opts["write-wer-details"], "w");
+        mitlm::SharedPtr<mitlm::ZFile> nbestZFile;
+        if (opts["write-nbest"])
+            nbestZFile = new mitlm::ZFile(opts["write-nbest"], "w");
         for (size_t i = 0; i < evalFiles.size(); i++) {
             mitlm::Logger::Log(1, "Loading eval lattices %s...\n",
                         evalFiles[i].c_str());
             mitlm::ZFile evalZFile(evalFiles[i].c_str());
 	    mitlm::WordErrorRateOptimizer eval(lm, order);
+            if (opts["prune-lattices"])
+                eval.SetPruneThreshold(atof(opts["prune-lattices"]));
+            eval.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            eval.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             eval.LoadLattices(evalZFile);
 
             mitlm::Logger::Log(0, "\t%s\t%.2f%%\n", evalFiles[i].c_str(),
                         eval.ComputeWER(params));
+            if (opts["write-wer-details"])
+                eval.SaveWERDetails(*detailsZFile);
+            if (opts["write-nbest"])
+                eval.SaveNBest(*nbestZFile, atoi(opts["nbest-size"]));
         }
     }
 
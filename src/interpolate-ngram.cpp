@@ -35,14 +35,21 @@
 
 #include <vector>
 #include <cstdio>
+#include <condition_variable>
+#include <mutex>
+#include <sys/stat.h>
 #include "util/CommandOptions.h"
 #include "util/ZFile.h"
 #include "util/Logger.h"
+#include "util/ThreadPool.h"
 #include "Types.h"
 #include "Smoothing.h"
 #include "NgramLM.h"
 #include "InterpolatedNgramLM.h"
+#include "LazyInterpolatedNgramLM.h"
 #include "PerplexityOptimizer.h"
+#include "SentenceScorer.h"
+#include "StreamingArpaMixer.h"
 #include "WordErrorRateOptimizer.h"
 
 #ifdef F77_DUMMY_MAIN
@@ -77,6 +84,139 @@ const char *footerDesc_tmpl =
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Read initial model params from file into params, which holds the defaults.
+void LoadParams(const char *paramsFile, mitlm::ParamVector &params) {
+    mitlm::Logger::Log(1, "Loading parameters from %s...\n", paramsFile);
+    mitlm::ZFile f(paramsFile, "r");
+    size_t numParams = params.length();
+    VerifyHeader(f, "Param");
+    ReadVector(f, params);
+    if (params.length() != numParams) {
+        mitlm::Logger::Error(1, "Number of parameters mismatched.\n");
+        exit(1);
+    }
+}
+
+// Score the sentences of the -es files, writing the scores to the -ws file.
+void EvalSentences(const mitlm::NgramLMBase &lm,
+                   mitlm::CommandOptions &opts) {
+    mitlm::Logger::Log(0, "Sentence Evaluations:\n");
+    vector<string> evalFiles;
+    mitlm::trim_split(evalFiles, opts["eval-sentences"], ',');
+    mitlm::ZFile scoresZFile(opts["write-sentence-scores"], "w");
+    mitlm::SentenceScorer scorer(lm, atoi(opts["threads"]));
+    scorer.SetWordScores(mitlm::AsBoolean(opts["eval-sentence-words"]));
+    for (size_t i = 0; i < evalFiles.size(); i++) {
+        mitlm::Logger::Log(1, "Scoring sentences %s...\n", evalFiles[i].c_str());
+        mitlm::ZFile evalZFile(evalFiles[i].c_str());
+        scorer.ScoreCorpus(evalZFile, scoresZFile);
+
+        mitlm::Logger::Log(0, "\t%s\t%lu sentences\t%lu OOVs\t%.3f\n",
+                    evalFiles[i].c_str(), scorer.numSentences(),
+                    scorer.numOOV(), scorer.ComputePerplexity());
+    }
+}
+
+// Compute the perplexity of the -ep files by scoring their sentences.  This
+// only needs ComputeProb(), so it also works for lazily interpolated LMs.
+void EvalPerplexity(const mitlm::NgramLMBase &lm,
+                    mitlm::CommandOptions &opts) {
+    mitlm::Logger::Log(0, "Perplexity Evaluations:\n");
+    vector<string> evalFiles;
+    mitlm::trim_split(evalFiles, opts["eval-perp"], ',');
+    mitlm::SentenceScorer scorer(lm, atoi(opts["threads"]));
+    for (size_t i = 0; i < evalFiles.size(); i++) {
+        mitlm::Logger::Log(1, "Loading eval set %s...\n", evalFiles[i].c_str());
+        mitlm::ZFile evalZFile(evalFiles[i].c_str());
+        scorer.ScoreCorpus(evalZFile);
+        mitlm::Logger::Log(0, "\t%s\t%.3f\n", evalFiles[i].c_str(),
+                    scorer.ComputePerplexity());
+    }
+}
+
+// Returns the estimated peak memory in bytes of building an n-gram LM of the
+// given order from file, or 0 if unknown.  The bytes per byte of uncompressed
+// text of each order are the growth in peak RSS of estimate-ngram -s ModKN
+// from a 1.1 MB to a 5.7 MB text (2K-word vocabulary), rounded up; trigrams
+// take 16.1.  Each order above 6 adds about 8 more.
+static size_t EstimateBuildMemory(const string &file, size_t order) {
+    static const size_t kBytesPerTextByte[] = { 0, 1, 6, 17, 30, 39, 47 };
+    const size_t kMaxMeasuredOrder = 6;
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+        return 0;
+    size_t rate = (order <= kMaxMeasuredOrder) ? kBytesPerTextByte[order] :
+        kBytesPerTextByte[kMaxMeasuredOrder] + 8 * (order - kMaxMeasuredOrder);
+    size_t bytes = (size_t)st.st_size * rate;
+    size_t len = file.length();
+    if ((len > 3 && file.compare(len - 3, 3, ".gz") == 0) ||
+        (len > 4 && file.compare(len - 4, 4, ".bz2") == 0) ||
+        (len > 4 && file.compare(len - 4, 4, ".zip") == 0))
+        bytes *= 4;  // Typical compression ratio of text.
+    return bytes;
+}
+
+// Build a component NgramLM from each text or counts file concurrently.
+// A build starts once its estimated memory, added to that of the running
+// builds, fits within memoryBudget bytes (0 for no limit).  A build larger
+// than the budget runs only once no other build is running.
+static void BuildComponents(vector<mitlm::SharedPtr<mitlm::NgramLMBase> > &lms,
+                            const vector<string> &corpusFiles, bool fromText,
+                            size_t order, mitlm::CommandOptions &opts,
+                            vector<string> &smoothings,
+                            vector<string> &features,
+                            size_t memoryBudget) {
+    size_t numLMs = corpusFiles.size();
+    vector<size_t> costs(numLMs);
+    for (size_t i = 0; i < numLMs; i++) {
+        costs[i] = EstimateBuildMemory(corpusFiles[i], order);
+        if (memoryBudget != 0)
+            costs[i] = std::min(costs[i], memoryBudget);
+    }
+
+    std::mutex              mutex;
+    std::condition_variable released;
+    size_t                  nextLM = 0, memoryUsed = 0, numBuilt = 0;
+    vector<mitlm::SharedPtr<mitlm::NgramLMBase> > builtLMs(numLMs);
+    mitlm::ThreadPool::Run(numLMs, [&](size_t) {
+        // Claim the next component and wait for its memory to be available.
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            i = nextLM++;
+            released.wait(lock, [&]() {
+                return memoryBudget == 0 || memoryUsed == 0 ||
+                    memoryUsed + costs[i] <= memoryBudget;
+            });
+            memoryUsed += costs[i];
+        }
+
+        mitlm::Logger::Log(1, "Building component LM %s...\n",
+                           corpusFiles[i].c_str());
+        try {
+            mitlm::NgramLM *pLM = new mitlm::NgramLM(order);
+            builtLMs[i] = (mitlm::SharedPtr<mitlm::NgramLMBase>)pLM;
+            pLM->Initialize(opts["vocab"], mitlm::AsBoolean(opts["unk"]),
+                            fromText ? corpusFiles[i].c_str() : NULL,
+                            fromText ? NULL : corpusFiles[i].c_str(),
+                            mitlm::GetItem(smoothings, i),
+                            mitlm::GetItem(features, i));
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            memoryUsed -= costs[i];
+            released.notify_all();
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        memoryUsed -= costs[i];
+        released.notify_all();
+        mitlm::Logger::Log(1, "Built component LM %s (%lu/%lu).\n",
+                           corpusFiles[i].c_str(), ++numBuilt, numLMs);
+    });
+    lms.insert(lms.end(), builtLMs.begin(), builtLMs.end());
+}
+
 int main(int argc, char* argv[]) {
     // Parse command line options.
     char *footerDesc = new char[strlen(footerDesc_tmpl)+strlen(PACKAGE_STRING)+1+59];
@@ -96,12 +236,20 @@ int main(int argc, char* argv[]) {
     opts.AddOption("i,interpolation", "Specify interpolation mode.", "LI", "LI, CM, GLI");
     opts.AddOption("if,interpolation-features", "Specify interpolation features.", NULL, "features-template");
     opts.AddOption("tpo,tie-param-order", "Tie parameters across n-gram order.", "true", "boolean");
+    opts.AddOption("lazy,lazy-interpolation", "Linearly interpolate -lm components at query time without building a merged model.  Supports -p, -ep and -es.", "false", "boolean");
+    opts.AddOption("sm,stream-mix", "Linearly interpolate sorted ARPA -lm components with -p weights into the specified ARPA LM file, streaming the highest order n-grams and keeping only the explicit lower order n-grams of each component in memory.", NULL, "file");
+    opts.AddOption("sc,sparse-components", "Store only the explicit n-grams of -lm components, computing backed-off probabilities on demand.", "false", "boolean");
     opts.AddOption("tpl,tie-param-lm", "Tie parameters across LM components.", "false", "boolean");
     opts.AddOption("p,params", "Set initial model params.", NULL, "file");
-    opts.AddOption("oa,opt-alg", "Specify optimization algorithm.", "LBFGS", "Powell, LBFGS, LBFGSB");
+    opts.AddOption("oa,opt-alg", "Specify optimization algorithm.", "LBFGS", "Powell, LBFGS, LBFGSB, EM");
     opts.AddOption("op,opt-perp", "Tune params to minimize dev set perplexity.", NULL, "file");
+    opts.AddOption("pl,prune-lattices", "[SLS] Prune development lattice arcs with posterior probability below the specified threshold.", NULL, "float");
+    opts.AddOption("xl,expand-lattices", "[SLS] Expand nodes of development lattices reached with different n-gram histories.", "false", "boolean");
+    opts.AddOption("fla,fast-log-add", "[SLS] Sum development lattice scores for -pl with a faster approximate log-add.", "false", "boolean");
     opts.AddOption("ow,opt-wer", "Tune params to minimize lattice word error rate.", NULL, "file");
     opts.AddOption("om,opt-margin", "Tune params to minimize lattice margin.", NULL, "file");
+    opts.AddOption("pr,prune", "Prune n-grams whose removal increases perplexity by less than the specified relative threshold.", NULL, "float");
+    opts.AddOption("ps,prune-size", "Prune the least significant n-grams until at most the specified number of n-grams remain.", NULL, "int");
     opts.AddOption("wb,write-binary", "Write LM/counts files in binary format.", "false", "boolean");
     opts.AddOption("wp,write-params", "Write tuned model params to file.", NULL, "file");
     opts.AddOption("wv,write-vocab", "Write LM vocab to file.", NULL, "file");
@@ -109,6 +257,11 @@ int main(int argc, char* argv[]) {
     opts.AddOption("ep,eval-perp", "Compute test set perplexity.", NULL, "files");
     opts.AddOption("ew,eval-wer", "Compute test set lattice word error rate.", NULL, "files");
     opts.AddOption("em,eval-margin", "Compute test set lattice margin.", NULL, "files");
+    opts.AddOption("es,eval-sentences", "Compute log10 probability of each sentence in files.", NULL, "files");
+    opts.AddOption("esw,eval-sentence-words", "Also output log10 probability of each word with -es.", "false", "boolean");
+    opts.AddOption("ws,write-sentence-scores", "Write sentence log10 probabilities to file.", "-", "file");
+    opts.AddOption("threads", "Set number of worker threads (0 = number of cores).", "0", "int");
+    opts.AddOption("mem,memory-budget", "Limit concurrent -t/-c component builds to an estimated memory budget in MB (0 = unlimited).", "0", "int");
     if (!opts.ParseArguments(argc, (const char **)argv) ||
         opts["help"] != NULL) {
         std::cout << std::endl;
@@ -120,6 +273,49 @@ int main(int argc, char* argv[]) {
     size_t order = atoi(opts["order"]);
     bool writeBinary = mitlm::AsBoolean(opts["write-binary"]);
     mitlm::Logger::SetVerbosity(atoi(opts["verbose"]));
+    mitlm::ThreadPool::SetNumThreads(atoi(opts["threads"]));
+    bool lazyInterpolation = mitlm::AsBoolean(opts["lazy-interpolation"]);
+    bool sparseComponents = mitlm::AsBoolean(opts["sparse-components"]);
+    if (lazyInterpolation &&
+        (opts["text"] || opts["counts"] || sparseComponents ||
+         strcmp(opts["interpolation"], "LI") != 0 ||
+         opts["opt-perp"] || opts["opt-wer"] || opts["opt-margin"] ||
+         opts["write-params"] || opts["write-vocab"] || opts["write-lm"] ||
+         opts["eval-wer"] || opts["eval-margin"] ||
+         opts["prune"] || opts["prune-size"])) {
+        mitlm::Logger::Error(1, "-lazy-interpolation only supports -lm with "
+                             "LI, -p, -ep, and -es.\n");
+        exit(1);
+    }
+    if (opts["stream-mix"] &&
+        (!opts["lm"] || opts["text"] || opts["counts"] || opts["vocab"] ||
+         strcmp(opts["interpolation"], "LI") != 0 || lazyInterpolation ||
+         sparseComponents || writeBinary ||
+         opts["opt-perp"] || opts["opt-wer"] || opts["opt-margin"] ||
+         opts["write-params"] || opts["write-vocab"] || opts["write-lm"] ||
+         opts["eval-perp"] || opts["eval-wer"] || opts["eval-margin"] ||
+         opts["eval-sentences"] || opts["prune"] || opts["prune-size"])) {
+        mitlm::Logger::Error(1, "-stream-mix only supports -lm with LI and "
+                             "-p.\n");
+        exit(1);
+    }
+
+    // Interpolate ARPA LM files without loading their highest order n-grams.
+    if (opts["stream-mix"]) {
+        vector<string> lmFiles;
+        mitlm::trim_split(lmFiles, opts["lm"], ',');
+        mitlm::StreamingArpaMixer mixer(
+            order, mitlm::AsBoolean(opts["tie-param-order"]));
+        mixer.LoadLMs(lmFiles);
+        mitlm::ParamVector params(mixer.defParams());
+        if (opts["params"])
+            LoadParams(opts["params"], params);
+        mitlm::Logger::Log(1, "Mixing component LMs into %s...\n",
+                           opts["stream-mix"]);
+        mitlm::ZFile lmZFile(opts["stream-mix"], "w");
+        mixer.SaveLM(params, lmZFile);
+        return 0;
+    }
 
     // Read language models.
     vector<mitlm::SharedPtr<mitlm::NgramLMBase> > lms;
@@ -146,14 +342,8 @@ int main(int argc, char* argv[]) {
             exit(1);
         }
 
-        for (size_t i = 0; i < corpusFiles.size(); i++) {
-            mitlm::NgramLM *pLM = new mitlm::NgramLM(order);
-            pLM->Initialize(opts["vocab"], mitlm::AsBoolean(opts["unk"]),
-                            fromText ? corpusFiles[i].c_str() : NULL, 
-                            fromText ? NULL : corpusFiles[i].c_str(), 
-                            mitlm::GetItem(smoothings, i), mitlm::GetItem(features, i));
-            lms.push_back((mitlm::SharedPtr<mitlm::NgramLMBase>)pLM);
-        }
+        BuildComponents(lms, corpusFiles, fromText, order, opts, smoothings,
+                        features, (size_t)atoi(opts["memory-budget"]) << 20);
     }
 
     // Read component language model input files.
@@ -173,6 +363,7 @@ int main(int argc, char* argv[]) {
             }
             mitlm::ZFile lmZFile(lmFiles[l].c_str(), "r");
             pLM->LoadLM(lmZFile);
+            pLM->SetSparse(sparseComponents);
             lms.push_back((mitlm::SharedPtr<mitlm::NgramLMBase>)pLM);
             corpusFiles.push_back(lmFiles[l]);
         }
@@ -183,6 +374,23 @@ int main(int argc, char* argv[]) {
             exit(1);
     }
 
+    // Interpolate language models at query time.
+    if (lazyInterpolation) {
+        mitlm::Logger::Log(1, "Interpolating component LMs at query time...\n");
+        mitlm::LazyInterpolatedNgramLM lazyLM(
+            order, mitlm::AsBoolean(opts["tie-param-order"]));
+        lazyLM.LoadLMs(lms);
+        mitlm::ParamVector params(lazyLM.defParams());
+        if (opts["params"])
+            LoadParams(opts["params"], params);
+        lazyLM.Estimate(params);
+        if (opts["eval-perp"])
+            EvalPerplexity(lazyLM, opts);
+        if (opts["eval-sentences"])
+            EvalSentences(lazyLM, opts);
+        return 0;
+    }
+
     // Interpolate language models.
     mitlm::Logger::Log(1, "Interpolating component LMs...\n");
     if (mitlm::AsBoolean(opts["tie-param-order"]))
@@ -261,16 +469,8 @@ int main(int argc, char* argv[]) {
 
     // Estimate LM.
     mitlm::ParamVector params(ilm.defParams());
-    if (opts["params"]) {
-        mitlm::Logger::Log(1, "Loading parameters from %s...\n", opts["params"]);
-        mitlm::ZFile f(opts["params"], "r");
-        VerifyHeader(f, "Param");
-        ReadVector(f, params);
-        if (params.length() != ilm.defParams().length()) {
-            mitlm::Logger::Error(1, "Number of parameters mismatched.\n");
-            exit(1);
-        }
-    }
+    if (opts["params"])
+        LoadParams(opts["params"], params);
 
     mitlm::Optimization optAlg = mitlm::ToOptimization(opts["opt-alg"]);
     if (optAlg == mitlm::UnknownOptimization) {
@@ -301,6 +501,13 @@ int main(int argc, char* argv[]) {
                         opts["opt-margin"]);
             mitlm::ZFile devZFile(opts["opt-margin"]);
             mitlm::WordErrorRateOptimizer dev(ilm, order);
+            if (opts["prune-lattices"]) {
+                // Prune under the initial parameters.
+                ilm.Estimate(params);
+                dev.SetPruneThreshold(atof(opts["prune-lattices"]));
+            }
+            dev.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            dev.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             dev.LoadLattices(devZFile);
 
             mitlm::Logger::Log(1, "Optimizing %lu parameters...\n", params.length());
@@ -316,6 +523,13 @@ int main(int argc, char* argv[]) {
                         opts["opt-wer"]);
             mitlm::ZFile devZFile(opts["opt-wer"]);
             mitlm::WordErrorRateOptimizer dev(ilm, order);
+            if (opts["prune-lattices"]) {
+                // Prune under the initial parameters.
+                ilm.Estimate(params);
+                dev.SetPruneThreshold(atof(opts["prune-lattices"]));
+            }
+            dev.SetExpandHistories(mitlm::AsBoolean(opts["expand-lattices"]));
+            dev.SetFastLogAdd(mitlm::AsBoolean(opts["fast-log-add"]));
             dev.LoadLattices(devZFile);
 
             mitlm::Logger::Log(1, "Optimizing %lu parameters...\n", params.length());
@@ -325,8 +539,9 @@ int main(int argc, char* argv[]) {
     }
 
     // Estimate full model.
-    if (opts["write-lm"] || opts["eval-perp"] || 
-        opts["eval-margin"] || opts["eval-wer"]) {
+    bool prune = opts["prune"] || opts["prune-size"];
+    if (prune || opts["write-lm"] || opts["eval-perp"] ||
+        opts["eval-sentences"] || opts["eval-margin"] || opts["eval-wer"]) {
         mitlm::Logger::Log(1, "Estimating full n-gram model...\n");
         ilm.Estimate(params);
     }
@@ -343,6 +558,11 @@ int main(int argc, char* argv[]) {
         mitlm::ZFile vocabZFile(opts["write-vocab"], "w");
         ilm.SaveVocab(vocabZFile);
     }
+    if (prune) {
+        mitlm::Logger::Log(1, "Pruning LM...\n");
+        ilm.Prune(opts["prune"] ? atof(opts["prune"]) : 0,
+                  opts["prune-size"] ? atol(opts["prune-size"]) : 0);
+    }
     if (opts["write-lm"]) {
         mitlm::Logger::Log(1, "Saving LM to %s...\n", opts["write-lm"]);
         mitlm::ZFile lmZFile(opts["write-lm"], "w");
@@ -364,6 +584,8 @@ int main(int argc, char* argv[]) {
                         eval.ComputePerplexity(params));
         }
     }
+    if (opts["eval-sentences"])
+        EvalSentences(ilm, opts);
     if (opts["eval-margin"]) {
         mitlm::Logger::Log(0, "Margin Evaluations:\n");
         vector<string> evalFiles;
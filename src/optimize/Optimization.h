@@ -47,7 +47,8 @@ enum Optimization {
     UnknownOptimization,
     PowellOptimization,
     LBFGSOptimization,
-    LBFGSBOptimization
+    LBFGSBOptimization,
+    EMOptimization
 };
 
 inline Optimization ToOptimization(const char *optimization) {
@@ -57,6 +58,8 @@ inline Optimization ToOptimization(const char *optimization) {
         return LBFGSOptimization;
     if (strcmp(optimization, "LBFGSB") == 0)
         return LBFGSBOptimization;
+    if (strcmp(optimization, "EM") == 0)
+        return EMOptimization;
     return UnknownOptimization;
 }
 
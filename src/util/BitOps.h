@@ -36,6 +36,8 @@
 #ifndef BITOPS_H
 #define BITOPS_H
 
+#include <stdint.h>
+
 namespace mitlm {
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -96,6 +98,18 @@ static __inline__ bool isPowerOf2(unsigned long x)
 static __inline__ unsigned long nextPowerOf2(unsigned long x)
 { return 1UL << find_last_bit_set(x); }
 
+// Returns the number of bits set in x.
+static __inline__ unsigned int popcount64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (unsigned int)((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
 }
 
 #endif // BITOPS_H
@@ -81,7 +81,8 @@ CommandOptions::ParseArguments(int argc, const char **argv) {
             return false;
         }
         const char *value = "";
-        if (i < argc && argv[i][0] != '-')
+        // A lone '-' is a value naming standard input or output.
+        if (i < argc && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
             value = argv[i++];
         _values[iter->second] = value;
     }
@@ -38,7 +38,9 @@
 #include <stdint.h>
 #include <cmath>
 #include <cassert>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <stdexcept>
@@ -52,6 +54,7 @@ namespace mitlm {
 // Use date as version ID.
 #define MITLMv1a 0x20080901  // Bug: Vocab did not store length
 #define MITLMv1 0x20081201
+#define MITLMv2 0x20261018  // Memory-mappable layout with hash tables
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -200,6 +203,154 @@ inline void VerifyHeader(FILE *inFile, const char *header) {
     ReadAlignPad(inFile, len);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The following functions read data written by the Write* functions in place
+// from a memory-mapped file, advancing p past the data.
+
+inline char *MapBytes(char *&p, const char *end, size_t len) {
+    size_t padLen = (len + 7) & ~(size_t)7;
+    if (p + padLen > end)
+        throw std::runtime_error("Read failed.");
+    char *data = p;
+    p += padLen;
+    return data;
+}
+
+inline uint64_t MapUInt64(char *&p, const char *end) {
+    return *reinterpret_cast<uint64_t *>(MapBytes(p, end, sizeof(uint64_t)));
+}
+
+inline void MapString(char *&p, const char *end, std::string &str) {
+    size_t len = MapUInt64(p, end);
+    str.assign(MapBytes(p, end, len), len);
+}
+
+inline bool MatchHeader(char *&p, const char *end, const char *header) {
+    size_t len = strlen(header);
+    size_t padLen = (len + 7) & ~(size_t)7;
+    if (p + padLen > end || strncmp(p, header, len) != 0 ||
+        (len < padLen && p[len] != 0))
+        return false;
+    p += padLen;
+    return true;
+}
+
+inline void MapHeader(char *&p, const char *end, const char *header) {
+    if (!MatchHeader(p, end, header))
+        throw std::runtime_error("Invalid file format.");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The following functions parse and format the decimal values found in ARPA
+// files.
+
+// Parses a floating point number at p, advancing p past it.  Plain decimals
+// with up to 15 significant digits are converted exactly, as strtod would.
+// Exponents, special values, and longer mantissas fall back to strtod.
+inline double ParseDouble(const char *&p) {
+    static const double kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char *begin = p;
+    const char *q     = p;
+    bool        neg   = (*q == '-');
+    if (*q == '-' || *q == '+') ++q;
+    uint64_t mantissa  = 0;
+    int      numDigits = 0;
+    int      numFrac   = 0;
+    const char *digits = q;
+    while ((unsigned)(*q - '0') < 10)
+        mantissa = mantissa * 10 + (*q++ - '0');
+    numDigits = q - digits;
+    if (*q == '.') {
+        digits = ++q;
+        while ((unsigned)(*q - '0') < 10)
+            mantissa = mantissa * 10 + (*q++ - '0');
+        numFrac = q - digits;
+        numDigits += numFrac;
+    }
+    if (numDigits == 0 || numDigits > 15 || *q == 'e' || *q == 'E' ||
+        (*q != 0 && !isspace((unsigned char)*q))) {
+        char *end;
+        double x = strtod(begin, &end);
+        p = end;
+        return x;
+    }
+    p = q;
+    double x = (double)mantissa / kPow10[numFrac];
+    return neg ? -x : x;
+}
+
+inline double ParseDouble(char *&p) {
+    const char *q = p;
+    double      x = ParseDouble(q);
+    p = const_cast<char *>(q);
+    return x;
+}
+
+// Returns 10^x, bit-identical to std::pow(10.0, x).  Integer exponents, such
+// as the common zero log backoff weights, are looked up in a table of powers
+// computed with std::pow.  Other exponents call std::pow, since scaling a
+// table entry by exp() of the fraction is not correctly rounded and would
+// change the probabilities loaded from ARPA files.
+inline double Pow10(double x) {
+    static const int kMinExp = -340, kMaxExp = 308;
+    struct Table {
+        double values[kMaxExp - kMinExp + 1];
+        Table() {
+            for (int i = kMinExp; i <= kMaxExp; ++i)
+                values[i - kMinExp] = std::pow(10.0, i);
+        }
+    };
+    static const Table table;
+    if (x == std::floor(x) && x >= kMinExp && x <= kMaxExp)
+        return table.values[(int)x - kMinExp];
+    return std::pow(10.0, x);
+}
+
+// Formats x with the given number of decimal digits (at most 9) into buf, as
+// snprintf with "%.*f" would, and returns the length.  Large values, and
+// values within rounding error of a tie, fall back to snprintf.
+inline int FormatFixed(char *buf, size_t bufSize, double x, int digits) {
+    static const double kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    assert(digits >= 0 && digits <= 9);
+    double y     = std::fabs(x) * kPow10[digits];
+    double whole = std::floor(y);
+    if (!(y < 1e9) || std::fabs(y - whole - 0.5) < 1e-6 || bufSize < 24)
+        return snprintf(buf, bufSize, "%.*f", digits, x);
+    uint64_t n = (uint64_t)whole + (y - whole > 0.5);
+
+    // Write digits in reverse order.
+    char str[24];
+    int  len = 0;
+    for (int i = 0; i < digits; ++i, n /= 10)
+        str[len++] = '0' + n % 10;
+    if (digits > 0)
+        str[len++] = '.';
+    do {
+        str[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    if (std::signbit(x))
+        str[len++] = '-';
+    for (int i = 0; i < len; ++i)
+        buf[i] = str[len - 1 - i];
+    buf[len] = '\0';
+    return len;
+}
+
+// Appends the log10 probability of an ARPA LM entry, or -99 for 0.
+inline void sprint_LProb(std::string &buf, double prob) {
+    if (prob == 0) {
+        buf.append("-99");
+    } else {
+        char str[32];
+        buf.append(str, FormatFixed(str, sizeof(str), std::log10(prob), 6));
+    }
+}
+
 }
 
 #endif // FASTIO_H
@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if !( defined(WIN32) || defined(_WIN32) ) || defined(__CYGWIN__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+#include "ZFile.h"
+#include "MappedFile.h"
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool IsCompressed(const char *filename) {
+    static const char *suffixes[] = { ".gz", ".bz2", ".zip" };
+    size_t len = strlen(filename);
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        size_t suffixLen = strlen(suffixes[i]);
+        if (len >= suffixLen &&
+            strcmp(&filename[len - suffixLen], suffixes[i]) == 0)
+            return true;
+    }
+    return strcmp(filename, "-") == 0;
+}
+
+MappedFile::MappedFile(const char *filename)
+    : _data(NULL), _size(0), _mapped(false) {
+#ifdef HAVE_MMAP
+    if (!IsCompressed(filename)) {
+        int fd = open(filename, O_RDONLY | O_BINARY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                _data   = static_cast<char *>(p);
+                _size   = st.st_size;
+                _mapped = true;
+            }
+        }
+        close(fd);
+        if (_mapped)
+            return;
+    }
+#endif
+
+    // Read the entire file into memory.
+    ZFile file(filename, "r");
+    _ReadAll(file);
+}
+
+// Reads the rest of a stream that cannot be reopened, such as standard input,
+// into memory after the headerSize bytes already read from it.
+MappedFile::MappedFile(FILE *file, const void *header, size_t headerSize)
+    : _data(NULL), _size(0), _mapped(false) {
+    _data = static_cast<char *>(malloc(headerSize));
+    if (_data == NULL)
+        throw std::runtime_error("Out of memory.");
+    memcpy(_data, header, headerSize);
+    _size = headerSize;
+    _ReadAll(file);
+}
+
+// Appends the remaining contents of file to _data.
+void
+MappedFile::_ReadAll(FILE *file) {
+    size_t capacity = std::max(_size, (size_t)1 << 20);
+    _data = static_cast<char *>(realloc(_data, capacity));
+    size_t len;
+    while (_data && (len = fread(_data + _size, 1, capacity - _size, file))) {
+        _size += len;
+        if (_size == capacity)
+            _data = static_cast<char *>(realloc(_data, capacity *= 2));
+    }
+    if (_data == NULL)
+        throw std::runtime_error("Out of memory.");
+}
+
+MappedFile::~MappedFile() {
+#ifdef HAVE_MMAP
+    if (_mapped) {
+        munmap(_data, _size);
+        return;
+    }
+#endif
+    free(_data);
+}
+
+}
@@ -1,6 +1,5 @@
 ////////////////////////////////////////////////////////////////////////////
 // Copyright (c) 2008, Massachusetts Institute of Technology              //
-// Copyright (c) 2013, Giulio Paci <giuliopaci@gmail.com>                 //
 // All rights reserved.                                                   //
 //                                                                        //
 // Redistribution and use in source and binary forms, with or without     //
@@ -33,23 +32,42 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
 ////////////////////////////////////////////////////////////////////////////
 
-#include "Logger.h"
-#include "RefCounter.h"
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdio>
 
 namespace mitlm {
 
 ////////////////////////////////////////////////////////////////////////////////
+// MappedFile maps the contents of a file into memory.  Uncompressed files are
+// mapped privately with mmap, so that pages are loaded on demand and shared
+// with other processes mapping the same file.  Compressed files, and systems
+// without mmap, fall back to reading the entire file into memory.  The data
+// is 8-byte aligned and writable, but changes are never written to the file.
+//
+class MappedFile {
+protected:
+    char * _data;
+    size_t _size;
+    bool   _mapped;
 
-_RefCounter RefCounter;
+public:
+    MappedFile(const char *filename);
+    MappedFile(FILE *file, const void *header, size_t headerSize);
+    ~MappedFile();
 
-_RefCounter::~_RefCounter() {
-    if (!_map.empty()) {
-        Logger::Error(1, "-- RefCounter----------\n");
-	unordered_map<const void*, int>::const_iterator it;
-        for (it = _map.begin(); it != _map.end(); ++it)
-            Logger::Error(1, "map[%p] = %i\n", (void *)it->first, it->second);
-        Logger::Error(1, "-----------------------\n\n");
-    }
-}
+    char * data() const { return _data; }
+    size_t size() const { return _size; }
+    bool   mapped() const { return _mapped; }
+
+private:
+    void _ReadAll(FILE *file);
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
 
 }
+
+#endif // MAPPEDFILE_H
@@ -36,42 +36,33 @@
 #ifndef REFCOUNTER_H
 #define REFCOUNTER_H
 
-#ifdef HAVE_TR1_UNORDERED_MAP
-#include <tr1/unordered_map>
-using std::tr1::unordered_map;
-#else
-#include <unordered_map>
-using std::unordered_map;
-#endif
+#include <atomic>
 
 namespace mitlm {
 
 ////////////////////////////////////////////////////////////////////////////////
+// RefCount tracks the number of extra owners of a block of storage, so a new
+// count of 0 means a single owner.  Owners may attach and detach concurrently
+// from multiple threads without a shared lock.
 
-class _RefCounter
+class RefCount
 {
 public:
-    ~_RefCounter();
+    RefCount() : _count(0) { }
 
-    template <typename T> void attach(const T *referenced)
-    { ++_map[reinterpret_cast<const void*>(referenced)]; }
+    void attach() { _count.fetch_add(1, std::memory_order_relaxed); }
 
-    template <typename T> bool detach(const T *referenced) {
-        const void* addr = reinterpret_cast<const void*>(referenced);
-        if (_map.find(addr)==_map.end())
-            return true;
-        if (--_map[addr] == -1) {
-            _map.erase(addr);
-            return true;
-        }
-        return false;
+    // Returns true if the caller was the last owner and should free storage.
+    bool detach() {
+        return _count.fetch_sub(1, std::memory_order_acq_rel) == 0;
     }
 
 private:
-    unordered_map<const void*, int> _map;
-};
+    RefCount(const RefCount &);
+    RefCount &operator=(const RefCount &);
 
-extern _RefCounter RefCounter;
+    std::atomic<int> _count;
+};
 
 }
 
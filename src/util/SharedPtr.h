@@ -42,22 +42,31 @@ namespace mitlm {
 template <typename T>
 class SharedPtr {
 protected:
-    T *_p;
+    T        *_p;
+    RefCount *_refs;
+
+    void _release() {
+        if (_p != NULL && _refs->detach()) { delete _p; delete _refs; }
+    }
 
 public:
-    explicit SharedPtr(T *p = NULL) : _p(p) { }
-    SharedPtr(const SharedPtr<T> &p) : _p(p._p)
-    { if (_p != NULL) RefCounter.attach(_p); }
-    ~SharedPtr() { if (_p != NULL && RefCounter.detach(_p)) delete _p; }
+    explicit SharedPtr(T *p = NULL)
+        : _p(p), _refs(p != NULL ? new RefCount() : NULL) { }
+    SharedPtr(const SharedPtr<T> &p) : _p(p._p), _refs(p._refs)
+    { if (_p != NULL) _refs->attach(); }
+    ~SharedPtr() { _release(); }
 
     SharedPtr<T> &operator=(T *p) {
-        if (_p != NULL && RefCounter.detach(_p)) delete _p;
+        _release();
         _p = p;
+        _refs = (p != NULL) ? new RefCount() : NULL;
         return *this;
     }
     SharedPtr<T> &operator=(const SharedPtr<T> &p) {
-        if (_p != NULL && RefCounter.detach(_p)) delete _p;
-        if ((_p = p._p) != NULL) RefCounter.attach(_p);
+        if (p._p != NULL) p._refs->attach();
+        _release();
+        _p = p._p;
+        _refs = p._refs;
         return *this;
     }
 
@@ -0,0 +1,214 @@
+////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2008, Massachusetts Institute of Technology              //
+// All rights reserved.                                                   //
+//                                                                        //
+// Redistribution and use in source and binary forms, with or without     //
+// modification, are permitted provided that the following conditions are //
+// met:                                                                   //
+//                                                                        //
+//     * Redistributions of source code must retain the above copyright   //
+//       notice, this list of conditions and the following disclaimer.    //
+//                                                                        //
+//     * Redistributions in binary form must reproduce the above          //
+//       copyright notice, this list of conditions and the following      //
+//       disclaimer in the documentation and/or other materials provided  //
+//       with the distribution.                                           //
+//                                                                        //
+//     * Neither the name of the Massachusetts Institute of Technology    //
+//       nor the names of its contributors may be used to endorse or      //
+//       promote products derived from this software without specific     //
+//       prior written permission.                                        //
+//                                                                        //
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS    //
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT      //
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  //
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT   //
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,  //
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT       //
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,  //
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY  //
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT    //
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE  //
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.   //
+////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+
+namespace mitlm {
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+class Pool {
+    std::mutex               _runMutex;
+    std::mutex               _mutex;
+    std::condition_variable  _wake;
+    std::condition_variable  _finished;
+    std::vector<std::thread> _threads;
+    size_t                   _numThreads;
+    const ThreadPool::Task * _task;
+    size_t                   _numTasks;
+    std::atomic<size_t>      _nextTask;
+    size_t                   _numActive;
+    size_t                   _generation;
+    bool                     _stop;
+    std::exception_ptr       _error;
+
+    void _StopThreads();
+    void _ThreadMain(size_t generation);
+    void _Work();
+
+public:
+    Pool() : _numThreads(0), _task(NULL), _numTasks(0), _nextTask(0),
+             _numActive(0), _generation(0), _stop(false) { }
+    ~Pool() { _StopThreads(); }
+
+    void   SetNumThreads(size_t numThreads);
+    size_t GetNumThreads() const;
+    void   Run(size_t numTasks, const ThreadPool::Task &task);
+};
+
+// Set while the current thread is executing a task, to serialize nested Run().
+thread_local bool inTask = false;
+
+Pool &
+GetPool() {
+    static Pool pool;
+    return pool;
+}
+
+void
+Pool::SetNumThreads(size_t numThreads) {
+    std::lock_guard<std::mutex> runLock(_runMutex);
+    if (numThreads != _numThreads) {
+        _StopThreads();
+        _numThreads = numThreads;
+    }
+}
+
+size_t
+Pool::GetNumThreads() const {
+    if (_numThreads == 0)
+        return std::max(1u, std::thread::hardware_concurrency());
+    return _numThreads;
+}
+
+void
+Pool::Run(size_t numTasks, const ThreadPool::Task &task) {
+    size_t numThreads = std::min(GetNumThreads(), numTasks);
+    std::unique_lock<std::mutex> runLock(_runMutex, std::defer_lock);
+    if (numThreads <= 1 || inTask || !runLock.try_lock()) {
+        for (size_t i = 0; i < numTasks; ++i)
+            task(i);
+        return;
+    }
+
+    // Start worker threads on first use.  The caller acts as one of them.
+    while (_threads.size() + 1 < GetNumThreads())
+        _threads.push_back(std::thread(&Pool::_ThreadMain, this, _generation));
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _task      = &task;
+        _numTasks  = numTasks;
+        _nextTask  = 0;
+        _numActive = _threads.size();
+        _error     = std::exception_ptr();
+        ++_generation;
+    }
+    _wake.notify_all();
+    _Work();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _finished.wait(lock, [this]() { return _numActive == 0; });
+    _task = NULL;
+    if (_error) {
+        std::exception_ptr error = _error;
+        _error = std::exception_ptr();
+        std::rethrow_exception(error);
+    }
+}
+
+void
+Pool::_StopThreads() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (size_t i = 0; i < _threads.size(); ++i)
+        _threads[i].join();
+    _threads.clear();
+    _stop = false;
+}
+
+void
+Pool::_ThreadMain(size_t generation) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this, generation]() {
+                return _stop || _generation != generation;
+            });
+            if (_stop) return;
+            generation = _generation;
+        }
+        _Work();
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_numActive == 0)
+            _finished.notify_all();
+    }
+}
+
+void
+Pool::_Work() {
+    inTask = true;
+    size_t i;
+    while ((i = _nextTask++) < _numTasks) {
+        try {
+            (*_task)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_error)
+                _error = std::current_exception();
+            _nextTask = _numTasks;  // Skip remaining tasks.
+        }
+    }
+    inTask = false;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void
+ThreadPool::SetNumThreads(size_t numThreads) {
+    GetPool().SetNumThreads(numThreads);
+}
+
+size_t
+ThreadPool::GetNumThreads() {
+    return GetPool().GetNumThreads();
+}
+
+void
+ThreadPool::Run(size_t numTasks, const Task &task) {
+    GetPool().Run(numTasks, task);
+}
+
+size_t
+ThreadPool::NumChunks(size_t length, size_t minChunkSize) {
+    size_t maxChunks = 4 * GetNumThreads();
+    size_t numChunks = length / std::max(minChunkSize, (size_t)1);
+    return std::max(std::min(numChunks, maxChunks), (size_t)1);
+}
+
+}
@@ -38,6 +38,7 @@
 #define ZFILE_H
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <cstdio>
 #include <string>
 #include <cstring>
@@ -196,6 +197,10 @@ public:
             _file = (_mode[0] == 'r') ?
                 processOpen(std::string(EXEC_TOKEN "unzip -c ") + popen_escape2(_filename), mode) :
                 processOpen(std::string(EXEC_TOKEN "zip -q > ") + popen_escape(_filename), mode);
+        } else if (_filename == "-") {
+            // Duplicate stdin/stdout so that closing _file leaves it open.
+            _file = fdopen(dup(fileno((_mode[0] == 'r') ? stdin : stdout)),
+                           mode);
         } else { // Assume uncompressed
             _file = fopen(_filename.c_str(), mode);
         }
@@ -204,6 +209,7 @@ public:
     }
 
     operator FILE *() const { return _file; }
+    const char *filename() const { return _filename.c_str(); }
 };
 
 }
@@ -41,6 +41,7 @@
 #include "VectorClosures.h"
 #include "Range.h"
 #include "Traits.h"
+#include "util/RefCounter.h"
 
 namespace mitlm {
 
@@ -98,6 +99,7 @@ public:
     void swap(DenseVector<T> &v);
     void set(T value);
     void attach(const DenseVector<T> &v);
+    void attach(T *data, size_t length);
     template <typename Compare> bool sort(Compare compare);
 
     size_t        length() const { return _length; }
@@ -109,13 +111,21 @@ public:
     T *           data()         { return _data; }
 
 private:
-    DenseVector(size_t length, T *data, void *storage);
+    // Element offset past the RefCount, kept aligned for any element type.
+    static const size_t _HeaderSize =
+        (sizeof(RefCount) + sizeof(double) - 1) / sizeof(double) *
+        sizeof(double);
+    static T *_Payload(RefCount *storage)
+    { return reinterpret_cast<T *>(reinterpret_cast<char *>(storage) +
+                                   _HeaderSize); }
+
+    DenseVector(size_t length, T *data, RefCount *storage);
     void _allocate();
     void _release();
 
-    size_t _length;
-    T *    _data;
-    void * _storage;
+    size_t     _length;
+    T *        _data;
+    RefCount * _storage;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -140,6 +150,9 @@ void WriteVector(FILE *out, const DenseVector<T> &x);
 template <typename T>
 void ReadVector(FILE *in, DenseVector<T> &x);
 
+template <typename T>
+void MapVector(char *&p, const char *end, DenseVector<T> &x);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 }
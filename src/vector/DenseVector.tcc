@@ -34,7 +34,7 @@
 
 #include <cassert>
 #include <algorithm>
-#include "util/RefCounter.h"
+#include <new>
 #include "util/Logger.h"
 #include "util/FastIO.h"
 
@@ -44,17 +44,18 @@ namespace mitlm {
 
 // data == NULL
 //   Empty zero-length vector.
-// data != NULL && storage == _data
+// data != NULL && data == _Payload(storage)
 //   Regular vector.  Could also be a prefix view.
 //   AddRefCount on copy construct.
 //   ReleaseRefCount/Free on detach.
-// data != NULL && storage != _data
+// data != NULL && data != _Payload(storage)
 //   View into another DenseVector.
 //   AddRefCount on attach.
 //   ReleaseRefCount/Free on detach.
 // data != NULL && storage == NULL
 //   View into memory managed elsewhere.
 //   No specific action on attach or detach.
+// The RefCount sits in front of the elements in the same allocation.
 
 template <typename T>
 DenseVector<T>::DenseVector(size_t length)
@@ -86,7 +87,7 @@ DenseVector<T>::DenseVector(const DenseVector<T> &rhs)
     : _length(rhs._length), _data(rhs._data), _storage(rhs._storage)
 {
     if (_storage)
-        RefCounter.attach(_storage);
+        _storage->attach();
 }
 
 template <typename T>
@@ -108,11 +109,11 @@ DenseVector<T>::DenseVector(const Vector<RHS> &rhs)
 }
 
 template <typename T>
-DenseVector<T>::DenseVector(size_t length, T *data, void *storage)
+DenseVector<T>::DenseVector(size_t length, T *data, RefCount *storage)
     : _length(length), _data(data), _storage(storage)
 {
     if (_storage)
-        RefCounter.attach(_storage);
+        _storage->attach();
 }
 
 template <typename T>
@@ -310,7 +311,7 @@ void
 DenseVector<T>::reset(size_t length)
 {
     if (length != _length) {
-        assert(_data == _storage);
+        assert(_storage == NULL || _data == _Payload(_storage));
         _release();
         _length = length;
         _allocate();
@@ -330,7 +331,7 @@ void
 DenseVector<T>::resize(size_t length)
 {
     if (length != _length) {
-        assert(_data == _storage);
+        assert(_storage == NULL || _data == _Payload(_storage));
         DenseVector<T> v(length);
         Copy(begin(), v.begin(), v.begin() + std::min(length, _length));
         swap(v);
@@ -342,7 +343,7 @@ void
 DenseVector<T>::resize(size_t length, T value)
 {
     if (length != _length) {
-        assert(_data == _storage);
+        assert(_storage == NULL || _data == _Payload(_storage));
         DenseVector<T> v(length);
         Copy(begin(), v.begin(), v.begin() + std::min(length, _length));
         if (length > _length)
@@ -377,7 +378,18 @@ DenseVector<T>::attach(const DenseVector<T> &rhs)
     _data    = rhs._data;
     _storage = rhs._storage;
     if (_storage)
-        RefCounter.attach(_storage);
+        _storage->attach();
+}
+
+// Attach to memory managed elsewhere, such as a memory-mapped file.
+template <typename T>
+void
+DenseVector<T>::attach(T *data, size_t length)
+{
+    _release();
+    _length  = length;
+    _data    = data;
+    _storage = NULL;
 }
 
 template <typename T>
@@ -386,8 +398,8 @@ bool
 DenseVector<T>::sort(Compare compare) {
     // Return true if vector has been modified.
     // Perform quicksort only if array is not already sorted.
-    for (size_t i = 0; i < _length - 1; ++i) {
-        if (compare(_data[i], _data[i + 1]) > 0) {
+    for (size_t i = 1; i < _length; ++i) {
+        if (compare(_data[i], _data[i - 1])) {
             std::sort(begin(), end(), compare);
             return true;
         }
@@ -404,8 +416,10 @@ DenseVector<T>::_allocate()
     assert(!_data && !_storage);
     if (length() == 0)
         return;
-    _storage = _data = static_cast<T *>(malloc(_length * sizeof(T)));
-    assert(_data);
+    void *block = malloc(_HeaderSize + _length * sizeof(T));
+    assert(block);
+    _storage = new (block) RefCount();
+    _data    = _Payload(_storage);
 }
 
 template <typename T>
@@ -413,10 +427,11 @@ void
 DenseVector<T>::_release()
 {
     if (_storage) {
-         if (RefCounter.detach(_storage)) {
-             if (_storage != _data)
+         if (_storage->detach()) {
+             if (_data != _Payload(_storage))
                  Logger::Warn(2, "DenseVector: Released by view.\n");
              fflush(stdout);
+             _storage->~RefCount();
              free(_storage);
          }
          _storage = NULL;
@@ -466,4 +481,13 @@ ReadVector(FILE *in, DenseVector<T> &x) {
     ReadAlignPad(in, x.length() * sizeof(T));
 }
 
+// Attach x to the vector written by WriteVector at p and advance p past it.
+template <typename T>
+void
+MapVector(char *&p, const char *end, DenseVector<T> &x) {
+    size_t length = MapUInt64(p, end);
+    x.attach(reinterpret_cast<T *>(MapBytes(p, end, length * sizeof(T))),
+             length);
+}
+
 }
\ No newline at end of file
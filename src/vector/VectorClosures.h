@@ -37,6 +37,7 @@
 
 #include <cassert>
 #include "Operations.h"
+#include "Scalar.h"
 #include "Vector.h"
 #include "Traits.h"
 
@@ -152,6 +153,21 @@ struct TypeInfo<UnaryVectorClosure<OpInt, V> > {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Returns the length of a binary closure.  Scalars repeat to the length of
+// the other operand, which may be empty.
+template <typename L, typename R>
+inline size_t ClosureLength(const L &l, const R &r)
+{ return std::max(l.length(), r.length()); }
+template <typename T, typename R>
+inline size_t ClosureLength(const Scalar<T> &, const R &r)
+{ return r.length(); }
+template <typename L, typename T>
+inline size_t ClosureLength(const L &l, const Scalar<T> &)
+{ return l.length(); }
+template <typename T, typename U>
+inline size_t ClosureLength(const Scalar<T> &, const Scalar<U> &)
+{ return 1; }
+
 template <typename Op, typename L, typename R>
 class VectorClosure : public Vector<VectorClosure<Op, L, R> > {
     typedef VectorClosure<Op, L, R> SelfT;
@@ -176,7 +192,7 @@ public:
 
     VectorClosure(typename Ref<L>::Type l, typename Ref<R>::Type r)
       : _l(l.impl()), _r(r.impl()) { }
-    size_t length() const       { return std::max(_l.length(), _r.length()); }
+    size_t length() const       { return ClosureLength(_l, _r); }
     ConstIterator begin() const { return ConstIterator(_l.begin(),_r.begin()); }
     ConstIterator end() const   { return ConstIterator(_l.end(), _r.end()); }
     ElementType   operator[](size_t i) const { return Op::Eval(_l[i], _r[i]); }